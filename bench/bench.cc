@@ -0,0 +1,326 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <new>
+#include "../mounted_devices.h"
+#include "../exception.h"
+#include "../devtree.h"
+#include "../endian.h"
+#include "../util.h"
+using namespace std;
+using namespace letterman;
+
+// Measures listing a large hive with both backends: time and number of
+// allocations (made through operator new; hivex's own mallocs are not
+// counted) for opening and listing, and for resolving the mappings
+// against a replayed device table.
+//
+//   letterman-bench [volumes] [devices] [iterations]
+
+static atomic<unsigned long> allocations(0);
+
+void* operator new(size_t size)
+{
+	++allocations;
+	void* p = malloc(size ? size : 1);
+	if (!p) throw bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace {
+	typedef chrono::steady_clock Clock;
+
+	// Mappings with a drive letter; all others are volumes
+	const unsigned kLetters = 20;
+
+	void put32(string& buf, size_t pos, uint32_t value)
+	{
+		value = htole32(value);
+		memcpy(&buf[pos], &value, 4);
+	}
+
+	// Appends an allocated cell to a hive bin, and returns its offset
+	uint32_t addCell(string& bin, const string& data)
+	{
+		uint32_t offset = bin.size();
+		size_t size = (data.size() + 4 + 7) / 8 * 8;
+
+		bin.append(size, 0);
+		put32(bin, offset, -int32_t(size));
+		memcpy(&bin[offset + 4], data.data(), data.size());
+
+		return offset;
+	}
+
+	string nk(const string& name, uint16_t flags, uint32_t parent)
+	{
+		string cell(0x4c, 0);
+		memcpy(&cell[0], "nk", 2);
+		cell[0x02] = char(flags);
+		put32(cell, 0x10, parent);
+		put32(cell, 0x1c, 0xffffffff);
+		put32(cell, 0x28, 0xffffffff);
+		put32(cell, 0x2c, 0xffffffff);
+		put32(cell, 0x30, 0xffffffff);
+		cell[0x48] = char(name.size());
+		return cell + name;
+	}
+
+	string mbrValue(uint32_t disk, uint64_t offset)
+	{
+		string data(12, 0);
+		disk = htole32(disk);
+		offset = htole64(offset);
+		memcpy(&data[0], &disk, 4);
+		memcpy(&data[4], &offset, 8);
+		return data;
+	}
+
+	string vk(const string& name, uint32_t dataSize, uint32_t data)
+	{
+		string cell(0x14, 0);
+		memcpy(&cell[0], "vk", 2);
+		cell[0x02] = char(name.size());
+		put32(cell, 0x04, dataSize);
+		put32(cell, 0x08, data);
+		put32(cell, 0x0c, 3); // REG_BINARY
+		cell[0x10] = 1; // ASCII name
+		return cell + name;
+	}
+
+	// Writes a hive whose MountedDevices key holds letters C: onwards,
+	// followed by volumes, all on MBR disks. Only the letters are listed.
+	void writeHive(const string& filename, unsigned volumes)
+	{
+		const string name("MountedDevices");
+		string bin(0x20, 0);
+		vector<uint32_t> values;
+
+		auto addValue = [&] (const string& name, const string& data) {
+			uint32_t offset = addCell(bin, data);
+			values.push_back(addCell(bin, vk(name, data.size(), offset)));
+		};
+
+		for (unsigned i = 0; i != kLetters; ++i) {
+			addValue(string("\\DosDevices\\") + char('C' + i) + ":",
+					mbrValue(0x10000000 + i, 1024 * 1024));
+		}
+
+		for (unsigned i = 0; i != volumes; ++i) {
+			char name[64];
+			snprintf(name, sizeof(name),
+					"\\??\\Volume{%08X-0000-0000-0000-000000000000}", i);
+			addValue(name, mbrValue(0x20000000 + i, 1024 * 1024));
+		}
+
+		string list(values.size() * 4, 0);
+		for (size_t i = 0; i != values.size(); ++i) {
+			put32(list, i * 4, values[i]);
+		}
+
+		uint32_t root = addCell(bin, nk("ROOT", 0x2c, 0));
+
+		string key(nk(name, 0x20, root));
+		put32(key, 0x24, values.size());
+		put32(key, 0x28, addCell(bin, list));
+		put32(key, 0x3c, 128);
+		put32(key, 0x40, 12);
+		uint32_t keyOffset = addCell(bin, key);
+
+		uint32_t hash = 0;
+		for (char c : name) hash = hash * 37 + toupper(c);
+
+		string lh("lh\1\0", 4);
+		lh.append(8, 0);
+		put32(lh, 4, keyOffset);
+		put32(lh, 8, hash);
+
+		put32(bin, root + 4 + 0x14, 1);
+		put32(bin, root + 4 + 0x1c, addCell(bin, lh));
+
+		// The rest of the bin is a free cell
+		size_t used = bin.size();
+		size_t binSize = (used + 8 + 0xfff) / 0x1000 * 0x1000;
+		bin.resize(binSize, 0);
+		put32(bin, used, binSize - used);
+
+		memcpy(&bin[0], "hbin", 4);
+		put32(bin, 8, binSize);
+
+		string base(0x1000, 0);
+		memcpy(&base[0], "regf", 4);
+		put32(base, 0x04, 1);
+		put32(base, 0x08, 1);
+		put32(base, 0x14, 1);
+		put32(base, 0x18, 5);
+		put32(base, 0x20, 1);
+		put32(base, 0x24, root);
+		put32(base, 0x28, binSize);
+		put32(base, 0x2c, 1);
+
+		uint32_t sum = 0;
+		for (size_t i = 0; i != 0x1fc; i += 4) {
+			uint32_t v;
+			memcpy(&v, &base[i], 4);
+			sum ^= le32toh(v);
+		}
+		put32(base, 0x1fc, sum == 0 ? 1 : sum == 0xffffffff ? 0xfffffffe : sum);
+
+		ofstream out(filename.c_str(), ios::binary);
+		out << base << bin;
+		if (!out) throw ErrnoException("write: " + filename);
+	}
+
+	// A recording of disks with one partition each; the first ones
+	// hold the drive letters.
+	void writeDevices(const string& filename, unsigned disks)
+	{
+		ofstream out(filename.c_str());
+		out << "letterman-devtree 1\n";
+
+		for (unsigned i = 0; i != disks; ++i) {
+			char id[9];
+			snprintf(id, sizeof(id), "%08x", 0x10000000 + i);
+			string name("bench" + util::toString(i));
+			string diskId("8:" + util::toString(i * 16));
+
+			out << "disk " << name << "\n"
+				<< "\t" << DevTree::kPropDeviceReadable << " /dev/" << name << "\n"
+				<< "\t" << DevTree::kPropMbrId << " " << id << "\n"
+				<< "\t" << DevTree::kPropDiskId << " " << diskId << "\n"
+				<< "partition " << name << "p1\n"
+				<< "\t" << DevTree::kPropDeviceReadable << " /dev/" << name << "p1\n"
+				<< "\t" << DevTree::kPropPartOffsetBlocks << " 2048\n"
+				<< "\t" << DevTree::kPropDiskId << " " << diskId << "\n";
+		}
+
+		if (!out) throw ErrnoException("write: " + filename);
+	}
+
+	double elapsedMs(Clock::time_point start, unsigned iterations)
+	{
+		return chrono::duration<double, milli>(Clock::now() - start).count()
+			/ iterations;
+	}
+
+	void printRow(const string& label, double ms, unsigned long allocs)
+	{
+		cout << setw(16) << left << label << right << setw(12) << fixed
+			<< setprecision(3) << ms << setw(12) << allocs << endl;
+	}
+
+	// Opens the hive and lists it, as a letterman process would
+	void benchBackend(const char* label, MountedDevices::Backend backend,
+			const string& hive, unsigned iterations)
+	{
+		MountedDevices::setBackend(backend);
+
+		try {
+			unsigned long before = allocations;
+			Clock::time_point start = Clock::now();
+			size_t listed = 0;
+
+			for (unsigned i = 0; i != iterations; ++i) {
+				MountedDevices md(hive);
+				listed = md.list().size();
+			}
+
+			double ms = elapsedMs(start, iterations);
+			if (listed != kLetters) {
+				throw runtime_error("listed " + util::toString(listed)
+						+ " mappings instead of " + util::toString(kLetters));
+			}
+
+			printRow(label, ms, (allocations - before) / iterations);
+		} catch (const std::exception& e) {
+			cout << setw(16) << left << label << "failed: " << e.what() << endl;
+		}
+	}
+
+	// Resolves the listed mappings against the device table
+	void benchResolve(const string& hive, unsigned iterations)
+	{
+		MountedDevices::setBackend(MountedDevices::BACKEND_NATIVE);
+		MountedDevices md(hive);
+		MappingTable mappings(md.list());
+
+		// The first query loads the device table
+		unsigned long before = allocations;
+		Clock::time_point start = Clock::now();
+		resolveDevices(mappings);
+
+		printRow("resolve (first)", elapsedMs(start, 1), allocations - before);
+
+		before = allocations;
+		start = Clock::now();
+
+		for (unsigned i = 0; i != iterations; ++i) {
+			resolveDevices(mappings);
+		}
+
+		printRow("resolve", elapsedMs(start, iterations),
+				(allocations - before) / iterations);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try {
+		unsigned volumes = argc > 1 ? util::fromString<unsigned>(argv[1]) : 10000;
+		unsigned disks = argc > 2 ? util::fromString<unsigned>(argv[2]) : 1000;
+		unsigned iterations = argc > 3 ? util::fromString<unsigned>(argv[3]) : 20;
+
+		char dir[] = "/tmp/letterman-benchXXXXXX";
+		if (!mkdtemp(dir)) throw ErrnoException("mkdtemp");
+
+		string hive(string(dir) + "/SYSTEM");
+		string devices(string(dir) + "/devices");
+		auto cleaner(util::createCleaner([&] () {
+			unlink(hive.c_str());
+			unlink(devices.c_str());
+			rmdir(dir);
+		}));
+
+		writeHive(hive, volumes);
+		writeDevices(devices, max(disks, kLetters));
+
+		DevTree::setIndexFile("");
+		DevTree::setReplayFile(devices);
+
+		struct stat st;
+		if (stat(hive.c_str(), &st) != 0) throw ErrnoException("stat: " + hive);
+
+		cout << "hive: " << kLetters << " letters, " << volumes << " volumes ("
+			<< st.st_size / 1024 << " KiB); " << max(disks, kLetters)
+			<< " disks; " << iterations << " iterations" << endl;
+		cout << setw(28) << "ms/op" << setw(12) << "allocs/op" << endl;
+
+		benchBackend("hivex", MountedDevices::BACKEND_HIVEX, hive, iterations);
+		benchBackend("native", MountedDevices::BACKEND_NATIVE, hive, iterations);
+		benchResolve(hive, iterations);
+	} catch (const std::exception& e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include "block_device.h"
+#include "util.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		mutex lock;
+		bool recording = false;
+		bool replaying = false;
+		BlockDevice::Recordings recordings;
+
+		class FileBlockDevice : public BlockDevice
+		{
+			public:
+			FileBlockDevice(int fd)
+			: _fd(fd)
+			{
+				off_t size = lseek(fd, 0, SEEK_END);
+				_size = size > 0 ? size : 0;
+			}
+
+			virtual ~FileBlockDevice()
+			{ close(_fd); }
+
+			virtual bool read(uint64_t offset, void* buf, size_t len) override
+			{ return util::preadAll(_fd, offset, buf, len); }
+
+			virtual uint64_t size() const override
+			{ return _size; }
+
+			private:
+			int _fd;
+			uint64_t _size;
+		};
+
+		class RecordingBlockDevice : public FileBlockDevice
+		{
+			public:
+			RecordingBlockDevice(int fd, const string& path)
+			: FileBlockDevice(fd), _path(path)
+			{
+				lock_guard<mutex> guard(lock);
+				recordings[_path].size = size();
+			}
+
+			virtual bool read(uint64_t offset, void* buf, size_t len) override
+			{
+				if (!FileBlockDevice::read(offset, buf, len)) return false;
+
+				lock_guard<mutex> guard(lock);
+				string& data = recordings[_path].reads[offset];
+				if (data.size() < len) data.assign(static_cast<char*>(buf), len);
+				return true;
+			}
+
+			private:
+			string _path;
+		};
+
+		class ReplayBlockDevice : public BlockDevice
+		{
+			public:
+			ReplayBlockDevice(const Recording& recording)
+			: _recording(recording) {}
+
+			virtual bool read(uint64_t offset, void* buf, size_t len) override
+			{
+				auto& reads = _recording.reads;
+
+				// The last read starting at or before offset
+				auto iter = reads.upper_bound(offset);
+				if (iter == reads.begin()) return false;
+				--iter;
+
+				uint64_t skip = offset - iter->first;
+				if (skip + len > iter->second.size()) return false;
+
+				memcpy(buf, iter->second.data() + skip, len);
+				return true;
+			}
+
+			virtual uint64_t size() const override
+			{ return _recording.size; }
+
+			private:
+			const Recording& _recording;
+		};
+	}
+
+	BlockDevice::Ptr BlockDevice::open(const string& path)
+	{
+		bool record;
+
+		{
+			lock_guard<mutex> guard(lock);
+
+			if (replaying) {
+				auto iter = recordings.find(path);
+				if (iter == recordings.end()) {
+					errno = ENOENT;
+					return nullptr;
+				}
+
+				// Recordings are never modified while replaying
+				return make_shared<ReplayBlockDevice>(iter->second);
+			}
+
+			record = recording;
+		}
+
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+
+		if (record) return make_shared<RecordingBlockDevice>(fd, path);
+		return make_shared<FileBlockDevice>(fd);
+	}
+
+	void BlockDevice::startRecording()
+	{
+		lock_guard<mutex> guard(lock);
+		recording = true;
+	}
+
+	BlockDevice::Recordings BlockDevice::getRecordings()
+	{
+		lock_guard<mutex> guard(lock);
+		return recordings;
+	}
+
+	void BlockDevice::replay(const Recordings& r)
+	{
+		lock_guard<mutex> guard(lock);
+		recordings = r;
+		replaying = true;
+		recording = false;
+	}
+}
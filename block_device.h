@@ -0,0 +1,46 @@
+#ifndef LETTERMAN_BLOCK_DEVICE_H
+#define LETTERMAN_BLOCK_DEVICE_H
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <map>
+
+namespace letterman {
+
+	// Read-only access to a disk, partition or disk image. Reads can
+	// be recorded, and later be served from the recording instead of
+	// the actual device.
+	class BlockDevice
+	{
+		public:
+		typedef std::shared_ptr<BlockDevice> Ptr;
+
+		struct Recording
+		{
+			uint64_t size;
+			// offset -> data
+			std::map<uint64_t, std::string> reads;
+		};
+
+		// path -> recording
+		typedef std::map<std::string, Recording> Recordings;
+
+		virtual ~BlockDevice() {}
+
+		// Returns NULL, with errno set, if the device can't be opened
+		static Ptr open(const std::string& path);
+
+		// Returns false on errors, and if there are less than len bytes
+		virtual bool read(uint64_t offset, void* buf, size_t len) = 0;
+		virtual uint64_t size() const = 0;
+
+		// Keeps all reads of all devices from now on
+		static void startRecording();
+		static Recordings getRecordings();
+
+		// Serves all devices from recordings; devices or reads that
+		// were not recorded fail.
+		static void replay(const Recordings& recordings);
+	};
+}
+#endif
@@ -1,29 +1,119 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <atomic>
+#include <numeric>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
 #include "devtree.h"
 #include "util.h"
-#include "mbr.h"
 using namespace std;
 
 namespace letterman {
 	namespace {
-		void fillMbrIdProp(Properties& props)
+		class PropRegistry
 		{
-			if (!props[DevTree::kPropMbrId].empty()) return;
+			public:
+			// Ids never change once assigned, so each thread keeps the
+			// ones it looked up, and only takes the lock for names it
+			// hasn't seen yet.
+			DevTree::PropId get(const string& name)
+			{
+				static thread_local unordered_map<string, DevTree::PropId> cache;
 
-			if (DevTree::isDisk(props)) {
-				ifstream in(props[DevTree::kPropDeviceReadable]);
-				MBR mbr;
+				auto iter = cache.find(name);
+				if (iter != cache.end()) return iter->second;
 
-				if (mbr.read(in)) {
-					ostringstream ostr;
-					ostr << setw(8) << setfill('0') << hex << mbr.id;
+				DevTree::PropId id = add(name);
+				cache.emplace(name, id);
+				return id;
+			}
 
-					props[DevTree::kPropMbrId] = ostr.str();
-				} else {
-					// TODO warn?
+			const string& name(DevTree::PropId id)
+			{
+				lock_guard<mutex> guard(_lock);
+				return _names.at(id);
+			}
+
+			static PropRegistry& instance()
+			{
+				static PropRegistry registry;
+				return registry;
+			}
+
+			private:
+			DevTree::PropId add(const string& name)
+			{
+				lock_guard<mutex> guard(_lock);
+
+				auto iter = _ids.find(name);
+				if (iter != _ids.end()) return iter->second;
+
+				if (_names.size() > UINT16_MAX) {
+					throw runtime_error("Too many property names");
 				}
+
+				DevTree::PropId id = _names.size();
+				_names.push_back(name);
+				_ids[name] = id;
+
+				return id;
+			}
+
+			mutex _lock;
+			// deque, so references returned by name() stay valid
+			deque<string> _names;
+			unordered_map<string, DevTree::PropId> _ids;
+		};
+
+		const uint64_t kNoOffset = UINT64_MAX;
+		// A property that isn't in a mapped index file
+		const uint32_t kNoProp = UINT32_MAX;
+
+		uint64_t toInt(util::StringRef str, uint64_t fallback)
+		{
+			if (str.empty()) return fallback;
+
+			try {
+				return util::fromString<uint64_t>(str);
+			} catch (const invalid_argument& e) {
+				return fallback;
+			}
+		}
+
+		// Identifies a disk in the persistent partition table cache
+		template<class T> string getDiskSerial(const T& dev)
+		{
+			string wwn(dev.get(DevTree::kPropWwn));
+			return !wwn.empty() ? wwn : string(dev.get(DevTree::kPropSerial));
+		}
+
+		void fillMbrIdProp(DevTree::Builder& builder)
+		{
+			if (!builder.get(DevTree::kPropMbrId).empty()) return;
+
+			PartitionTable::Ptr table(PartitionTable::get(
+					builder.get(DevTree::kPropDeviceReadable),
+					getDiskSerial(builder),
+					toInt(builder.get(DevTree::kPropLbaSize), 512)));
+
+			if (table) {
+				ostringstream ostr;
+				ostr << setw(8) << setfill('0') << hex << table->mbrId;
+
+				builder.set(DevTree::kPropMbrId, ostr.str());
+			} else {
+				// TODO warn?
 			}
 		}
 	}
@@ -39,64 +129,1022 @@ namespace letterman {
 	const string DevTree::kPropDiskId = "kPropDiskId";
 	const string DevTree::kPropIsNtfs = "kPropIsNtfs";
 
-	size_t DevTree::blockSize(const Properties& props)
+	// Devices are stored as fixed-size records, with their values in
+	// one flat array, sorted by property id for each device. All
+	// strings live in a single pool. Frequently queried properties
+	// have sorted lookup tables. All of these are plain arrays without
+	// padding, so a snapshot can be used in place from an index file.
+	struct DevTree::Snapshot
+	{
+		struct Record
+		{
+			PropValue name;
+			uint32_t firstValue;
+			uint16_t numValues;
+			// A bool, sized so records have no padding
+			uint16_t isDisk;
+			uint32_t major;
+			uint32_t minor;
+			uint32_t lbaSize;
+			uint64_t offsetBlocks;
+			uint64_t offsetBytes;
+		};
+
+		// A device, and the value it is looked up by
+		struct IndexEntry
+		{
+			uint32_t index;
+			uint32_t offset;
+			uint32_t size;
+		};
+
+		// A partition, looked up by its disk and offset
+		struct OffsetEntry
+		{
+			uint64_t offset;
+			uint32_t index;
+			uint32_t diskOffset;
+			uint32_t diskSize;
+			uint32_t reserved;
+		};
+
+		// Lookup tables, sorted by value and then by device
+		enum Table
+		{
+			TABLE_DISK_MBR_ID,
+			TABLE_DISK_ID,
+			TABLE_DISK_MOUNTABLE,
+			TABLE_PARTITION_UUID,
+			TABLE_PARTITION_DISK_ID,
+			TABLE_PARTITION_MOUNTABLE,
+			kNumTables
+		};
+
+		// An array that is either owned, or part of a mapped index file
+		template<class T> class Array
+		{
+			public:
+			Array()
+			: _data(nullptr), _size(0) {}
+
+			Array(const Array&) = delete;
+			Array& operator=(const Array&) = delete;
+
+			void assign(vector<T>&& items)
+			{
+				_items = move(items);
+				_data = _items.data();
+				_size = _items.size();
+			}
+
+			void refer(const T* data, size_t size)
+			{
+				_items.clear();
+				_data = data;
+				_size = size;
+			}
+
+			const T* begin() const
+			{ return _data; }
+
+			const T* end() const
+			{ return _data + _size; }
+
+			size_t size() const
+			{ return _size; }
+
+			const T& operator[](size_t i) const
+			{ return _data[i]; }
+
+			private:
+			vector<T> _items;
+			const T* _data;
+			size_t _size;
+		};
+
+		struct DiskAndOffset
+		{
+			util::StringRef disk;
+			uint64_t offset;
+		};
+
+		// Compares lookup table entries with the values looked up
+		struct Less
+		{
+			const Snapshot* snapshot;
+
+			bool operator()(const IndexEntry& a, util::StringRef b) const
+			{ return snapshot->str(a.offset, a.size) < b; }
+
+			bool operator()(util::StringRef a, const IndexEntry& b) const
+			{ return a < snapshot->str(b.offset, b.size); }
+
+			bool operator()(const OffsetEntry& a, const DiskAndOffset& b) const
+			{
+				util::StringRef disk(snapshot->str(a.diskOffset, a.diskSize));
+				return disk < b.disk || (disk == b.disk && a.offset < b.offset);
+			}
+
+			bool operator()(const DiskAndOffset& a, const OffsetEntry& b) const
+			{
+				util::StringRef disk(snapshot->str(b.diskOffset, b.diskSize));
+				return a.disk < disk || (a.disk == disk && a.offset < b.offset);
+			}
+		};
+
+		Snapshot()
+		: generation(0), poolData(nullptr) {}
+
+		util::StringRef str(uint32_t offset, uint32_t size) const
+		{ return util::StringRef(poolData + offset, size); }
+
+		util::StringRef str(const PropValue& value) const
+		{ return str(value.offset, value.size); }
+
+		const PropValue* find(uint32_t index, PropId id) const
+		{
+			uint32_t key = id;
+			if (!fileIds.empty()) {
+				key = id < fileIds.size() ? fileIds[id] : kNoProp;
+				if (key == kNoProp) return nullptr;
+			}
+
+			const Record& r = records[index];
+			auto begin = values.begin() + r.firstValue;
+			auto end = begin + r.numValues;
+			auto iter = lower_bound(begin, end, key,
+					[] (const PropValue& v, uint32_t id) { return v.id < id; });
+
+			return (iter != end && iter->id == key) ? iter : nullptr;
+		}
+
+		util::StringRef get(uint32_t index, PropId id) const
+		{
+			const PropValue* value = find(index, id);
+			return value ? str(*value) : util::StringRef();
+		}
+
+		PropId localId(uint32_t id) const
+		{ return localIds.empty() ? id : localIds[id]; }
+
+		// Returns the lookup table for the given key, or NULL if there
+		// is none
+		const Array<IndexEntry>* table(PropId id, bool getDisks) const
+		{
+			if (getDisks) {
+				if (id == propId(kPropMbrId)) return &tables[TABLE_DISK_MBR_ID];
+				if (id == propId(kPropDiskId)) return &tables[TABLE_DISK_ID];
+				if (id == propId(kPropDeviceMountable)) return &tables[TABLE_DISK_MOUNTABLE];
+			} else {
+				if (id == propId(kPropPartUuid)) return &tables[TABLE_PARTITION_UUID];
+				if (id == propId(kPropDiskId)) return &tables[TABLE_PARTITION_DISK_ID];
+				if (id == propId(kPropDeviceMountable)) {
+					return &tables[TABLE_PARTITION_MOUNTABLE];
+				}
+			}
+
+			return nullptr;
+		}
+
+		pair<const IndexEntry*, const IndexEntry*> lookup(
+				const Array<IndexEntry>& table, util::StringRef value) const
+		{ return equal_range(table.begin(), table.end(), value, Less{ this }); }
+
+		pair<const OffsetEntry*, const OffsetEntry*> lookup(
+				const Array<OffsetEntry>& table, const DiskAndOffset& key) const
+		{ return equal_range(table.begin(), table.end(), key, Less{ this }); }
+
+		void addToTable(vector<IndexEntry>& table, uint32_t index,
+				const string& key) const
+		{
+			if (key == kNoMatchIfSetAsPropKey) return;
+
+			const PropValue* value = find(index, propId(key));
+			if (value) table.push_back(IndexEntry{ index, value->offset, value->size });
+		}
+
+		void addToTable(vector<OffsetEntry>& table, uint32_t index,
+				uint64_t offset) const
+		{
+			if (kPropDiskId == kNoMatchIfSetAsPropKey) return;
+
+			const PropValue* disk = find(index, propId(kPropDiskId));
+			if (disk && offset != kNoOffset) {
+				table.push_back(OffsetEntry{ offset, index, disk->offset,
+						disk->size, 0 });
+			}
+		}
+
+		// Builds all lookup tables
+		void finish()
+		{
+			vector<uint32_t> diskList, partitionList;
+			vector<IndexEntry> entries[kNumTables];
+			vector<OffsetEntry> byBlocks, byBytes;
+
+			for (uint32_t i = 0; i != records.size(); ++i) {
+				const Record& r = records[i];
+
+				if (r.isDisk) {
+					diskList.push_back(i);
+					addToTable(entries[TABLE_DISK_MBR_ID], i, kPropMbrId);
+					addToTable(entries[TABLE_DISK_ID], i, kPropDiskId);
+					addToTable(entries[TABLE_DISK_MOUNTABLE], i, kPropDeviceMountable);
+				} else {
+					partitionList.push_back(i);
+					addToTable(entries[TABLE_PARTITION_UUID], i, kPropPartUuid);
+					addToTable(entries[TABLE_PARTITION_DISK_ID], i, kPropDiskId);
+					addToTable(entries[TABLE_PARTITION_MOUNTABLE], i,
+							kPropDeviceMountable);
+					addToTable(byBlocks, i, r.offsetBlocks);
+					addToTable(byBytes, i, r.offsetBytes);
+				}
+			}
+
+			for (int i = 0; i != kNumTables; ++i) {
+				sort(entries[i].begin(), entries[i].end(),
+						[this] (const IndexEntry& a, const IndexEntry& b) -> bool {
+					util::StringRef x(str(a.offset, a.size)), y(str(b.offset, b.size));
+					return x < y || (x == y && a.index < b.index);
+				});
+
+				tables[i].assign(move(entries[i]));
+			}
+
+			auto byOffset = [this] (const OffsetEntry& a, const OffsetEntry& b) -> bool {
+				util::StringRef x(str(a.diskOffset, a.diskSize));
+				util::StringRef y(str(b.diskOffset, b.diskSize));
+				return x < y || (x == y && (a.offset < b.offset
+							|| (a.offset == b.offset && a.index < b.index)));
+			};
+
+			sort(byBlocks.begin(), byBlocks.end(), byOffset);
+			sort(byBytes.begin(), byBytes.end(), byOffset);
+
+			disks.assign(move(diskList));
+			partitions.assign(move(partitionList));
+			partitionsByOffsetBlocks.assign(move(byBlocks));
+			partitionsByOffsetBytes.assign(move(byBytes));
+		}
+
+		uint64_t generation;
+
+		// Either pool.data(), or a memory mapped device index
+		const char* poolData;
+		string pool;
+		shared_ptr<const void> mapping;
+
+		// Property ids in a mapped index are those of the process that
+		// wrote it: ours -> the index's, and back. Both are empty if
+		// the ids are the same.
+		vector<uint32_t> fileIds;
+		vector<PropId> localIds;
+
+		Array<Record> records;
+		Array<PropValue> values;
+
+		Array<uint32_t> disks;
+		Array<uint32_t> partitions;
+		Array<IndexEntry> tables[kNumTables];
+		Array<OffsetEntry> partitionsByOffsetBlocks;
+		Array<OffsetEntry> partitionsByOffsetBytes;
+
+		static_assert(sizeof(PropValue) == 12 && sizeof(Record) == 48
+				&& sizeof(IndexEntry) == 12 && sizeof(OffsetEntry) == 24,
+				"Index file structures must not have padding");
+	};
+
+	DevTree::PropId DevTree::propId(const string& name)
 	{
-		auto iter = props.find(kPropLbaSize);
-		if (iter != props.end() && !iter->second.empty()) {
-			return util::fromString<size_t>(iter->second);
+		return PropRegistry::instance().get(name);
+	}
+
+	const string& DevTree::propName(PropId id)
+	{
+		return PropRegistry::instance().name(id);
+	}
+
+	util::StringRef DevTree::Device::name() const
+	{
+		return _snapshot->str(_snapshot->records[_index].name);
+	}
+
+	util::StringRef DevTree::Device::get(PropId id) const
+	{
+		return _snapshot->get(_index, id);
+	}
+
+	vector<pair<DevTree::PropId, util::StringRef>> DevTree::Device::props() const
+	{
+		vector<pair<PropId, util::StringRef>> ret;
+		const Snapshot::Record& r = _snapshot->records[_index];
+
+		for (uint32_t i = 0; i != r.numValues; ++i) {
+			const PropValue& v = _snapshot->values[r.firstValue + i];
+			ret.emplace_back(_snapshot->localId(v.id), _snapshot->str(v));
+		}
+
+		return ret;
+	}
+
+	bool DevTree::Device::isDisk() const
+	{
+		return _snapshot->records[_index].isDisk;
+	}
+
+	bool DevTree::Device::isPartition() const
+	{
+		return !isDisk();
+	}
+
+	size_t DevTree::Device::blockSize() const
+	{
+		return _snapshot->records[_index].lbaSize;
+	}
+
+	PartitionTable::Ptr DevTree::Device::partitionTable() const
+	{
+		return PartitionTable::get(get(kPropDeviceReadable), getDiskSerial(*this),
+				blockSize());
+	}
+
+	bool DevTree::Device::offset(uint64_t& bytes) const
+	{
+		const Snapshot::Record& r = _snapshot->records[_index];
+
+		if (r.offsetBlocks != kNoOffset) {
+			bytes = r.offsetBlocks * 512;
+		} else if (r.offsetBytes != kNoOffset) {
+			bytes = r.offsetBytes;
 		} else {
-			return 512;
+			return false;
 		}
+
+		return true;
 	}
 
-	bool DevTree::arePropsMatching(
-			const Properties& all, const Properties& criteria)
+	DevTree::Builder::Builder()
+	: _snapshot(new Snapshot), _current(0)
+	{}
+
+	DevTree::Builder::~Builder()
+	{}
+
+	uint32_t DevTree::Builder::intern(const char* value, size_t len)
 	{
-		for (auto& crit : criteria) {
+		string str(value, len);
 
-			if (crit.second == kIgnoreValue) continue;
+		auto iter = _interned.find(str);
+		if (iter != _interned.end()) return iter->second;
 
-			auto iter = all.find(crit.first);
-			bool exists = iter != all.end();
-			if (crit.first == kNoMatchIfSetAsPropKey) {
-				return false;
+		string& pool = _snapshot->pool;
+		if (pool.size() + len + 1 > UINT32_MAX) {
+			throw runtime_error("Property pool too large");
+		}
+
+		uint32_t offset = pool.size();
+		// NUL-terminated, so values can be passed to C functions
+		pool.append(value, len);
+		pool.push_back('\0');
+
+		_interned[str] = offset;
+		return offset;
+	}
+
+	void DevTree::Builder::begin()
+	{
+		_devices.emplace_back();
+		_current = _devices.size() - 1;
+	}
+
+	void DevTree::Builder::set(PropId id, const char* value, size_t len)
+	{
+		vector<PropValue>& values = _devices.at(_current).values;
+
+		auto iter = find_if(values.begin(), values.end(),
+				[id] (const PropValue& v) { return v.id == id; });
+
+		// Empty values are not stored; a query for them yields an
+		// empty string anyway.
+		if (!len) {
+			if (iter != values.end()) values.erase(iter);
+			return;
+		}
+
+		PropValue v = { id, intern(value, len), static_cast<uint32_t>(len) };
+
+		if (iter != values.end()) {
+			*iter = v;
+		} else {
+			values.push_back(v);
+		}
+	}
+
+	string DevTree::Builder::get(PropId id) const
+	{
+		for (auto& v : _devices.at(_current).values) {
+			if (v.id == id) {
+				return string(_snapshot->pool.data() + v.offset, v.size);
 			}
+		}
+
+		return "";
+	}
 
-			if (crit.second == kNoValue && exists) {
-				return false;
+	void DevTree::Builder::end(const string& name, bool isDisk)
+	{
+		Pending& dev = _devices.at(_current);
+		dev.name = name;
+		dev.isDisk = isDisk;
+	}
+
+	void DevTree::Builder::discard()
+	{
+		_devices.pop_back();
+		_current = _devices.size() - 1;
+	}
+
+	void DevTree::Builder::append(Builder& other)
+	{
+		const string& pool = other._snapshot->pool;
+
+		for (auto& dev : other._devices) {
+			for (auto& v : dev.values) {
+				v.offset = intern(pool.data() + v.offset, v.size);
 			}
 
-			if (exists && (crit.second != iter->second && crit.second != kAnyValue)) {
-				return false;
+			_devices.push_back(move(dev));
+		}
+
+		other._devices.clear();
+		_current = _devices.size() - 1;
+	}
+
+	void DevTree::Builder::add(const Device& dev)
+	{
+		begin();
+
+		for (auto& prop : dev.props()) {
+			set(prop.first, prop.second.data(), prop.second.size());
+		}
+
+		end(dev.name(), dev.isDisk());
+	}
+
+	void DevTree::Builder::forEach(const function<void(bool)>& f)
+	{
+		for (_current = 0; _current != _devices.size(); ++_current) {
+			f(_devices[_current].isDisk);
+		}
+	}
+
+	shared_ptr<DevTree::Snapshot> DevTree::Builder::finish()
+	{
+		// Sort by name, keeping only the last device of a given name
+		stable_sort(_devices.begin(), _devices.end(),
+				[] (const Pending& a, const Pending& b) { return a.name < b.name; });
+
+		vector<PropValue> names;
+		for (auto& dev : _devices) {
+			uint32_t offset = intern(dev.name.data(), dev.name.size());
+			names.push_back(PropValue{ 0, offset,
+					static_cast<uint32_t>(dev.name.size()) });
+		}
+
+		// From now on, the pool does not grow, so references into
+		// it stay valid.
+		unique_ptr<Snapshot> snapshot(move(_snapshot));
+		snapshot->poolData = snapshot->pool.data();
+		_snapshot.reset(new Snapshot);
+		_interned.clear();
+
+		PropId lbaSize = propId(kPropLbaSize);
+		PropId offsetBlocks = propId(kPropPartOffsetBlocks);
+		PropId offsetBytes = propId(kPropPartOffsetBytes);
+		PropId major = propId(kPropMajor);
+		PropId minor = propId(kPropMinor);
+
+		vector<Snapshot::Record> records;
+		vector<PropValue> values;
+
+		for (size_t i = 0; i != _devices.size(); ++i) {
+			Pending& dev = _devices[i];
+
+			if (i + 1 != _devices.size() && _devices[i + 1].name == dev.name) {
+				continue;
 			}
 
-			if (!exists)
-				return false;
+			sort(dev.values.begin(), dev.values.end(),
+					[] (const PropValue& a, const PropValue& b) { return a.id < b.id; });
+
+			auto get = [&] (PropId id) -> util::StringRef {
+				for (auto& v : dev.values) {
+					if (v.id == id) return snapshot->str(v);
+				}
+				return util::StringRef();
+			};
+
+			// Value-initialized, so records saved to the index file
+			// don't contain garbage
+			Snapshot::Record r = Snapshot::Record();
+			r.name = names[i];
+			r.firstValue = values.size();
+			r.numValues = dev.values.size();
+			r.isDisk = dev.isDisk;
+			r.lbaSize = toInt(get(lbaSize), 512);
+			r.offsetBlocks = toInt(get(offsetBlocks), kNoOffset);
+			r.offsetBytes = toInt(get(offsetBytes), kNoOffset);
+			r.major = toInt(get(major), 0);
+			r.minor = toInt(get(minor), 0);
+
+			values.insert(values.end(), dev.values.begin(), dev.values.end());
+			records.push_back(r);
 		}
 
-		return true;
+		_devices.clear();
+		snapshot->records.assign(move(records));
+		snapshot->values.assign(move(values));
+		snapshot->finish();
+
+		return shared_ptr<Snapshot>(move(snapshot));
+	}
+
+	namespace {
+		atomic<unsigned> enumerationThreads(0);
+
+		string indexFile(DevTree::kDefaultIndexFile);
+
+		// Layout of the device index file. Property ids are only valid
+		// within a process, so the file has its own, which are mapped
+		// to ours by name when loading.
+		struct IndexHeader
+		{
+			char magic[8];
+			uint32_t version;
+			// Guards against layout changes between builds
+			uint32_t recordSize;
+			uint32_t valueSize;
+			uint32_t tagSize;
+			uint32_t propsSize;
+			uint32_t numRecords;
+			uint32_t numValues;
+			uint32_t poolSize;
+			uint32_t numDisks;
+			uint32_t numPartitions;
+			uint32_t tableSizes[DevTree::Snapshot::kNumTables];
+			uint32_t numByOffsetBlocks;
+			uint32_t numByOffsetBytes;
+			// tag, NUL-separated property names, records, values, pool,
+			// disks, partitions, the lookup tables and the offset tables
+			// follow, each padded to 8 bytes.
+		};
+
+		const char kIndexMagic[8] = { 'L', 'M', 'D', 'E', 'V', 'I', 'D', 'X' };
+		const uint32_t kIndexVersion = 2;
+
+		size_t align8(size_t size)
+		{
+			return (size + 7) & ~size_t(7);
+		}
+	}
+
+	const string DevTree::kDefaultIndexFile("/run/letterman/devtree.idx");
+
+	void DevTree::setIndexFile(const string& filename)
+	{
+		indexFile = filename;
 	}
 
+	shared_ptr<DevTree::Snapshot> DevTree::loadIndex(const string& tag)
+	{
+		int fd = open(indexFile.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return nullptr;
+		auto cleaner(util::createCleaner([fd] () { close(fd); }));
+
+		struct stat st;
+		if (fstat(fd, &st) || size_t(st.st_size) < sizeof(IndexHeader)) {
+			return nullptr;
+		}
+
+		size_t size = st.st_size;
+		void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) return nullptr;
+
+		shared_ptr<const void> mapping(addr, [size] (const void* p) {
+			munmap(const_cast<void*>(p), size);
+		});
 
-	map<string, Properties> DevTree::getDisksOrPartitions(
+		const char* base = static_cast<const char*>(addr);
+		const IndexHeader& h = *reinterpret_cast<const IndexHeader*>(base);
+
+		if (memcmp(h.magic, kIndexMagic, 8) || h.version != kIndexVersion
+				|| h.recordSize != sizeof(Snapshot::Record)
+				|| h.valueSize != sizeof(PropValue)) {
+			return nullptr;
+		}
+
+		shared_ptr<Snapshot> snapshot(make_shared<Snapshot>());
+		snapshot->mapping = mapping;
+
+		// Each section is used in place; all sizes are 32 bit, so the
+		// offsets can't overflow.
+		size_t offset = align8(sizeof(IndexHeader));
+		auto section = [&offset, base] (uint64_t len) -> const char* {
+			const char* p = base + offset;
+			offset += align8(len);
+			return p;
+		};
+
+		const char* tagData = section(h.tagSize);
+		const char* props = section(h.propsSize);
+		const char* records = section(uint64_t(h.numRecords) * sizeof(Snapshot::Record));
+		const char* values = section(uint64_t(h.numValues) * sizeof(PropValue));
+		const char* pool = section(h.poolSize);
+		const char* disks = section(uint64_t(h.numDisks) * 4);
+		const char* partitions = section(uint64_t(h.numPartitions) * 4);
+
+		const char* tables[Snapshot::kNumTables];
+		for (int i = 0; i != Snapshot::kNumTables; ++i) {
+			tables[i] = section(uint64_t(h.tableSizes[i]) * sizeof(Snapshot::IndexEntry));
+		}
+
+		const char* byBlocks = section(uint64_t(h.numByOffsetBlocks)
+				* sizeof(Snapshot::OffsetEntry));
+		const char* byBytes = section(uint64_t(h.numByOffsetBytes)
+				* sizeof(Snapshot::OffsetEntry));
+
+		if (offset > size || tag != string(tagData, h.tagSize)
+				|| (h.poolSize && pool[h.poolSize - 1])) {
+			return nullptr;
+		}
+
+		// Our property ids may differ from those of the writer
+		vector<PropId> ids;
+		const char* propsEnd = props + h.propsSize;
+
+		while (props < propsEnd) {
+			size_t len = strnlen(props, propsEnd - props);
+			ids.push_back(propId(string(props, len)));
+			props += len + 1;
+		}
+
+		bool sameIds = true;
+		for (uint32_t i = 0; i != ids.size(); ++i) {
+			sameIds = sameIds && ids[i] == i;
+		}
+
+		if (!sameIds) {
+			snapshot->localIds = ids;
+			snapshot->fileIds.assign(*max_element(ids.begin(), ids.end()) + 1,
+					kNoProp);
+			for (uint32_t i = 0; i != ids.size(); ++i) snapshot->fileIds[ids[i]] = i;
+		}
+
+		snapshot->poolData = pool;
+		snapshot->records.refer(reinterpret_cast<const Snapshot::Record*>(records),
+				h.numRecords);
+		snapshot->values.refer(reinterpret_cast<const PropValue*>(values),
+				h.numValues);
+		snapshot->disks.refer(reinterpret_cast<const uint32_t*>(disks), h.numDisks);
+		snapshot->partitions.refer(reinterpret_cast<const uint32_t*>(partitions),
+				h.numPartitions);
+
+		for (int i = 0; i != Snapshot::kNumTables; ++i) {
+			snapshot->tables[i].refer(
+					reinterpret_cast<const Snapshot::IndexEntry*>(tables[i]),
+					h.tableSizes[i]);
+		}
+
+		snapshot->partitionsByOffsetBlocks.refer(
+				reinterpret_cast<const Snapshot::OffsetEntry*>(byBlocks),
+				h.numByOffsetBlocks);
+		snapshot->partitionsByOffsetBytes.refer(
+				reinterpret_cast<const Snapshot::OffsetEntry*>(byBytes),
+				h.numByOffsetBytes);
+
+		// Only check that everything refers to something in the file
+		auto inPool = [&h] (uint32_t offset, uint32_t size) {
+			return uint64_t(offset) + size < h.poolSize;
+		};
+
+		for (auto& v : snapshot->values) {
+			if (v.id >= ids.size() || !inPool(v.offset, v.size)) return nullptr;
+		}
+
+		for (auto& r : snapshot->records) {
+			if (uint64_t(r.firstValue) + r.numValues > h.numValues
+					|| !inPool(r.name.offset, r.name.size)) {
+				return nullptr;
+			}
+		}
+
+		for (auto* list : { &snapshot->disks, &snapshot->partitions }) {
+			for (uint32_t index : *list) {
+				if (index >= h.numRecords) return nullptr;
+			}
+		}
+
+		for (auto& table : snapshot->tables) {
+			for (auto& e : table) {
+				if (e.index >= h.numRecords || !inPool(e.offset, e.size)) {
+					return nullptr;
+				}
+			}
+		}
+
+		for (auto* table : { &snapshot->partitionsByOffsetBlocks,
+				&snapshot->partitionsByOffsetBytes }) {
+			for (auto& e : *table) {
+				if (e.index >= h.numRecords || !inPool(e.diskOffset, e.diskSize)) {
+					return nullptr;
+				}
+			}
+		}
+
+		return snapshot;
+	}
+
+	void DevTree::saveIndex(const Snapshot& snapshot, const string& tag)
+	{
+		string props;
+		uint32_t maxId = 0;
+
+		for (auto& v : snapshot.values) {
+			maxId = max(maxId, v.id);
+		}
+
+		for (uint32_t id = 0; snapshot.values.size() && id <= maxId; ++id) {
+			props += propName(id);
+			props += '\0';
+		}
+
+		IndexHeader h = IndexHeader();
+		memcpy(h.magic, kIndexMagic, 8);
+		h.version = kIndexVersion;
+		h.recordSize = sizeof(Snapshot::Record);
+		h.valueSize = sizeof(PropValue);
+		h.tagSize = tag.size();
+		h.propsSize = props.size();
+		h.numRecords = snapshot.records.size();
+		h.numValues = snapshot.values.size();
+		h.poolSize = snapshot.pool.size();
+		h.numDisks = snapshot.disks.size();
+		h.numPartitions = snapshot.partitions.size();
+		for (int i = 0; i != Snapshot::kNumTables; ++i) {
+			h.tableSizes[i] = snapshot.tables[i].size();
+		}
+		h.numByOffsetBlocks = snapshot.partitionsByOffsetBlocks.size();
+		h.numByOffsetBytes = snapshot.partitionsByOffsetBytes.size();
+
+		string data(reinterpret_cast<const char*>(&h), sizeof(h));
+
+		auto append = [&data] (const void* p, size_t len) {
+			data.append(static_cast<const char*>(p), len);
+			data.resize(align8(data.size()));
+		};
+
+		data.resize(align8(data.size()));
+		append(tag.data(), tag.size());
+		append(props.data(), props.size());
+		append(snapshot.records.begin(),
+				snapshot.records.size() * sizeof(Snapshot::Record));
+		append(snapshot.values.begin(), snapshot.values.size() * sizeof(PropValue));
+		append(snapshot.pool.data(), snapshot.pool.size());
+		append(snapshot.disks.begin(), snapshot.disks.size() * 4);
+		append(snapshot.partitions.begin(), snapshot.partitions.size() * 4);
+
+		for (auto& table : snapshot.tables) {
+			append(table.begin(), table.size() * sizeof(Snapshot::IndexEntry));
+		}
+
+		append(snapshot.partitionsByOffsetBlocks.begin(),
+				snapshot.partitionsByOffsetBlocks.size() * sizeof(Snapshot::OffsetEntry));
+		append(snapshot.partitionsByOffsetBytes.begin(),
+				snapshot.partitionsByOffsetBytes.size() * sizeof(Snapshot::OffsetEntry));
+
+		// The index is only an optimization, so errors are ignored.
+		// Written to a new temporary file first, so readers never see
+		// a partial index, and nothing planted in the directory is
+		// followed.
+		string dir(indexFile.substr(0, indexFile.rfind('/') + 1));
+		if (!dir.empty()) mkdir(dir.c_str(), 0755);
+
+		string tmpl(indexFile + ".XXXXXX");
+		int fd = mkstemp(&tmpl[0]);
+		if (fd == -1) return;
+		fchmod(fd, 0644);
+
+		bool written = util::pwriteAll(fd, 0, data.data(), data.size());
+		if (close(fd) != 0) written = false;
+
+		if (!written || rename(tmpl.c_str(), indexFile.c_str()) != 0) {
+			unlink(tmpl.c_str());
+		}
+	}
+
+	void DevTree::setEnumerationThreads(unsigned threads)
+	{
+		enumerationThreads = threads;
+	}
+
+	unsigned DevTree::getEnumerationThreads()
+	{
+		return enumerationThreads;
+	}
+
+	namespace {
+		// Serializes writers; readers just load the current snapshot
+		mutex snapshotLock;
+		shared_ptr<const DevTree::Snapshot> currentSnapshot;
+
+		void publish(const shared_ptr<DevTree::Snapshot>& snapshot,
+				uint64_t generation)
+		{
+			snapshot->generation = generation;
+			atomic_store(&currentSnapshot,
+					shared_ptr<const DevTree::Snapshot>(snapshot));
+		}
+	}
+
+	uint64_t DevTree::generation()
+	{
+		return getSnapshot()->generation;
+	}
+
+	shared_ptr<const DevTree::Snapshot> DevTree::getSnapshot()
+	{
+		shared_ptr<const Snapshot> snapshot(atomic_load(&currentSnapshot));
+		if (snapshot) return snapshot;
+
+		lock_guard<mutex> guard(snapshotLock);
+		snapshot = atomic_load(&currentSnapshot);
+		if (snapshot) return snapshot;
+
+		Builder builder;
+		string tag;
+		bool useIndex = false;
+
+		if (!getReplayDevices(builder) && !getImageDevices(builder)) {
+			// The device index is not used while recording, since the
+			// recording needs the actual reads.
+			useIndex = !indexFile.empty() && !isRecording() && getIndexTag(tag);
+
+			shared_ptr<Snapshot> s;
+			if (useIndex && (s = loadIndex(tag))) {
+				publish(s, 1);
+				return s;
+			}
+
+			getAllDevices(builder);
+		}
+
+		builder.forEach([&builder] (bool isDisk) {
+			if (isDisk) fillMbrIdProp(builder);
+		});
+
+		shared_ptr<Snapshot> s(builder.finish());
+
+		Devices::Indexes all(s->records.size());
+		iota(all.begin(), all.end(), 0);
+		saveRecording(Devices(s, move(all)));
+
+		if (useIndex) saveIndex(*s, tag);
+
+		publish(s, 1);
+		return s;
+	}
+
+	void DevTree::update(const set<string>& names, Builder& changed)
+	{
+		shared_ptr<const Snapshot> old(getSnapshot());
+
+		lock_guard<mutex> guard(snapshotLock);
+		old = atomic_load(&currentSnapshot);
+
+		Builder builder;
+
+		for (uint32_t i = 0; i != old->records.size(); ++i) {
+			Device dev(old.get(), i);
+			if (!names.count(dev.name())) builder.add(dev);
+		}
+
+		changed.forEach([&changed] (bool isDisk) {
+			if (isDisk) fillMbrIdProp(changed);
+		});
+
+		builder.append(changed);
+		publish(builder.finish(), old->generation + 1);
+	}
+
+	namespace {
+		struct Criterion
+		{
+			DevTree::PropId id;
+			const string* value;
+		};
+
+		bool isMatching(const DevTree::Device& dev, const vector<Criterion>& criteria)
+		{
+			for (auto& crit : criteria) {
+				util::StringRef value(dev.get(crit.id));
+
+				if (*crit.value == DevTree::kNoValue) {
+					if (!value.empty()) return false;
+				} else if (*crit.value == DevTree::kAnyValue) {
+					if (value.empty()) return false;
+				} else if (value != *crit.value) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+	}
+
+	DevTree::Devices DevTree::getDisksOrPartitions(
 			const Properties& props, bool getDisks)
 	{
-		map<string, Properties> ret;
+		shared_ptr<const Snapshot> snapshot(getSnapshot());
+		Devices::Indexes ret;
 
-		for (auto& e : getAllDevices()) {
+		vector<Criterion> criteria;
 
-			if(!(getDisks ? isDisk(e.second) : isPartition(e.second))) {
-				continue;
+		for (auto& crit : props) {
+			if (crit.second == kIgnoreValue) continue;
+			if (crit.first == kNoMatchIfSetAsPropKey) {
+				return Devices(snapshot, move(ret));
+			}
+
+			criteria.push_back(Criterion{ propId(crit.first), &crit.second });
+		}
+
+		auto isValue = [&props] (const string& key) -> const string* {
+			auto iter = props.find(key);
+			if (iter == props.end() || iter->second.empty()
+					|| iter->second == kIgnoreValue
+					|| iter->second == kAnyValue || iter->second == kNoValue) {
+				return nullptr;
+			}
+
+			return &iter->second;
+		};
+
+		auto addIfMatching = [&] (uint32_t index) {
+			if (isMatching(Device(snapshot.get(), index), criteria)) {
+				ret.push_back(index);
 			}
+		};
 
-			fillMbrIdProp(e.second);
+		// Use the most selective index available; all criteria are
+		// checked against the candidates anyway.
+		const string* disk = isValue(kPropDiskId);
+		const string* offset = nullptr;
+		const Snapshot::Array<Snapshot::OffsetEntry>* offsets = nullptr;
 
-			if (props.empty() || DevTree::arePropsMatching(e.second, props)) {
-				ret.insert(e);
+		if (!getDisks && disk) {
+			if ((offset = isValue(kPropPartOffsetBlocks))) {
+				offsets = &snapshot->partitionsByOffsetBlocks;
+			} else if ((offset = isValue(kPropPartOffsetBytes))) {
+				offsets = &snapshot->partitionsByOffsetBytes;
 			}
 		}
 
-		return ret;
+		// Only keys that have a table for this kind of device are used;
+		// other criteria fall back to a scan.
+		const Snapshot::Array<Snapshot::IndexEntry>* table = nullptr;
+		const string* value = nullptr;
+
+		for (auto& key : { kPropMbrId, kPropPartUuid, kPropDeviceMountable,
+				kPropDiskId }) {
+			const string* v;
+			if (key != kNoMatchIfSetAsPropKey && (v = isValue(key))
+					&& (table = snapshot->table(propId(key), getDisks))) {
+				value = v;
+				break;
+			}
+		}
+
+		if (offsets) {
+			Snapshot::DiskAndOffset key = { *disk, toInt(*offset, kNoOffset) };
+			auto range = snapshot->lookup(*offsets, key);
+			for (auto iter = range.first; iter != range.second; ++iter) {
+				addIfMatching(iter->index);
+			}
+		} else if (table) {
+			auto range = snapshot->lookup(*table, *value);
+			for (auto iter = range.first; iter != range.second; ++iter) {
+				addIfMatching(iter->index);
+			}
+		} else {
+			for (uint32_t index : getDisks ? snapshot->disks : snapshot->partitions) {
+				addIfMatching(index);
+			}
+		}
+
+		// Records are sorted by name, so this yields the same order
+		// as a scan.
+		sort(ret.begin(), ret.end());
+		return Devices(snapshot, move(ret));
 	}
 
 }
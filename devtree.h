@@ -1,8 +1,16 @@
 #ifndef LETTERMAN_DEVTREE_H
 #define LETTERMAN_DEVTREE_H
+#include <unordered_map>
+#include <functional>
+#include <iterator>
+#include <stdint.h>
+#include <memory>
 #include <string>
+#include <vector>
 #include <map>
 #include <set>
+#include "partition_table.h"
+#include "util.h"
 
 namespace letterman {
 
@@ -26,6 +34,7 @@ namespace letterman {
 		static const std::string kPropModel;
 		static const std::string kPropRevision;
 		static const std::string kPropSerial;
+		static const std::string kPropWwn;
 
 		static const std::string kPropLbaSize;
 
@@ -41,15 +50,235 @@ namespace letterman {
 		static const std::string kAnyValue;
 		static const std::string kNoValue;
 
-		static std::map<std::string, Properties> getDisks(
-				const Properties& criteria = Properties())
+		// Property names are interned, so devices only store a small
+		// integer per property. Ids are only valid within a process.
+		typedef uint16_t PropId;
+
+		static PropId propId(const std::string& name);
+		static const std::string& propName(PropId id);
+
+		struct Snapshot;
+
+		private:
+		struct PropValue
+		{
+			// A PropId, sized so values have no padding
+			uint32_t id;
+			uint32_t offset;
+			uint32_t size;
+		};
+
+		public:
+		// Handle to a device in a snapshot. Values refer to the
+		// snapshot's string pool, so they must not outlive it.
+		class Device
+		{
+			public:
+			Device(const Snapshot* snapshot, uint32_t index)
+			: _snapshot(snapshot), _index(index) {}
+
+			util::StringRef name() const;
+
+			util::StringRef get(PropId id) const;
+			util::StringRef get(const std::string& key) const
+			{ return get(propId(key)); }
+
+			std::vector<std::pair<PropId, util::StringRef>> props() const;
+
+			bool isDisk() const;
+			bool isPartition() const;
+
+			size_t blockSize() const;
+
+			// Partition offset in bytes, from either kPropPartOffsetBlocks
+			// or kPropPartOffsetBytes. Returns false if neither is set.
+			bool offset(uint64_t& bytes) const;
+
+			// Partition table of a disk, or nullptr if it has no MBR
+			PartitionTable::Ptr partitionTable() const;
+
+			private:
+			const Snapshot* _snapshot;
+			uint32_t _index;
+		};
+
+		// Result of a query. Refers to devices in an immutable
+		// snapshot of the device table, which is kept alive for
+		// as long as the result exists, so no properties are copied.
+		class Devices
+		{
+			public:
+			typedef std::vector<uint32_t> Indexes;
+
+			class const_iterator
+			: public std::iterator<std::forward_iterator_tag, Device>
+			{
+				public:
+				const_iterator(const Snapshot* snapshot,
+						Indexes::const_iterator iter)
+				: _snapshot(snapshot), _iter(iter) {}
+
+				Device operator*() const
+				{ return Device(_snapshot, *_iter); }
+
+				const_iterator& operator++()
+				{ ++_iter; return *this; }
+
+				const_iterator operator++(int)
+				{ return const_iterator(_snapshot, _iter++); }
+
+				bool operator==(const const_iterator& other) const
+				{ return _iter == other._iter; }
+
+				bool operator!=(const const_iterator& other) const
+				{ return _iter != other._iter; }
+
+				private:
+				const Snapshot* _snapshot;
+				Indexes::const_iterator _iter;
+			};
+
+			typedef const_iterator iterator;
+
+			Devices() {}
+
+			Devices(const std::shared_ptr<const Snapshot>& snapshot,
+					Indexes&& devices)
+			: _snapshot(snapshot), _devices(std::move(devices)) {}
+
+			const_iterator begin() const
+			{ return const_iterator(_snapshot.get(), _devices.begin()); }
+
+			const_iterator end() const
+			{ return const_iterator(_snapshot.get(), _devices.end()); }
+
+			bool empty() const
+			{ return _devices.empty(); }
+
+			size_t size() const
+			{ return _devices.size(); }
+
+			Device front() const
+			{ return Device(_snapshot.get(), _devices.front()); }
+
+			private:
+			std::shared_ptr<const Snapshot> _snapshot;
+			Indexes _devices;
+		};
+
+		// Collects devices during enumeration. Values are interned
+		// into a string pool shared by all devices of a snapshot.
+		class Builder
+		{
+			public:
+			Builder();
+			~Builder();
+
+			// Starts a new device; all values set until end() or
+			// discard() belong to it.
+			void begin();
+
+			void set(PropId id, const char* value, size_t len);
+
+			void set(PropId id, const std::string& value)
+			{ set(id, value.data(), value.size()); }
+
+			void set(const std::string& key, const std::string& value)
+			{ set(propId(key), value); }
+
+			// Value of the current device
+			std::string get(PropId id) const;
+
+			std::string get(const std::string& key) const
+			{ return get(propId(key)); }
+
+			void end(const std::string& name, bool isDisk);
+			void discard();
+
+			// Moves all devices of another builder into this one
+			void append(Builder& other);
+
+			// Copies a device from a snapshot
+			void add(const Device& dev);
+
+			// Makes each device the current one in turn, so its values
+			// can be updated.
+			void forEach(const std::function<void(bool isDisk)>& f);
+
+			std::shared_ptr<Snapshot> finish();
+
+			private:
+			struct Pending
+			{
+				std::string name;
+				bool isDisk;
+				std::vector<PropValue> values;
+			};
+
+			uint32_t intern(const char* value, size_t len);
+
+			std::unique_ptr<Snapshot> _snapshot;
+			std::unordered_map<std::string, uint32_t> _interned;
+			std::vector<Pending> _devices;
+			size_t _current;
+		};
+
+		// Keeps the device table up to date with udev events for block
+		// devices (Linux only). Each batch of events is applied by
+		// re-reading only the affected devices, and published as a new
+		// snapshot; queries that are running keep using the old one.
+		class Monitor
+		{
+			public:
+			Monitor();
+			~Monitor();
+
+			Monitor(const Monitor&) = delete;
+			Monitor& operator=(const Monitor&) = delete;
+
+			// Becomes readable when events are pending
+			int fd() const;
+
+			// Applies all pending events without blocking, and returns
+			// the number of devices that were changed.
+			size_t process();
+
+			private:
+			struct Impl;
+			std::unique_ptr<Impl> _impl;
+		};
+
+		// Incremented whenever a new snapshot is published
+		static uint64_t generation();
+
+		static Devices getDisks(const Properties& criteria = Properties())
 		{ return getDisksOrPartitions(criteria, true); }
 
-		static std::map<std::string, Properties> getPartitions(
-				const Properties& criteria = Properties())
+		static Devices getPartitions(const Properties& criteria = Properties())
 		{ return getDisksOrPartitions(criteria, false); }
 
-		static size_t blockSize(const Properties& props);
+		// Number of threads used to enumerate devices. Zero means one
+		// per CPU, if there are enough devices to make it worthwhile.
+		static void setEnumerationThreads(unsigned threads);
+
+		// Use raw disk images instead of the OS's devices. Each image
+		// is a disk, its partitions are named <image>#p<number>. Must
+		// be called before the first query.
+		static void setImages(const std::vector<std::string>& paths);
+
+		// Writes all devices, and everything read from their partition
+		// tables, to a file once they have been enumerated.
+		static void setRecordFile(const std::string& filename);
+
+		// Serves devices from a recording, instead of the OS's
+		static void setReplayFile(const std::string& filename);
+
+		// Devices enumerated from the OS are stored in an index file,
+		// which is reused by later processes until a device changes.
+		// An empty filename disables the index.
+		static void setIndexFile(const std::string& filename);
+
+		static const std::string kDefaultIndexFile;
 
 		static bool isDisk(const Properties& props)
 		{ return isDiskOrPartition(props, true); }
@@ -64,14 +293,29 @@ namespace letterman {
 		// available on the current OS (such as kPropMbrId on OS X)
 		static const std::string kNoMatchIfSetAsPropKey;
 
-		static std::map<std::string, Properties> getAllDevices();
-		static std::map<std::string, Properties> getDisksOrPartitions(
-				const Properties& criteria, bool getDisks);
+		// Enumerates all devices (implemented in devtree_<os>.cc)
+		static void getAllDevices(Builder& builder);
+		static unsigned getEnumerationThreads();
+		// Enumerates disk images (devtree_image.cc); returns false
+		// if there are none.
+		static bool getImageDevices(Builder& builder);
+		// Recording and replay (devtree_replay.cc)
+		static bool getReplayDevices(Builder& builder);
+		static void saveRecording(const Devices& devices);
+		static bool isRecording();
 
-		static bool isDiskOrPartition(const Properties& props, bool isDisk);
+		// Identifies the current state of the OS's devices, see
+		// devtree_<os>.cc. Returns false if that isn't possible.
+		static bool getIndexTag(std::string& tag);
+		static std::shared_ptr<Snapshot> loadIndex(const std::string& tag);
+		static void saveIndex(const Snapshot& snapshot, const std::string& tag);
+		static std::shared_ptr<const Snapshot> getSnapshot();
+		// Replaces the named devices by those in the builder (if any)
+		static void update(const std::set<std::string>& names, Builder& changed);
+		static Devices getDisksOrPartitions(const Properties& criteria,
+				bool getDisks);
 
-		static bool arePropsMatching(
-				const Properties& all, const Properties& criteria);
+		static bool isDiskOrPartition(const Properties& props, bool isDisk);
 	};
 }
 #endif
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <vector>
+#include <string>
+#include "partition_table.h"
+#include "block_device.h"
+#include "thread_pool.h"
+#include "exception.h"
+#include "devtree.h"
+#include "gpt.h"
+#include "mbr.h"
+#include "util.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		vector<string> images;
+
+		const size_t kImageBlockSize = 512;
+
+		void addPartition(DevTree::Builder& builder, const string& image,
+				unsigned number, uint64_t lbaStart, const string& guid)
+		{
+			string name(image + "#p" + util::toString(number));
+
+			builder.begin();
+			builder.set(DevTree::kPropDeviceName, name);
+			builder.set(DevTree::kPropDeviceMountable, name);
+			builder.set(DevTree::kPropDeviceReadable, name);
+			builder.set(DevTree::kPropDiskId, image);
+			builder.set(DevTree::kPropPartUuid, guid);
+			builder.set(DevTree::kPropPartOffsetBlocks,
+					util::toString(lbaStart * kImageBlockSize / 512));
+			builder.set(DevTree::kPropPartOffsetBytes,
+					util::toString(lbaStart * kImageBlockSize));
+			builder.end(name, false);
+		}
+
+		void addImage(DevTree::Builder& builder, const string& image)
+		{
+			if (!BlockDevice::open(image)) {
+				throw ErrnoException("open: " + image);
+			}
+
+			builder.begin();
+			builder.set(DevTree::kPropDeviceName, image);
+			builder.set(DevTree::kPropDeviceMountable, image);
+			builder.set(DevTree::kPropDeviceReadable, image);
+			builder.set(DevTree::kPropDiskId, image);
+			builder.set(DevTree::kPropLbaSize, util::toString(kImageBlockSize));
+			builder.end(image, true);
+
+			GPT::Ptr gpt(GPT::get(image, kImageBlockSize));
+
+			if (gpt) {
+				for (auto& p : gpt->partitions) {
+					addPartition(builder, image, p.number, p.lbaStart, p.guid);
+				}
+
+				return;
+			}
+
+			PartitionTable::Ptr table(PartitionTable::get(image, "",
+						kImageBlockSize));
+
+			if (table) {
+				for (auto& p : table->partitions) {
+					if (!MBR::isExtended(p.type)) {
+						addPartition(builder, image, p.number, p.lbaStart, "");
+					}
+				}
+			}
+		}
+	}
+
+	void DevTree::setImages(const vector<string>& paths)
+	{
+		images = paths;
+	}
+
+	bool DevTree::getImageDevices(Builder& builder)
+	{
+		if (images.empty()) return false;
+
+		unsigned threads = getEnumerationThreads();
+		if (!threads) threads = ThreadPool::defaultSize();
+		threads = min<size_t>(threads, images.size());
+
+		vector<Builder> builders(images.size());
+		ThreadPool pool(threads);
+
+		for (size_t i = 0; i != images.size(); ++i) {
+			pool.post([&builders, i] () { addImage(builders[i], images[i]); });
+		}
+
+		pool.wait();
+
+		for (auto& b : builders) {
+			builder.append(b);
+		}
+
+		return true;
+	}
+}
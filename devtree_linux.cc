@@ -1,15 +1,24 @@
 #ifdef LETTERMAN_LINUX
 #include <libudev.h>
+#include <unordered_map>
 #include <algorithm>
-#include <mntent.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <fstream>
 #include <sstream>
 #include <memory>
 #include <string>
+#include <vector>
 #include <map>
+#include <set>
+#include "mount_table.h"
+#include "partition_table.h"
+#include "thread_pool.h"
 #include "exception.h"
 #include "devtree.h"
+#include "gpt.h"
 #include "util.h"
 using namespace std;
 
@@ -20,7 +29,7 @@ namespace letterman {
 			"ID_FS_LABEL_ENC", "UDISKS_PARTITION_NUMBER", "UDISKS_PARTITION_OFFSET",
 			"ID_DRIVE_FLOPPY", "MAJOR", "MINOR", "ID_SERIAL", "ID_SERIAL_SHORT",
 			"ID_PART_ENTRY_DISK", "DEVTYPE", "ID_PART_TABLE_UUID", "ID_PART_ENTRY_UUID",
-			"ID_FS_TYPE", "ID_MODEL", "DEVPATH"
+			"ID_FS_TYPE", "ID_MODEL", "DEVPATH", "ID_WWN_WITH_EXTENSION"
 		};
 
 
@@ -36,29 +45,146 @@ namespace letterman {
 			return ::basename(s);
 		}
 
-		string getMountPoint(const string& device)
+		string getMountPoint(const MountTable& mounts, DevTree::Builder& builder,
+				const string& device)
 		{
-			FILE* fp = setmntent("/proc/mounts", "r");
-			if (!fp) fp = setmntent("/etc/mtab", "r");
-			if (!fp) throw ErrnoException("setmntent");
-
-			struct mntent* mnt;
-			while ((mnt = getmntent(fp))) {
-				if (device == mnt->mnt_fsname) {
-					return mnt->mnt_dir;
+			dev_t devNum = makedev(
+					strtoul(builder.get("MAJOR").c_str(), NULL, 10),
+					strtoul(builder.get("MINOR").c_str(), NULL, 10));
+
+			const MountTable::Mount* m = mounts.find(device, devNum);
+			return m ? m->target : "";
+		}
+
+		// Reads an attribute relative to the device's sysfs directory
+		void getSysAttr(DevTree::Builder& builder, int dirfd, const string& target,
+				const char* name)
+		{
+			char buf[256];
+			ssize_t len = -1;
+
+			int fd = dirfd >= 0 ? openat(dirfd, name, O_RDONLY | O_CLOEXEC) : -1;
+			if (fd >= 0) {
+				len = read(fd, buf, sizeof(buf));
+				close(fd);
+			}
+
+			if (len < 0) {
+				// TODO warning in debug mode
+				len = 0;
+			}
+
+			const char* end = static_cast<const char*>(memchr(buf, '\n', len));
+			builder.set(DevTree::propId(target), buf, end ? end - buf : len);
+		}
+
+		typedef unordered_map<util::StringRef, DevTree::PropId,
+				util::StringRef::Hash> PropIds;
+
+		// Ids of the udev properties we're interested in
+		const PropIds& getPropIds()
+		{
+			static const PropIds ids = [] () {
+				PropIds ids;
+				for (const char* key : PROPS) {
+					ids[key] = DevTree::propId(key);
 				}
+				return ids;
+			}();
+
+			return ids;
+		}
+
+		// Below this, threads cost more than they save
+		const size_t kMinDevicesPerThread = 64;
+
+		typedef util::UniquePtrWithDeleter<udev> UdevPtr;
+
+		// A udev context must not be shared between threads
+		UdevPtr newUdev()
+		{
+			UdevPtr udev(udev_new(), [] (struct udev* p) { udev_unref(p); });
+			if (!udev) {
+				throw ErrnoException("udev_new");
 			}
 
-			return "";
+			return udev;
 		}
 
-		void getSysAttr(Properties& props, const string& target,
-				const string& name)
+		void addDevice(struct udev* udev, const string& path,
+				const MountTable& mounts, DevTree::Builder& builder)
 		{
-			string filename("/sys/" + props["DEVPATH"] + "/" + name);
-			ifstream in(filename.c_str());
-			if (!in.good() || !getline(in, props[target])) {
-				// TODO warning in debug mode
+			const PropIds& ids = getPropIds();
+
+			util::UniquePtrWithDeleter<udev_device> dev(
+					udev_device_new_from_syspath(udev, path.c_str()),
+					[] (udev_device* p) { udev_device_unref(p); });
+
+			if (!dev) return;
+
+			builder.begin();
+
+			// Single pass over the device's properties, rather than
+			// one lookup per property we're interested in.
+			udev_list_entry* prop;
+			udev_list_entry_foreach(prop,
+					udev_device_get_properties_list_entry(dev.get())) {
+				auto iter = ids.find(udev_list_entry_get_name(prop));
+				const char* value = udev_list_entry_get_value(prop);
+				if (iter != ids.end() && value) {
+					builder.set(iter->second, value, strlen(value));
+				}
+			}
+
+			string type(builder.get("DEVTYPE"));
+
+			if (builder.get("ID_DRIVE_FLOPPY") == "1"
+					|| (type != "disk" && type != "partition")) {
+				builder.discard();
+				return;
+			}
+
+			int dirfd = open(udev_device_get_syspath(dev.get()),
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			auto cleaner(util::createCleaner([dirfd] () {
+				if (dirfd >= 0) close(dirfd);
+			}));
+
+			string devName(builder.get("DEVNAME"));
+
+			if (type == "disk") {
+				builder.set(DevTree::kPropDiskId, builder.get("MAJOR") + ":"
+						+ builder.get("MINOR"));
+				getSysAttr(builder, dirfd, DevTree::kPropLbaSize,
+						"queue/logical_block_size");
+			} else {
+				builder.set(DevTree::kPropDiskId, builder.get("ID_PART_ENTRY_DISK"));
+				builder.set(DevTree::kPropIsNtfs, (builder.get("ID_FS_TYPE") == "ntfs" ?
+						"1" : "0"));
+				builder.set(DevTree::kPropMountPoint,
+						getMountPoint(mounts, builder, devName));
+
+				if (builder.get(DevTree::kPropPartOffsetBlocks).empty()) {
+					getSysAttr(builder, dirfd, DevTree::kPropPartOffsetBlocks, "start");
+				}
+			}
+
+			string uuid(builder.get(DevTree::kPropPartUuid));
+			capitalize(uuid);
+			builder.set(DevTree::kPropPartUuid, uuid);
+
+			string name(basename(devName));
+			builder.set(DevTree::kPropDeviceName, name);
+			builder.end(name, type == "disk");
+		}
+
+		void addDevices(const vector<string>& paths, size_t begin, size_t end,
+				const MountTable& mounts, DevTree::Builder& builder)
+		{
+			UdevPtr udev(newUdev());
+
+			for (size_t i = begin; i != end; ++i) {
+				addDevice(udev.get(), paths[i], mounts, builder);
 			}
 		}
 	}
@@ -72,6 +198,8 @@ namespace letterman {
 	const string DevTree::kPropFsLabel = "ID_FS_LABEL";
 	const string DevTree::kPropPartUuid = "ID_PART_ENTRY_UUID";
 	const string DevTree::kPropHardware = "ID_MODEL";
+	const string DevTree::kPropSerial = "ID_SERIAL";
+	const string DevTree::kPropWwn = "ID_WWN_WITH_EXTENSION";
 	const string DevTree::kPropLbaSize = "kPropLbaSize";
 
 	const string DevTree::kPropMountPoint = "kPropMountPoint";
@@ -79,69 +207,158 @@ namespace letterman {
 	const string DevTree::kPropPartOffsetBlocks = "ID_PART_ENTRY_OFFSET"; 
 	const string DevTree::kPropPartOffsetBytes = "UDISKS_PARTITION_OFFSET";
 
-	map<string, Properties> DevTree::getAllDevices()
+	void DevTree::getAllDevices(Builder& builder)
 	{
-		static map<string, Properties> entries;
-		if (!entries.empty()) return entries;
+		vector<string> paths;
+
+		{
+			UdevPtr udev(newUdev());
+
+			util::UniquePtrWithDeleter<udev_enumerate> enumerate(
+					udev_enumerate_new(udev.get()),
+					[] (udev_enumerate* p) { udev_enumerate_unref(p); });
+
+			udev_enumerate_add_match_subsystem(enumerate.get(), "block");
+			udev_enumerate_scan_devices(enumerate.get());
+
+			udev_list_entry *devices, *dev_list_entry;
+			devices = udev_enumerate_get_list_entry(enumerate.get());
+
+			udev_list_entry_foreach(dev_list_entry, devices) {
+				paths.push_back(udev_list_entry_get_name(dev_list_entry));
+			}
+		}
+
+		MountTable::Ptr mounts(MountTable::get(true));
 
-		util::UniquePtrWithDeleter<udev> udev(udev_new(),
-				[] (struct udev* p) { udev_unref(p); });
-		if (!udev) {
-			throw ErrnoException("udev_new");
+		unsigned threads = getEnumerationThreads();
+		if (!threads) {
+			threads = min<size_t>(ThreadPool::defaultSize(),
+					paths.size() / kMinDevicesPerThread);
 		}
 
-		util::UniquePtrWithDeleter<udev_enumerate> enumerate(
-				udev_enumerate_new(udev.get()),
-				[] (udev_enumerate* p) { udev_enumerate_unref(p); });
+		threads = min<size_t>(threads, paths.size());
+
+		if (threads <= 1) {
+			addDevices(paths, 0, paths.size(), *mounts, builder);
+			return;
+		}
+
+		// Contiguous shards, merged in order, so the result is the
+		// same as that of a serial enumeration.
+		vector<Builder> builders(threads);
+		ThreadPool pool(threads);
+
+		for (unsigned i = 0; i != threads; ++i) {
+			pool.post([&, i] () {
+				addDevices(paths, paths.size() * i / threads,
+						paths.size() * (i + 1) / threads, *mounts, builders[i]);
+			});
+		}
+
+		pool.wait();
+
+		for (auto& b : builders) {
+			builder.append(b);
+		}
+	}
+
+	struct DevTree::Monitor::Impl
+	{
+		UdevPtr udev;
+		util::UniquePtrWithDeleter<udev_monitor> monitor;
+	};
+
+	DevTree::Monitor::Monitor()
+	: _impl(new Impl)
+	{
+		_impl->udev = newUdev();
+		_impl->monitor = util::UniquePtrWithDeleter<udev_monitor>(
+				udev_monitor_new_from_netlink(_impl->udev.get(), "udev"),
+				[] (udev_monitor* p) { udev_monitor_unref(p); });
 
-		udev_enumerate_add_match_subsystem(enumerate.get(), "block");
-		udev_enumerate_scan_devices(enumerate.get());
+		if (!_impl->monitor) throw ErrnoException("udev_monitor_new_from_netlink");
 
-		udev_list_entry *devices, *dev_list_entry;
-		devices = udev_enumerate_get_list_entry(enumerate.get());
+		if (udev_monitor_filter_add_match_subsystem_devtype(
+					_impl->monitor.get(), "block", NULL) < 0
+				|| udev_monitor_enable_receiving(_impl->monitor.get()) < 0) {
+			throw ErrnoException("udev_monitor_enable_receiving");
+		}
 
+		// Enumerate only once we're receiving events, so none are lost.
+		// Events for devices that are already up to date are harmless.
+		getSnapshot();
+	}
 
-		udev_list_entry_foreach(dev_list_entry, devices) {
+	DevTree::Monitor::~Monitor()
+	{}
 
-			const char* path = udev_list_entry_get_name(dev_list_entry);
+	int DevTree::Monitor::fd() const
+	{
+		return udev_monitor_get_fd(_impl->monitor.get());
+	}
+
+	size_t DevTree::Monitor::process()
+	{
+		set<string> names;
+		vector<string> paths;
+
+		// The monitor's socket is non-blocking, so this returns NULL
+		// once all pending events have been received.
+		while (true) {
 			util::UniquePtrWithDeleter<udev_device> dev(
-					udev_device_new_from_syspath(udev.get(), path),
+					udev_monitor_receive_device(_impl->monitor.get()),
 					[] (udev_device* p) { udev_device_unref(p); });
 
-			Properties props;
+			if (!dev) break;
+
+			const char* devName = udev_device_get_property_value(dev.get(),
+					"DEVNAME");
+			if (!devName) continue;
 
-			for (const char* key : PROPS) {
-				const char* prop = udev_device_get_property_value(dev.get(), key);
-				props[key] = prop ? prop : "";
+			// Removed devices are simply not re-added
+			PartitionTable::invalidate(devName);
+			GPT::invalidate(devName);
+			names.insert(basename(devName));
+
+			const char* action = udev_device_get_action(dev.get());
+			if (!action || string(action) != "remove") {
+				paths.push_back(udev_device_get_syspath(dev.get()));
 			}
+		}
 
-			if (props["ID_DRIVE_FLOPPY"] == "1") continue;
-
-			if (!props.empty()) {
-				if (isDisk(props)) {
-					props[kPropDiskId] = props["MAJOR"] + ":" + props["MINOR"];
-					getSysAttr(props, kPropLbaSize, "queue/logical_block_size");
-				} else if (isPartition(props)) {
-					props[kPropDiskId] = props["ID_PART_ENTRY_DISK"];
-					props[kPropIsNtfs] = (props["ID_FS_TYPE"] == "ntfs" ?
-							"1" : "0");
-					props[kPropMountPoint] = getMountPoint(props["DEVNAME"]);
-
-					if (props[kPropPartOffsetBlocks].empty()) {
-						getSysAttr(props, kPropPartOffsetBlocks, "start");
-					}
-				} else {
-					continue;
-				}
+		if (names.empty()) return 0;
 
-				props[kPropDeviceName] = basename(props["DEVNAME"]);
-				capitalize(props[kPropPartUuid]);
+		Builder changed;
+		addDevices(paths, 0, paths.size(), *MountTable::get(true), changed);
+		update(names, changed);
 
-				entries[props[kPropDeviceName]] = props;
-			}
+		return names.size();
+	}
+
+	bool DevTree::getIndexTag(string& tag)
+	{
+		string bootId, seqnum;
+
+		if (!getline(ifstream("/proc/sys/kernel/random/boot_id"), bootId)
+				|| !getline(ifstream("/sys/kernel/uevent_seqnum"), seqnum)) {
+			return false;
+		}
+
+		// Mounting doesn't cause a uevent, but mount points are part of
+		// the index. Only mounts of block devices matter, so container
+		// churn (overlay, tmpfs, ...) doesn't invalidate the index.
+		string mounts;
+		for (auto& m : MountTable::get(true)->mounts()) {
+			if (m.source.compare(0, 5, "/dev/")) continue;
+			mounts += m.source + '\0' + m.target + '\0';
 		}
 
-		return entries;
+		ostringstream ostr;
+		ostr << bootId << " " << seqnum << " " << hex
+			<< util::StringRef::Hash()(util::StringRef(mounts.data(), mounts.size()));
+		tag = ostr.str();
+		return true;
 	}
 
 	bool DevTree::isDiskOrPartition(const Properties& props, bool isDisk)
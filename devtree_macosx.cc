@@ -117,6 +117,7 @@ namespace letterman {
 			kDADiskDescriptionMediaBlockSizeKey, false);
 
 	const string DevTree::kPropSerial = "kPropSerial";
+	const string DevTree::kPropWwn = DevTree::kNoMatchIfSetAsPropKey;
 	const string DevTree::kPropHardware = "kPropHardware";
 	const string DevTree::kPropDeviceMountable = "kPropDeviceMountable";
 	const string DevTree::kPropDeviceReadable = "kPropDeviceReadable";
@@ -124,10 +125,9 @@ namespace letterman {
 	const string DevTree::kPropPartOffsetBlocks = DevTree::kNoMatchIfSetAsPropKey;
 	const string DevTree::kPropPartOffsetBytes = DevTree::kNoMatchIfSetAsPropKey;
 
-	map<string, Properties> DevTree::getAllDevices()
+	void DevTree::getAllDevices(Builder& builder)
 	{
-		static map<string, Properties> ret;
-		if (!ret.empty()) return ret;
+		map<string, Properties> ret;
 
 		kern_return_t kr;
 		io_iterator_t iter;
@@ -286,9 +286,17 @@ namespace letterman {
 			props[kPropHardware] = props[kPropVendor] + props[kPropModel];
 			util::rtrim(props[kPropHardware]);
 			util::replaceAll(props[kPropHardware], ' ', '_');
-		}
 
-		return ret;
+			if (!isDisk(props) && !isPartition(props)) continue;
+
+			builder.begin();
+
+			for (auto& prop : props) {
+				builder.set(prop.first, prop.second);
+			}
+
+			builder.end(dev.first, isDisk(props));
+		}
 	}
 
 	bool DevTree::isDiskOrPartition(const Properties& props, bool isDisk)
@@ -296,5 +304,32 @@ namespace letterman {
 		auto i = props.find(kPropIsDisk);
 		return i != props.end() && i->second == (isDisk ? "1" : "0");
 	}
+
+	bool DevTree::getIndexTag(string&)
+	{
+		// No equivalent of uevent_seqnum, so no index
+		return false;
+	}
+
+	struct DevTree::Monitor::Impl
+	{};
+
+	DevTree::Monitor::Monitor()
+	{
+		throw UserFault("Device monitoring is not supported on OS X");
+	}
+
+	DevTree::Monitor::~Monitor()
+	{}
+
+	int DevTree::Monitor::fd() const
+	{
+		return -1;
+	}
+
+	size_t DevTree::Monitor::process()
+	{
+		return 0;
+	}
 }
 #endif
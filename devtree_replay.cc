@@ -0,0 +1,223 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include "block_device.h"
+#include "exception.h"
+#include "devtree.h"
+#include "gpt.h"
+#include "util.h"
+using namespace std;
+
+// Recordings are line-based text files. Devices are listed first,
+// followed by everything that was read from them:
+//
+// letterman-devtree 1
+// disk sda
+// 	DEVNAME /dev/sda
+// partition sda1
+// 	DEVNAME /dev/sda1
+// blocks /dev/sda 256060514304
+// 	0 33c0...
+//
+// Names, keys and values are percent-encoded, data is hex-encoded.
+
+namespace letterman {
+	namespace {
+		const string kMagic = "letterman-devtree";
+		const unsigned kVersion = 1;
+
+		string recordFile;
+		string replayFile;
+
+		string encode(util::StringRef str)
+		{
+			ostringstream ostr;
+			ostr << hex << uppercase << setfill('0');
+
+			for (size_t i = 0; i != str.size(); ++i) {
+				unsigned char c = str.data()[i];
+				if (c <= ' ' || c == '%' || c >= 0x7f) {
+					ostr << '%' << setw(2) << unsigned(c);
+				} else {
+					ostr << c;
+				}
+			}
+
+			return ostr.str();
+		}
+
+		string encodeHex(const string& data)
+		{
+			static const char digits[] = "0123456789abcdef";
+			string ret;
+			ret.reserve(data.size() * 2);
+
+			for (unsigned char c : data) {
+				ret += digits[c >> 4];
+				ret += digits[c & 0xf];
+			}
+
+			return ret;
+		}
+
+		unsigned fromHex(char c)
+		{
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			throw UserFault(string("Invalid hex digit in recording: ") + c);
+		}
+
+		string decode(const string& str)
+		{
+			string ret;
+
+			for (size_t i = 0; i < str.size(); ++i) {
+				if (str[i] == '%' && i + 2 < str.size()) {
+					ret += char(fromHex(str[i + 1]) * 16 + fromHex(str[i + 2]));
+					i += 2;
+				} else {
+					ret += str[i];
+				}
+			}
+
+			return ret;
+		}
+
+		string decodeHex(const string& str)
+		{
+			string ret;
+
+			for (size_t i = 0; i + 1 < str.size(); i += 2) {
+				ret += char(fromHex(str[i]) * 16 + fromHex(str[i + 1]));
+			}
+
+			return ret;
+		}
+
+		[[noreturn]] void throwInvalid(const string& filename, unsigned line)
+		{
+			throw UserFault("Invalid recording " + filename + ", line "
+					+ util::toString(line));
+		}
+	}
+
+	void DevTree::setRecordFile(const string& filename)
+	{
+		recordFile = filename;
+		BlockDevice::startRecording();
+	}
+
+	bool DevTree::isRecording()
+	{
+		return !recordFile.empty();
+	}
+
+	void DevTree::setReplayFile(const string& filename)
+	{
+		replayFile = filename;
+	}
+
+	void DevTree::saveRecording(const Devices& devices)
+	{
+		if (recordFile.empty()) return;
+
+		// Partition tables are read lazily, so make sure the
+		// recording contains everything a query might need.
+		for (auto dev : devices) {
+			if (!dev.isDisk()) continue;
+			dev.partitionTable();
+			GPT::get(dev.get(kPropDeviceReadable), dev.blockSize());
+		}
+
+		ofstream out(recordFile.c_str());
+		out << kMagic << " " << kVersion << endl;
+
+		for (auto dev : devices) {
+			out << (dev.isDisk() ? "disk " : "partition ") << encode(dev.name())
+				<< endl;
+
+			for (auto& prop : dev.props()) {
+				out << "\t" << encode(propName(prop.first)) << " "
+					<< encode(prop.second) << endl;
+			}
+		}
+
+		for (auto& r : BlockDevice::getRecordings()) {
+			out << "blocks " << encode(r.first) << " " << r.second.size << endl;
+
+			for (auto& read : r.second.reads) {
+				out << "\t" << read.first << " " << encodeHex(read.second) << endl;
+			}
+		}
+
+		if (!out) throw ErrnoException("write: " + recordFile);
+	}
+
+	bool DevTree::getReplayDevices(Builder& builder)
+	{
+		if (replayFile.empty()) return false;
+
+		ifstream in(replayFile.c_str());
+		if (!in) throw ErrnoException("open: " + replayFile);
+
+		string line, magic;
+		unsigned version = 0, lineNo = 1;
+
+		if (!getline(in, line) || !(istringstream(line) >> magic >> version)
+				|| magic != kMagic || version != kVersion) {
+			throw UserFault("Not a device recording: " + replayFile);
+		}
+
+		BlockDevice::Recordings recordings;
+		BlockDevice::Recording* blocks = nullptr;
+		string name;
+		bool isDisk = false, inDevice = false;
+
+		auto endDevice = [&] () {
+			if (inDevice) builder.end(name, isDisk);
+			inDevice = false;
+		};
+
+		while (getline(in, line)) {
+			++lineNo;
+			istringstream istr(line);
+			string type, arg;
+
+			if (!(istr >> type >> arg)) {
+				if (line.empty()) continue;
+				throwInvalid(replayFile, lineNo);
+			}
+
+			if (line[0] == '\t') {
+				if (inDevice) {
+					builder.set(decode(type), decode(arg));
+				} else if (blocks) {
+					blocks->reads[util::fromString<uint64_t>(type)] = decodeHex(arg);
+				} else {
+					throwInvalid(replayFile, lineNo);
+				}
+			} else if (type == "disk" || type == "partition") {
+				endDevice();
+				builder.begin();
+				name = decode(arg);
+				isDisk = (type == "disk");
+				inDevice = true;
+			} else if (type == "blocks") {
+				endDevice();
+				uint64_t size;
+				if (!(istr >> size)) throwInvalid(replayFile, lineNo);
+				blocks = &recordings[decode(arg)];
+				blocks->size = size;
+			} else {
+				throwInvalid(replayFile, lineNo);
+			}
+		}
+
+		endDevice();
+		BlockDevice::replay(recordings);
+		return true;
+	}
+}
@@ -10,25 +10,25 @@ namespace letterman {
 	{
 		public:
 		ErrnoException(const std::string& function, int errnum = errno)
-		: _function(function), _errnum(errnum) {}
+		: _function(function), _errnum(errnum), _msg("error: " + function)
+		{
+			if (_errnum) {
+				_msg.append(": ");
+				_msg.append(std::strerror(_errnum));
+			}
+		}
 
 		virtual ~ErrnoException() throw() {}
 
 		virtual const char *what() const throw()
 		{
-			std::string msg("error: " + _function);
-
-			if (_errnum) {
-				msg.append(": ");
-			   	msg.append(std::strerror(_errnum));
-			}
-
-			return msg.c_str();
+			return _msg.c_str();
 		}
 
 		private:
 		std::string _function;
 		int _errnum;
+		std::string _msg;
 	};
 
 	class UserFault : public std::runtime_error
@@ -0,0 +1,258 @@
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <map>
+#include "block_device.h"
+#include "endian.h"
+#include "util.h"
+#include "gpt.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		struct Header
+		{
+			char signature[8];
+			uint32_t revision;
+			uint32_t headerSize;
+			uint32_t headerCrc;
+			uint32_t reserved;
+			uint64_t myLba;
+			uint64_t alternateLba;
+			uint64_t firstUsableLba;
+			uint64_t lastUsableLba;
+			char diskGuid[16];
+			uint64_t entriesLba;
+			uint32_t numEntries;
+			uint32_t entrySize;
+			uint32_t entriesCrc;
+		} __attribute__((packed));
+
+		static_assert(sizeof(Header) == 92, "GPT header is not 92 bytes");
+
+		struct Entry
+		{
+			char typeGuid[16];
+			char guid[16];
+			uint64_t firstLba;
+			uint64_t lastLba;
+			uint64_t attributes;
+			uint16_t name[36];
+		} __attribute__((packed));
+
+		static_assert(sizeof(Entry) == 128, "GPT entry is not 128 bytes");
+
+		// Anything larger is most likely garbage
+		const size_t kMaxEntriesSize = 4 * 1024 * 1024;
+
+		// Slice-by-8 tables for the reflected CRC-32 polynomial used by
+		// GPT (and zlib). tables[k][i] is the CRC of byte i followed by
+		// k zero bytes.
+		struct Crc32Tables
+		{
+			Crc32Tables()
+			{
+				for (uint32_t i = 0; i != 256; ++i) {
+					uint32_t crc = i;
+					for (int k = 0; k != 8; ++k) {
+						crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+					}
+					t[0][i] = crc;
+				}
+
+				for (uint32_t i = 0; i != 256; ++i) {
+					for (int k = 1; k != 8; ++k) {
+						t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+					}
+				}
+			}
+
+			uint32_t t[8][256];
+		};
+
+		const Crc32Tables& getCrc32Tables()
+		{
+			static const Crc32Tables tables;
+			return tables;
+		}
+
+		bool readHeader(BlockDevice& dev, size_t blockSize, uint64_t lba, Header& header)
+		{
+			vector<char> block(blockSize);
+
+			if (!dev.read(lba * blockSize, block.data(), blockSize)) {
+				return false;
+			}
+
+			memcpy(&header, block.data(), sizeof(header));
+
+			if (memcmp(header.signature, "EFI PART", 8)) return false;
+
+			size_t headerSize = le32toh(header.headerSize);
+			if (headerSize < sizeof(Header) || headerSize > blockSize) return false;
+
+			// The CRC is calculated with the CRC field zeroed
+			uint32_t headerCrc = le32toh(header.headerCrc);
+			memset(block.data() + offsetof(Header, headerCrc), 0, 4);
+
+			if (GPT::crc32(block.data(), headerSize) != headerCrc) return false;
+
+			header.revision = le32toh(header.revision);
+			header.headerSize = headerSize;
+			header.headerCrc = headerCrc;
+			header.myLba = le64toh(header.myLba);
+			header.alternateLba = le64toh(header.alternateLba);
+			header.firstUsableLba = le64toh(header.firstUsableLba);
+			header.lastUsableLba = le64toh(header.lastUsableLba);
+			header.entriesLba = le64toh(header.entriesLba);
+			header.numEntries = le32toh(header.numEntries);
+			header.entrySize = le32toh(header.entrySize);
+			header.entriesCrc = le32toh(header.entriesCrc);
+
+			return header.myLba == lba;
+		}
+
+		bool readEntries(BlockDevice& dev, size_t blockSize, const Header& header,
+				vector<char>& entries)
+		{
+			if (header.entrySize < sizeof(Entry) || header.entrySize % 8) {
+				return false;
+			}
+
+			uint64_t size = uint64_t(header.numEntries) * header.entrySize;
+			if (size > kMaxEntriesSize) return false;
+
+			entries.resize(size);
+
+			return dev.read(header.entriesLba * blockSize, entries.data(), size)
+				&& GPT::crc32(entries.data(), size) == header.entriesCrc;
+		}
+
+		bool isZero(const char* p, size_t len)
+		{
+			while (len--) {
+				if (*p++) return false;
+			}
+
+			return true;
+		}
+	}
+
+	uint32_t GPT::crc32(const void* data, size_t len, uint32_t crc)
+	{
+		const uint32_t (&t)[8][256] = getCrc32Tables().t;
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+
+		crc = ~crc;
+
+		for (; len >= 8; p += 8, len -= 8) {
+			uint32_t lo, hi;
+			memcpy(&lo, p, 4);
+			memcpy(&hi, p + 4, 4);
+			lo = le32toh(lo) ^ crc;
+			hi = le32toh(hi);
+
+			crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+				^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+				^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+				^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+		}
+
+		while (len--) {
+			crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		}
+
+		return ~crc;
+	}
+
+	bool GPT::read(BlockDevice& dev, size_t blockSize)
+	{
+		Header header;
+		vector<char> entries;
+
+		bool havePrimary = readHeader(dev, blockSize, 1, header);
+		isBackup = !havePrimary || !readEntries(dev, blockSize, header, entries);
+
+		if (isBackup) {
+			// The backup header is usually in the last block, but the
+			// primary knows better, if it is intact.
+			uint64_t lba = header.alternateLba;
+
+			if (!havePrimary) {
+				uint64_t size = dev.size();
+				if (size < blockSize * 2) return false;
+				lba = size / blockSize - 1;
+			}
+
+			if (!readHeader(dev, blockSize, lba, header)
+					|| !readEntries(dev, blockSize, header, entries)) {
+				return false;
+			}
+		}
+
+		diskGuid = util::guidToString(header.diskGuid);
+		partitions.clear();
+
+		for (uint32_t i = 0; i != header.numEntries; ++i) {
+			Entry e;
+			memcpy(&e, entries.data() + size_t(i) * header.entrySize, sizeof(e));
+
+			if (isZero(e.typeGuid, sizeof(e.typeGuid))) continue;
+
+			partitions.push_back(Partition{ i + 1, util::guidToString(e.typeGuid),
+					util::guidToString(e.guid), le64toh(e.firstLba),
+					le64toh(e.lastLba) });
+		}
+
+		return true;
+	}
+
+	namespace {
+		mutex cacheLock;
+		map<string, GPT::Ptr> cache;
+	}
+
+	GPT::Ptr GPT::get(const string& device, size_t blockSize)
+	{
+		{
+			lock_guard<mutex> guard(cacheLock);
+			auto iter = cache.find(device);
+			if (iter != cache.end()) return iter->second;
+		}
+
+		shared_ptr<GPT> gpt;
+		BlockDevice::Ptr dev(BlockDevice::open(device));
+
+		if (dev) {
+			gpt = make_shared<GPT>();
+			if (!gpt->read(*dev, blockSize)) gpt.reset();
+		}
+
+		lock_guard<mutex> guard(cacheLock);
+		return cache[device] = gpt;
+	}
+
+	void GPT::invalidate(const string& device)
+	{
+		lock_guard<mutex> guard(cacheLock);
+		cache.erase(device);
+	}
+
+	void GPT::Index::add(const string& disk, const GPT& gpt, size_t blockSize)
+	{
+		for (auto& p : gpt.partitions) {
+			// The first disk wins if GUIDs are not unique (cloned disks)
+			_locations.insert(make_pair(p.guid,
+					Location{ disk, p.number, p.lbaStart * blockSize }));
+		}
+	}
+
+	const GPT::Index::Location* GPT::Index::find(const string& guid) const
+	{
+		string key(guid);
+		util::capitalize(key);
+
+		auto iter = _locations.find(key);
+		return iter != _locations.end() ? &iter->second : nullptr;
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef LETTERMAN_GPT_H
+#define LETTERMAN_GPT_H
+#include <unordered_map>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace letterman {
+	class BlockDevice;
+
+	// GUID partition table of a disk. The primary header and entry
+	// array are used if their CRCs match, otherwise the backup.
+	struct GPT
+	{
+		struct Partition
+		{
+			unsigned number;
+			std::string typeGuid;
+			std::string guid;
+			uint64_t lbaStart;
+			uint64_t lbaEnd;
+		};
+
+		typedef std::shared_ptr<const GPT> Ptr;
+
+		std::string diskGuid;
+		std::vector<Partition> partitions;
+		bool isBackup;
+
+		// Returns false if there is no valid GPT
+		bool read(BlockDevice& dev, size_t blockSize);
+
+		// Returns NULL if the device has no valid GPT. Tables are cached
+		// per process by device.
+		static Ptr get(const std::string& device, size_t blockSize);
+		static void invalidate(const std::string& device);
+
+		static uint32_t crc32(const void* data, size_t len, uint32_t crc = 0);
+
+		// Maps partition GUIDs to their location, across disks
+		class Index
+		{
+			public:
+			struct Location
+			{
+				std::string disk;
+				unsigned number;
+				uint64_t offset;
+			};
+
+			void add(const std::string& disk, const GPT& gpt, size_t blockSize);
+
+			// GUIDs are compared case-insensitively. Returns NULL if
+			// there is no such partition.
+			const Location* find(const std::string& guid) const;
+
+			private:
+			std::unordered_map<std::string, Location> _locations;
+		};
+	};
+}
+#endif
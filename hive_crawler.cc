@@ -3,12 +3,23 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#ifdef LETTERMAN_LINUX
+#include <sys/syscall.h>
+#endif
+#include <condition_variable>
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <set>
 #include "hive_crawler.h"
+#include "block_device.h"
+#include "mount_table.h"
 #include "exception.h"
 #include "devtree.h"
+#include "thread_pool.h"
+#include "ntfs.h"
 #include "util.h"
 using namespace std;
 
@@ -17,13 +28,58 @@ namespace letterman {
 
 		struct Mount
 		{
+			Mount() {}
+
+			// A mount of its own, which isn't shared through create()
+			explicit Mount(const string& path)
+			: _fs(path), _target(mountNtfs(path)) {}
+
+			Mount(const Mount&) = delete;
+			Mount& operator=(const Mount&) = delete;
+
+			// The lock is not held while mounting, so a device that hangs
+			// doesn't hold up mounting the others.
 			static const Mount* create(const string& path)
 			{
+				{
+					lock_guard<mutex> guard(lock);
+
+					auto iter = mounts.find(path);
+					if (iter != mounts.end()) return &iter->second;
+				}
+
+				string target(mountNtfs(path));
+				lock_guard<mutex> guard(lock);
+
+				// Unmounted by the destructor, even if it's a duplicate
 				auto iter = mounts.find(path);
-				if (iter != mounts.end()) return &iter->second;
+				Mount& ret = mounts[iter == mounts.end() ? path : target];
+				ret._target = target;
+				ret._fs = path;
+
+				return &ret;
+			}
+
+			~Mount()
+			{
+				if (!_target.empty()) {
+#ifdef LETTERMAN_LINUX
+					umount2(_target.c_str(), MNT_DETACH);
+#else
+					unmount(_target.c_str(), MNT_FORCE);
+#endif
+					rmdir(_target.c_str());
+				}
+			}
 
-				Mount& ret = mounts[path];
+			const string& target() const
+			{ return _target; }
 
+			private:
+			// Mounts the NTFS file system on path at a new temporary
+			// directory, and returns the directory.
+			static string mountNtfs(const string& path)
+			{
 				unique_ptr<char[]> tmpl(new char[32]);
 				strcpy(tmpl.get(), "/tmp/lettermanXXXXXX");
 
@@ -31,7 +87,7 @@ namespace letterman {
 					throw ErrnoException("mkdtemp");
 				}
 
-				ret._target = tmpl.get();
+				string target(tmpl.get());
 
 #ifdef LETTERMAN_MACOSX
 				struct NtfsMountOpts
@@ -52,115 +108,403 @@ namespace letterman {
 					.majorVer = 0,
 					.minorVer = 0 };
 
-				if (mount("ntfs", ret._target.c_str(), 0, opts.get())) {
+				if (mount("ntfs", target.c_str(), 0, opts.get())) {
 #else
-				if (mount(path.c_str(), ret._target.c_str(), "ntfs", 0, NULL)) {
+				if (mount(path.c_str(), target.c_str(), "ntfs", 0, NULL)) {
 #endif
-					throw ErrnoException("mount: " + path);
+					ErrnoException e("mount: " + path);
+					rmdir(target.c_str());
+					throw e;
 				}
 
-				ret._fs = path;
+				return target;
+			}
 
-				return &ret;
+			string _fs;
+			string _target;
+
+			static map<string, Mount> mounts;
+			static mutex lock;
+		};
+
+		map<string, Mount> Mount::mounts;
+		mutex Mount::lock;
+
+		const char* const kSystemHive = "Windows/System32/config/SYSTEM";
+		const char* const kHivePath[] = { "Windows", "System32", "config", "SYSTEM" };
+
+		// Hives extracted from NTFS file systems, removed at exit
+		struct Extracted
+		{
+			~Extracted()
+			{
+				for (auto& file : files) unlink(file.c_str());
 			}
 
-			~Mount()
+			set<string> files;
+			mutex lock;
+		} extracted;
+
+		// Copies the SYSTEM hive out of the NTFS file system on a device
+		// or image, without mounting it.
+		string extractHive(const string& path)
+		{
+			BlockDevice::Ptr dev(BlockDevice::open(path));
+			if (!dev) throw ErrnoException("open: " + path);
+
+			Ntfs ntfs(dev, path);
+			Ntfs::Record record;
+			if (!ntfs.find(kSystemHive, record)) {
+				throw UserFault("No Windows installation on " + path);
+			}
+
+			char tmpl[] = "/tmp/letterman-hiveXXXXXX";
+			int fd = mkstemp(tmpl);
+			if (fd == -1) throw ErrnoException("mkstemp");
+
 			{
-				if (!_target.empty()) {
+				lock_guard<mutex> guard(extracted.lock);
+				extracted.files.insert(tmpl);
+			}
+
+			auto cleaner(util::createCleaner([fd] () { close(fd); }));
+			uint64_t offset = 0;
+
+			ntfs.read(record, [&] (const void* data, size_t len) {
+				if (!util::pwriteAll(fd, offset, data, len)) {
+					throw ErrnoException(string("write: ") + tmpl);
+				}
+				offset += len;
+			});
+
+			return tmpl;
+		}
+
+		// Errors other than UserFault mean that the file system couldn't
+		// be read, so root can still try to mount it.
+		bool canMountInstead(const std::exception& e)
+		{
+			return !dynamic_cast<const UserFault*>(&e) && geteuid() == 0;
+		}
+
+		string getMountPoint(const string& device, const struct stat& st)
+		{
 #ifdef LETTERMAN_LINUX
-					umount2(_target.c_str(), MNT_DETACH);
+			// Shares the snapshot taken during device enumeration
+			const MountTable::Mount* m = MountTable::get()->find(device,
+					st.st_rdev);
+			return m ? m->target : "";
 #else
-					unmount(_target.c_str(), MNT_FORCE);
+			(void) st;
+			Properties criteria = {{
+				DevTree::kPropDeviceMountable, device }};
+			DevTree::Devices devices(DevTree::getPartitions(criteria));
+			if (devices.empty()) return "";
+			return devices.front().get(DevTree::kPropMountPoint);
 #endif
-					rmdir(_target.c_str());
+		}
+
+		char foldCase(char c)
+		{
+			return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+		}
+
+		bool equalsIgnoreCase(const char* a, const char* b)
+		{
+			for (; *a && foldCase(*a) == foldCase(*b); ++a, ++b) {}
+			return foldCase(*a) == foldCase(*b);
+		}
+
+		bool isType(int dirfd, const char* name, unsigned char type, bool isDir)
+		{
+			// Not all file systems fill in d_type
+			if (type == DT_UNKNOWN) {
+				struct stat st;
+				if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) return false;
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+					: DT_UNKNOWN;
+			}
+
+			return type == (isDir ? DT_DIR : DT_REG);
+		}
+
+		// Scans the whole directory for the first entry that matches name,
+		// ignoring ASCII case. Returns "" if there is none.
+		string scan(int dirfd, const string& path, const char* name, bool isDir)
+		{
+#ifdef LETTERMAN_LINUX
+			// getdents64(2) returns as many entries as fit, instead of
+			// one per readdir(3) call.
+			alignas(struct dirent64) char buf[32768];
+			long len;
+
+			while ((len = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+				for (long pos = 0; pos < len; ) {
+					auto d = reinterpret_cast<const struct dirent64*>(buf + pos);
+					pos += d->d_reclen;
+
+					if (equalsIgnoreCase(d->d_name, name)
+							&& isType(dirfd, d->d_name, d->d_type, isDir)) {
+						return d->d_name;
+					}
 				}
 			}
 
-			const string& target() const
-			{ return _target; }
+			if (len < 0) throw ErrnoException("getdents64: " + path);
+#else
+			int fd = dup(dirfd);
+			if (fd == -1) throw ErrnoException("dup");
 
-			private:
-			string _fs;
-			string _target;
+			DIR* dir = fdopendir(fd);
+			if (!dir) {
+				close(fd);
+				throw ErrnoException("fdopendir: " + path);
+			}
 
-			static map<string, Mount> mounts;
+			auto cleaner(util::createCleaner([dir] () { closedir(dir); }));
+			struct dirent* d;
+
+			while ((d = readdir(dir))) {
+				if (equalsIgnoreCase(d->d_name, name)
+						&& isType(dirfd, d->d_name, d->d_type, isDir)) {
+					return d->d_name;
+				}
+			}
+#endif
+
+			return "";
+		}
+
+		// Names found (or not) in directories, by device and inode, so
+		// installs and requests that resolve the same path scan each
+		// directory only once. Entries are only valid for the mtime the
+		// directory had when they were looked up.
+		struct DirCache
+		{
+			struct Dir
+			{
+				time_t mtime;
+				long mtimeNsec;
+				// (name, isDir) -> name in the directory, or ""
+				map<pair<string, bool>, string> names;
+			};
+
+			map<pair<dev_t, ino_t>, Dir> dirs;
+			mutex lock;
 		};
 
-		map<string, Mount> Mount::mounts;
+		// Never destroyed, since probes that were abandoned may still
+		// use it while the process exits.
+		DirCache& dirCache = *new DirCache;
 
-		string getMountPoint(const string& device)
+		// Runs the probes of getAllWindowsInstalls. Also never destroyed,
+		// so exiting doesn't wait for probes that are stuck in the kernel.
+		ThreadPool& probePool()
 		{
-			Properties criteria = {{
-				DevTree::kPropDeviceMountable, device }};
-			map<string, Properties> devices(DevTree::getPartitions(criteria));
-			if (devices.empty()) return "";
-			return devices.begin()->second[DevTree::kPropMountPoint];
+			static ThreadPool* pool = new ThreadPool();
+			return *pool;
 		}
 
-		string findFirst(const string& path, string name, bool findDir = true)
+		string lookup(int dirfd, const string& path, const char* name, bool isDir)
 		{
-			DIR* dir = opendir(path.c_str());
-			if (!dir) throw ErrnoException("opendir: " + path);
+			struct stat st;
+			if (fstat(dirfd, &st)) throw ErrnoException("fstat: " + path);
 
-			util::capitalize(name);
-
-			struct dirent d, *result;
+#ifdef LETTERMAN_MACOSX
+			long nsec = st.st_mtimespec.tv_nsec;
+#else
+			long nsec = st.st_mtim.tv_nsec;
+#endif
+			auto key(make_pair(string(name), isDir));
 
-			do
 			{
-				if (readdir_r(dir, &d, &result) != 0) {
-					throw ErrnoException("readdir_r");
+				lock_guard<mutex> guard(dirCache.lock);
+				auto iter = dirCache.dirs.find(make_pair(st.st_dev, st.st_ino));
+
+				if (iter != dirCache.dirs.end() && iter->second.mtime == st.st_mtime
+						&& iter->second.mtimeNsec == nsec) {
+					auto found = iter->second.names.find(key);
+					if (found != iter->second.names.end()) return found->second;
 				}
+			}
 
-				if (result) {
-					string leaf(d.d_name);
-					util::capitalize(leaf);
+			string found(scan(dirfd, path, name, isDir));
 
-					if (leaf == name) {
-						if (d.d_type == DT_UNKNOWN 
-							|| d.d_type == (findDir ? DT_DIR : DT_REG)) {
-							return path + "/" + d.d_name;
-						}
-					}
+			lock_guard<mutex> guard(dirCache.lock);
+			DirCache::Dir& dir = dirCache.dirs[make_pair(st.st_dev, st.st_ino)];
+			if (dir.mtime != st.st_mtime || dir.mtimeNsec != nsec) {
+				dir.mtime = st.st_mtime;
+				dir.mtimeNsec = nsec;
+				dir.names.clear();
+			}
+			dir.names[key] = found;
+
+			return found;
+		}
+
+		// Resolves the SYSTEM hive below path, starting at the given
+		// component of kHivePath. Each directory is opened relative to
+		// the previous one.
+		string resolveHive(const string& path, size_t first)
+		{
+			const size_t count = sizeof(kHivePath) / sizeof(kHivePath[0]);
+
+			int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd == -1) throw ErrnoException("open: " + path);
+			auto cleaner(util::createCleaner([&fd] () { close(fd); }));
+
+			string ret(path);
+
+			for (size_t i = first; i != count; ++i) {
+				bool isDir = i + 1 != count;
+				string name(lookup(fd, ret, kHivePath[i], isDir));
+
+				if (name.empty()) {
+					throw UserFault(string("No such ") + (isDir ? "directory" : "file")
+							+ " in " + ret + ": " + kHivePath[i]);
 				}
 
+				ret += "/" + name;
 
-			} while(result);
+				if (isDir) {
+					int next = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+					if (next == -1) throw ErrnoException("open: " + ret);
+					close(fd);
+					fd = next;
+				}
+			}
 
-			throw UserFault(string("No such ") + (findDir ? "directory" : "file") + 
-					" in " + path + ": " + name);
+			return ret;
 		}
 	}
 
-	set<WindowsInstall> getAllWindowsInstalls()
+	set<WindowsInstall> getAllWindowsInstalls(unsigned timeoutMs,
+			map<string, string>& failures)
 	{
-		set<WindowsInstall> ret;
+		struct Probe
+		{
+			WindowsInstall install;
+			bool done;
+			bool found;
+			string error;
+		};
+
+		// Shared with the probes, which may outlive this call. Probes
+		// only use this and state that is never destroyed, so they can
+		// still finish while the process exits.
+		struct State
+		{
+			mutex lock;
+			condition_variable changed;
+			vector<Probe> probes;
+			size_t pending;
+			// Set at the deadline; probes that haven't started by then
+			// are skipped, and don't start mounting.
+			bool abandoned;
+		};
+
+		auto state(make_shared<State>());
 		Properties props = {{ DevTree::kPropIsNtfs, "1" }};
 
-		for (auto& e : DevTree::getPartitions(props)) {
-			try {
-				WindowsInstall wi;
+		for (auto dev : DevTree::getPartitions(props)) {
+			Probe probe;
+			probe.install.path = dev.get(DevTree::kPropMountPoint);
+			if (probe.install.path.empty()) {
+				probe.install.isDevice = true;
+				probe.install.path = dev.get(DevTree::kPropDeviceMountable);
+			} else {
+				probe.install.isDevice = false;
+			}
 
-				wi.path = e.second[DevTree::kPropMountPoint];
-				if (wi.path.empty()) {
-					wi.isDevice = true;
-					wi.path = e.second[DevTree::kPropDeviceMountable];
-				} else {
-					wi.isDevice = false;
+			probe.done = probe.found = false;
+			state->probes.push_back(probe);
+		}
+
+		state->pending = state->probes.size();
+		state->abandoned = false;
+
+		// A probe that is stuck in mount(2) can't be stopped, so it
+		// keeps its pool thread, and is abandoned at the deadline.
+		for (size_t i = 0; i != state->probes.size(); ++i) {
+			string path(state->probes[i].install.path);
+			bool isDevice = state->probes[i].install.isDevice;
+
+			auto abandoned = [state] () {
+				lock_guard<mutex> guard(state->lock);
+				return state->abandoned;
+			};
+
+			probePool().post([state, i, path, isDevice, abandoned] () {
+				if (abandoned()) return;
+
+				bool found = false;
+				string error;
+
+				try {
+					if (isDevice) {
+						// Look up unmounted partitions without extracting
+						// or mounting them
+						try {
+							BlockDevice::Ptr dev(BlockDevice::open(path));
+							if (!dev) throw ErrnoException("open: " + path);
+
+							Ntfs::Record record;
+							found = Ntfs(dev, path).find(kSystemHive, record);
+						} catch (const std::exception& e) {
+							if (!canMountInstead(e) || abandoned()) throw;
+
+							// Unmounted again right away, even if the
+							// mount only succeeds after the deadline
+							Mount mount(path);
+							resolveHive(mount.target(), 0);
+							found = true;
+						}
+					} else {
+						// Ignore return value, just check!
+						hiveFromSysDrive(path);
+						found = true;
+					}
+				} catch (const UserFault& e) {
+					// not a Windows install
+				} catch (const std::exception& e) {
+					error = e.what();
 				}
 
-				// Ignore return value, just check!
-				hiveFromSysDrive(wi.path);
-				ret.insert(wi);
-			} catch (const UserFault& e) {
-				// ignore
+				lock_guard<mutex> guard(state->lock);
+				Probe& probe = state->probes[i];
+				probe.done = true;
+				probe.found = found;
+				probe.error = error;
+
+				if (!--state->pending) state->changed.notify_all();
+			});
+		}
+
+		// All probes start at once, so they share the deadline
+		auto deadline = chrono::steady_clock::now()
+			+ chrono::milliseconds(timeoutMs);
+
+		unique_lock<mutex> guard(state->lock);
+		state->changed.wait_until(guard, deadline,
+				[&state] () { return !state->pending; });
+		state->abandoned = true;
+
+		set<WindowsInstall> ret;
+
+		for (auto& probe : state->probes) {
+			if (!probe.done) {
+				failures[probe.install.path] = "timed out";
+			} else if (!probe.error.empty()) {
+				failures[probe.install.path] = probe.error;
+			} else if (probe.found) {
+				ret.insert(probe.install);
 			}
 		}
 
 		return ret;
 	}
 
-	string hiveFromSysDrive(const string& path)
+	string hiveFromSysDrive(const string& path, bool writable)
 	{
 		struct stat st;
 
@@ -170,27 +514,42 @@ namespace letterman {
 		}
 
 		if (S_ISBLK(st.st_mode)) {
-			string mountPoint(getMountPoint(path));
+			string mountPoint(getMountPoint(path, st));
 			if (!mountPoint.empty()) {
-				return hiveFromSysDrive(mountPoint);
+				return hiveFromSysDrive(mountPoint, writable);
+			}
+			if (!writable) {
+				try {
+					return extractHive(path);
+				} catch (const std::exception& e) {
+					if (!canMountInstead(e)) throw;
+				}
 			}
 			if (geteuid() != 0) throw UserFault("Operation requires root");
 			auto m = Mount::create(path);
-			return hiveFromSysDrive(m->target());
+			return hiveFromSysDrive(m->target(), writable);
+		} else if (S_ISREG(st.st_mode)) {
+			return extractHive(path);
 		} else if(!S_ISDIR(st.st_mode)) {
-			throw UserFault("Not a device or directory: " + path);
+			throw UserFault("Not a device, image or directory: " + path);
 		}
 
-		return hiveFromSysRoot(findFirst(path, "Windows"));
+		return resolveHive(path, 0);
+	}
+
+	bool isHiveCopy(const string& hive)
+	{
+		lock_guard<mutex> guard(extracted.lock);
+		return extracted.files.count(hive);
 	}
 
-	inline string hiveFromSysRoot(const string& path)
+	string hiveFromSysRoot(const string& path)
 	{
-		return hiveFromSysDir(findFirst(path, "System32"));
+		return resolveHive(path, 1);
 	}
 
-	inline string hiveFromSysDir(const string& path)
+	string hiveFromSysDir(const string& path)
 	{
-		return findFirst(findFirst(path, "config"), "SYSTEM", false);
+		return resolveHive(path, 2);
 	}
 }
@@ -3,10 +3,17 @@
 #include <iostream>
 #include <string>
 #include <set>
+#include <map>
 
 namespace letterman {
 
-	std::string hiveFromSysDrive(const std::string& path);
+	// Devices that aren't mounted, and NTFS images, are read directly
+	// and their SYSTEM hive is copied to a temporary file. Devices are
+	// mounted instead (which requires root) if the hive may be modified.
+	std::string hiveFromSysDrive(const std::string& path, bool writable = false);
+
+	// True for hives copied from images, which can't be modified
+	bool isHiveCopy(const std::string& hive);
 
 	std::string hiveFromSysRoot(const std::string& path);
 
@@ -29,7 +36,17 @@ namespace letterman {
 		}
 	};
 
-	std::set<WindowsInstall> getAllWindowsInstalls();
+	const unsigned kDefaultProbeTimeoutMs = 10000;
+
+	// Probes all NTFS partitions in parallel, on one thread per CPU,
+	// reading unmounted ones directly (mounting them only if they can't
+	// be read that way, and unmounting them again afterwards).
+	// Partitions that can't be probed within timeoutMs (e.g. because
+	// the mount hangs on a failing disk), or fail with an error, are
+	// skipped and added to failures, along with the reason; the installs
+	// found on the other partitions are returned regardless.
+	std::set<WindowsInstall> getAllWindowsInstalls(unsigned timeoutMs,
+			std::map<std::string, std::string>& failures);
 }
 
 #endif
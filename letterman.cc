@@ -1,16 +1,37 @@
+#include <condition_variable>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <dirent.h>
+#include <chrono>
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
 #include "mounted_devices.h"
 #include "hive_crawler.h"
 #include "exception.h"
 #include "devtree.h"
+#include "partition_table.h"
+#include "record_writer.h"
+#include "thread_pool.h"
 #include "endian.h"
 #include "util.h"
 using namespace std;
 using namespace letterman;
 
 namespace {
+	// Output of list and dump
+	RecordWriter::Format outputFormat = RecordWriter::FORMAT_TEXT;
+	ResolveMode resolveMode = RESOLVE_FULL;
+
 	void requireDriveLetter(const string& arg)
 	{
 		bool invalid = false;
@@ -32,22 +53,882 @@ namespace {
 		}
 	}
 
-	void requireArgCount(int argc, int n)
+	typedef vector<string> Args;
+
+	// args[0] is the action, so n is the number of actual arguments
+	void requireArgCount(const Args& args, size_t n)
 	{
-		if (argc - 1 != n) {
+		if (args.size() - 1 != n) {
 			ostringstream ostr;
-			ostr << "Action requires " << n << " argument";
-			ostr << (n == 1 ? "" : "s") << ", got " << (n - 1);
+			ostr << args[0] << " requires " << n << " argument";
+			ostr << (n == 1 ? "" : "s") << ", got " << (args.size() - 1);
 			throw UserFault(ostr.str());
 		}
 	}
 
+	string createMbrEntry(uint32_t disk, uint64_t offset)
+	{
+		struct Entry
+		{
+			uint32_t disk;
+			uint64_t offset;
+		} __attribute__((packed));
+
+		Entry e;
+		e.disk = htole32(disk);
+		e.offset = htole64(offset);
+
+		return string(reinterpret_cast<const char*>(&e), sizeof(e));
+	}
+
+	string createPartitionEntry(const string& device)
+	{
+		Properties criteria = {{ DevTree::kPropDeviceMountable, device }};
+		DevTree::Devices partitions(DevTree::getPartitions(criteria));
+		if (partitions.empty()) throw UserFault("No such partition: " + device);
+
+		DevTree::Device partition(partitions.front());
+
+		uint64_t offset;
+		if (!partition.offset(offset)) {
+			throw UserFault("Failed to determine partition offset; must specify manually");
+		}
+
+		// Get the disk with the corresponding kPropDiskId
+		criteria = {{ DevTree::kPropDiskId, partition.get(DevTree::kPropDiskId) }};
+		DevTree::Devices disks(DevTree::getDisks(criteria));
+
+		if (disks.empty()) {
+			throw UserFault("Failed to determine hosting disk of partition " + device);
+		}
+
+		string mbrIdStr(disks.front().get(DevTree::kPropMbrId));
+		if (mbrIdStr.empty()) {
+			throw UserFault("Failed to determine MBR disk id of partition " + device);
+		}
+
+		return createMbrEntry(util::fromString<uint32_t>(mbrIdStr, ios::hex),
+				offset);
+	}
+
+	bool isWriteAction(const string& action)
+	{
+		return action == "swap" || action == "change" || action == "remove"
+			|| action == "add";
+	}
+
+	// All mappings are resolved before the first one is written, so
+	// the device table is scanned only once. Lists only hold drive
+	// letters, so there are never more than a few dozen.
+	void printMappings(ostream& os, const MappingTable& mappings)
+	{
+		vector<string> devices(resolveDevices(mappings, resolveMode));
+
+		if (outputFormat != RecordWriter::FORMAT_TEXT) {
+			RecordWriter writer(os, outputFormat);
+
+			for (size_t i = 0; i != mappings.size(); ++i) {
+				const Mapping& mapping = mappings[i];
+				const string& device = devices[i];
+
+				writer.begin();
+				mapping.name().addFields(writer);
+				mapping.addFields(writer);
+
+				if (device == Mapping::kOsNameUnknown) {
+					writer.add("status", "unknown");
+				} else if (device == Mapping::kOsNameNotAttached) {
+					writer.add("status", "detached");
+				} else {
+					writer.add("status", "attached");
+					writer.add("device", device);
+				}
+
+				writer.end();
+			}
+
+			return;
+		}
+
+		for (size_t i = 0; i != mappings.size(); ++i) {
+			const Mapping& mapping = mappings[i];
+			const string& device = devices[i];
+
+			os << mapping.name() << "  ";
+
+			if (device == Mapping::kOsNameUnknown) {
+				os << "? " << mapping.toString(0);
+			} else if (device == Mapping::kOsNameNotAttached) {
+				os << "- " << mapping.toString(0);
+			} else {
+				os << "* " << device;
+			}
+
+			os << '\n';
+		}
+	}
+
+	void printDevices(ostream& os, const string& what)
+	{
+		DevTree::Devices data;
+
+		if (what == "partitions") data = DevTree::getPartitions();
+		else if (what == "disks") data = DevTree::getDisks();
+		else throw UserFault("Unknown device type: " + what);
+
+		if (outputFormat != RecordWriter::FORMAT_TEXT) {
+			RecordWriter writer(os, outputFormat);
+
+			for (auto dev : data) {
+				writer.begin();
+				writer.add("name", dev.name());
+				writer.add("hardware", dev.get(DevTree::kPropHardware));
+				for (auto& prop : dev.props()) {
+					writer.add(DevTree::propName(prop.first).c_str(), prop.second);
+				}
+				writer.end();
+			}
+
+			return;
+		}
+
+		for (auto dev : data) {
+			os << dev.name() << "\t" << dev.get(DevTree::kPropHardware) << '\n';
+			for (auto& prop : dev.props()) {
+				os << "  " << DevTree::propName(prop.first) << "=" << prop.second << '\n';
+			}
+		}
+	}
+
+	// Runs a single action against a transaction. Changes are queued,
+	// so it is up to the caller to commit the transaction.
+	void runAction(MountedDevices::Transaction& t, const Args& args,
+			ostream& os)
+	{
+		const string& action = args[0];
+
+		if (action == "swap" || action == "change") {
+			requireArgCount(args, 2);
+			requireDriveLetter(args[1]);
+			requireDriveLetter(args[2]);
+
+			char a = args[1][0];
+			char b = args[2][0];
+
+			if (action == "swap") {
+				t.swap(a, b);
+			} else {
+				t.change(a, b);
+			}
+		} else if (action == "remove") {
+			requireArgCount(args, 1);
+			requireDriveLetter(args[1]);
+
+			t.remove(args[1][0]);
+		} else if (action == "list") {
+			requireArgCount(args, 0);
+			printMappings(os, t.list());
+		} else if (action == "add") {
+			if (args.size() < 4) requireArgCount(args, 3);
+
+			const string& type = args[1];
+			requireDriveLetter(args[2]);
+
+			string data;
+
+			if (type == "mbr") {
+				requireArgCount(args, 4);
+				data = createMbrEntry(
+						util::fromString<uint32_t>(args[3], ios::hex),
+						util::fromString<uint64_t>(args[4]));
+				util::hexdump(os, data, 4) << endl;
+			} else if (type == "raw") {
+				requireArgCount(args, 3);
+				for (char c : args[3]) {
+					data += c;
+					data += '\0';
+				}
+				util::hexdump(os, data, 4) << endl;
+			} else if (type == "partition") {
+				requireArgCount(args, 3);
+				data = createPartitionEntry(args[3]);
+			} else {
+				throw UserFault("Unknown type: " + type);
+			}
+
+			t.add(args[2][0], data.data(), data.size());
+		} else if (action == "dump") {
+			requireArgCount(args, 1);
+			printDevices(os, args[1]);
+		} else {
+			throw UserFault(action + ": unknown action");
+		}
+	}
+
+	Args splitArgs(const string& line)
+	{
+		Args args;
+		istringstream istr(line);
+		string arg;
+
+		while (istr >> arg) {
+			args.push_back(arg);
+		}
+
+		return args;
+	}
+
+	// Reads one action per line from the given stream, runs them all
+	// in a single transaction, and writes the hive once. Blank lines
+	// and lines starting with '#' are ignored. If any action fails,
+	// nothing is written.
+	int runBatch(const string& hive, istream& in, ostream& os)
+	{
+		vector<pair<unsigned, Args>> actions;
+		bool writable = false;
+		string line;
+
+		for (unsigned n = 1; getline(in, line); ++n) {
+			Args args(splitArgs(line));
+			if (args.empty() || args[0][0] == '#') continue;
+
+			if (args[0] == "batch") {
+				throw UserFault("batch: line " + util::toString(n)
+						+ ": batch actions cannot be nested");
+			}
+
+			writable |= isWriteAction(args[0]);
+			actions.emplace_back(n, args);
+		}
+
+		if (writable && isHiveCopy(hive)) {
+			throw UserFault("Can't modify a hive in an image");
+		}
+
+		MountedDevices md(hive, writable);
+		MountedDevices::Transaction t(md.begin());
+		unsigned failed = 0;
+
+		for (auto& a : actions) {
+			os << a.first << ":";
+			for (auto& arg : a.second) os << " " << arg;
+
+			try {
+				ostringstream out;
+				runAction(t, a.second, out);
+				os << " -> ok" << endl << out.str();
+			} catch (const UserFault& uf) {
+				os << " -> " << uf.what() << endl;
+				++failed;
+			} catch (const std::exception& e) {
+				os << " -> " << e.what() << endl;
+				++failed;
+			}
+		}
+
+		if (failed) {
+			t.rollback();
+			os << failed << " of " << actions.size() << " actions failed; "
+				<< "hive was not modified" << endl;
+			return 1;
+		}
+
+		t.commit();
+		return 0;
+	}
+
+	int runBatch(const string& hive, const Args& args, ostream& os)
+	{
+		requireArgCount(args, 1);
+
+		if (args[1] == "-") {
+			return runBatch(hive, cin, os);
+		}
+
+		ifstream in(args[1].c_str());
+		if (!in.good()) {
+			throw ErrnoException("open: " + args[1]);
+		}
+
+		return runBatch(hive, in, os);
+	}
+
+	vector<string> getFleetHives(const string& path)
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			throw ErrnoException("stat: " + path);
+		}
+
+		vector<string> hives;
+
+		if (S_ISDIR(st.st_mode)) {
+			DIR* dir = opendir(path.c_str());
+			if (!dir) throw ErrnoException("opendir: " + path);
+			auto cleaner(util::createCleaner([&dir] () { closedir(dir); }));
+
+			struct dirent* d;
+			while ((d = readdir(dir))) {
+				if (d->d_name[0] == '.') continue;
+
+				string hive(path + "/" + d->d_name);
+				if (stat(hive.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+					hives.push_back(hive);
+				}
+			}
+
+			sort(hives.begin(), hives.end());
+		} else {
+			ifstream in(path.c_str());
+			string line;
+
+			while (getline(in, line)) {
+				util::rtrim(line);
+				if (!line.empty() && line[0] != '#') {
+					hives.push_back(line);
+				}
+			}
+		}
+
+		return hives;
+	}
+
+	struct FleetResult
+	{
+		FleetResult()
+		: done(false), ok(false), bytes(0) {}
+
+		bool done;
+		bool ok;
+		uint64_t bytes;
+		string output;
+	};
+
+	// Runs an action (or a batch script) against every hive in a
+	// directory or list file, using a thread pool. Since every worker
+	// has at most one hive open, the number of threads also caps the
+	// number of hives held in memory. Results are printed in input
+	// order, as soon as they are available.
+	int runFleet(const Args& args, ostream& os)
+	{
+		size_t i = 1;
+		unsigned jobs = 0;
+
+		if (args.size() > 2 && args[1] == "--jobs") {
+			jobs = util::fromString<unsigned>(args[2]);
+			i = 3;
+		}
+
+		if (args.size() < i + 2) {
+			throw UserFault("fleet requires a directory or list file, "
+					"and an action");
+		}
+
+		vector<string> hives(getFleetHives(args[i]));
+		Args action(args.begin() + i + 1, args.end());
+
+		if (action[0] == "fleet") {
+			throw UserFault("fleet actions cannot be nested");
+		}
+
+		bool batch = action[0] == "batch";
+		bool writable = isWriteAction(action[0]);
+		string script;
+
+		if (batch) {
+			requireArgCount(action, 1);
+
+			ostringstream ostr;
+			if (action[1] == "-") {
+				ostr << cin.rdbuf();
+			} else {
+				ifstream in(action[1].c_str());
+				if (!in.good()) throw ErrnoException("open: " + action[1]);
+				ostr << in.rdbuf();
+			}
+
+			script = ostr.str();
+		}
+
+		vector<FleetResult> results(hives.size());
+		mutex lock;
+		condition_variable done;
+		unsigned failed = 0;
+		uint64_t bytes = 0;
+
+		auto start = chrono::steady_clock::now();
+
+		{
+			ThreadPool pool(jobs);
+
+			for (size_t k = 0; k != hives.size(); ++k) {
+				pool.post([&, k] () {
+					ostringstream out;
+					FleetResult result;
+
+					try {
+						struct stat st;
+						if (stat(hives[k].c_str(), &st) == 0) {
+							result.bytes = st.st_size;
+						}
+
+						if (batch) {
+							istringstream in(script);
+							result.ok = runBatch(hives[k], in, out) == 0;
+						} else {
+							MountedDevices md(hives[k], writable);
+							MountedDevices::Transaction t(md.begin());
+							runAction(t, action, out);
+							t.commit();
+							result.ok = true;
+						}
+					} catch (const UserFault& uf) {
+						out << uf.what() << endl;
+					} catch (const std::exception& e) {
+						out << e.what() << endl;
+					}
+
+					result.output = out.str();
+					result.done = true;
+
+					lock_guard<mutex> guard(lock);
+					results[k] = move(result);
+					done.notify_all();
+				});
+			}
+
+			for (size_t k = 0; k != hives.size(); ++k) {
+				unique_lock<mutex> guard(lock);
+				done.wait(guard, [&] () { return results[k].done; });
+
+				FleetResult& result = results[k];
+				failed += !result.ok;
+				bytes += result.bytes;
+
+				os << hives[k] << ": " << (result.ok ? "ok" : "failed") << endl;
+				os << result.output;
+
+				result.output.clear();
+			}
+
+			pool.wait();
+		}
+
+		double elapsed = chrono::duration<double>(
+				chrono::steady_clock::now() - start).count();
+
+		os << "fleet: " << hives.size() << " hives, " << failed << " failed, "
+			<< fixed << setprecision(2) << elapsed << " s";
+
+		if (elapsed > 0) {
+			os << " (" << hives.size() / elapsed << " hives/s, "
+				<< bytes / elapsed / (1024 * 1024) << " MiB/s)";
+		}
+
+		os << endl;
+
+		return failed ? 1 : 0;
+	}
+
+	[[noreturn]] void printUsageAndDie()
+	{
+		cerr << "usage: letterman [options] [hive arg] [action] [arguments ...]" << endl;
+		cerr << "       letterman fleet [--jobs N] [dir|listfile] [action] [arguments ...]" << endl;
+		cerr << "       letterman serve --socket PATH" << endl;
+		cerr << "actions: list, swap, change, remove, add, dump, batch" << endl;
+		cerr << "options: --ptable-cache[=DIR]  cache partition tables across runs" << endl;
+		cerr << "                               (default " << PartitionTable::kDefaultCacheDir << ")" << endl;
+		cerr << "         --enum-threads N      threads used to enumerate devices (default: auto)" << endl;
+		cerr << "         --backend=NAME        access hives with hivex (default) or native" << endl;
+		cerr << "         --commit=MODE         write changes directly (default) or to the log" << endl;
+		cerr << "         --format=FORMAT       list/dump output: text (default), ndjson or bin" << endl;
+		cerr << "         --resolve=MODE        how list finds devices: full (default), cached or none" << endl;
+		cerr << "         --probe-timeout SECS  give up on a partition during --probe after SECS" << endl;
+		cerr << "         --image FILE          use disk image(s) instead of devices (repeatable)" << endl;
+		cerr << "         --devtree-index FILE  device index file (default " << DevTree::kDefaultIndexFile << ")" << endl;
+		cerr << "         --no-devtree-index    always enumerate devices" << endl;
+		cerr << "         --devtree-record FILE record devices and partition tables to FILE" << endl;
+		cerr << "         --devtree-replay FILE use devices recorded with --devtree-record" << endl;
+		exit(1);
+	}
+
+	unsigned probeTimeoutMs = kDefaultProbeTimeoutMs;
+
+	// Options that apply to all actions; must precede everything else
+	void parseGlobalOptions(int argc, char **argv, int& index)
+	{
+		vector<string> images;
+
+		for (; index < argc; ++index) {
+			string opt(argv[index]);
+
+			if (opt == "--ptable-cache") {
+				PartitionTable::setCacheDir(PartitionTable::kDefaultCacheDir);
+			} else if (opt.substr(0, 15) == "--ptable-cache=") {
+				PartitionTable::setCacheDir(opt.substr(15));
+			} else if (opt == "--image") {
+				if (++index >= argc) throw UserFault(opt + " requires an argument");
+				images.push_back(argv[index]);
+			} else if (opt == "--devtree-record") {
+				if (++index >= argc) throw UserFault(opt + " requires an argument");
+				DevTree::setRecordFile(argv[index]);
+			} else if (opt == "--devtree-replay") {
+				if (++index >= argc) throw UserFault(opt + " requires an argument");
+				DevTree::setReplayFile(argv[index]);
+			} else if (opt == "--devtree-index") {
+				if (++index >= argc) throw UserFault(opt + " requires an argument");
+				DevTree::setIndexFile(argv[index]);
+			} else if (opt == "--no-devtree-index") {
+				DevTree::setIndexFile("");
+			} else if (opt.substr(0, 10) == "--backend=") {
+				string backend(opt.substr(10));
+				if (backend == "hivex") {
+					MountedDevices::setBackend(MountedDevices::BACKEND_HIVEX);
+				} else if (backend == "native") {
+					MountedDevices::setBackend(MountedDevices::BACKEND_NATIVE);
+				} else {
+					throw UserFault("Unknown backend: " + backend);
+				}
+			} else if (opt.substr(0, 9) == "--commit=") {
+				string mode(opt.substr(9));
+				if (mode == "direct") {
+					MountedDevices::setCommitMode(MountedDevices::COMMIT_DIRECT);
+				} else if (mode == "log") {
+					MountedDevices::setCommitMode(MountedDevices::COMMIT_LOG);
+				} else {
+					throw UserFault("Unknown commit mode: " + mode);
+				}
+			} else if (opt.substr(0, 9) == "--format=") {
+				string format(opt.substr(9));
+				if (format == "text") {
+					outputFormat = RecordWriter::FORMAT_TEXT;
+				} else if (format == "ndjson") {
+					outputFormat = RecordWriter::FORMAT_NDJSON;
+				} else if (format == "bin") {
+					outputFormat = RecordWriter::FORMAT_BIN;
+				} else {
+					throw UserFault("Unknown output format: " + format);
+				}
+			} else if (opt.substr(0, 10) == "--resolve=") {
+				string mode(opt.substr(10));
+				if (mode == "none") {
+					resolveMode = RESOLVE_NONE;
+				} else if (mode == "cached") {
+					resolveMode = RESOLVE_CACHED;
+				} else if (mode == "full") {
+					resolveMode = RESOLVE_FULL;
+				} else {
+					throw UserFault("Unknown resolve mode: " + mode);
+				}
+			} else if (opt == "--probe-timeout") {
+				if (++index >= argc) throw UserFault(opt + " requires an argument");
+				probeTimeoutMs = util::fromString<double>(argv[index]) * 1000;
+			} else if (opt == "--enum-threads") {
+				if (++index >= argc) throw UserFault(opt + " requires an argument");
+				DevTree::setEnumerationThreads(
+						util::fromString<unsigned>(argv[index]));
+			} else {
+				break;
+			}
+		}
+
+		if (!images.empty()) DevTree::setImages(images);
+	}
+
+	// A hive kept open by the daemon. Requests for the same hive are
+	// serialized, since hivex handles are not thread-safe.
+	struct CachedHive
+	{
+		CachedHive()
+		: writable(false) {}
+
+		mutex lock;
+		unique_ptr<MountedDevices> md;
+		bool writable;
+		struct stat st;
+	};
+
+	bool isSameFile(const struct stat& a, const struct stat& b)
+	{
+#ifdef LETTERMAN_MACOSX
+		long aNsec = a.st_mtimespec.tv_nsec, bNsec = b.st_mtimespec.tv_nsec;
+#else
+		long aNsec = a.st_mtim.tv_nsec, bNsec = b.st_mtim.tv_nsec;
+#endif
+		return a.st_dev == b.st_dev && a.st_ino == b.st_ino
+			&& a.st_size == b.st_size && a.st_mtime == b.st_mtime
+			&& aNsec == bNsec;
+	}
+
+	// Hives are closed again when more than this many are cached
+	const size_t kMaxCachedHives = 16;
+
+	class HiveCache
+	{
+		public:
+		HiveCache()
+		: _clock(0) {}
+
+		shared_ptr<CachedHive> get(const string& path)
+		{
+			lock_guard<mutex> guard(_lock);
+			Entry& entry = _hives[path];
+			if (!entry.hive) entry.hive = make_shared<CachedHive>();
+			entry.lastUsed = ++_clock;
+
+			shared_ptr<CachedHive> hive(entry.hive);
+			if (_hives.size() > kMaxCachedHives) evict();
+			return hive;
+		}
+
+		private:
+		struct Entry
+		{
+			shared_ptr<CachedHive> hive;
+			uint64_t lastUsed;
+		};
+
+		// Closes the least recently used hive that no request is using.
+		// Hives in use are kept, so a path never has two handles.
+		void evict()
+		{
+			auto oldest = _hives.end();
+
+			for (auto iter = _hives.begin(); iter != _hives.end(); ++iter) {
+				if (iter->second.hive.use_count() == 1 && (oldest == _hives.end()
+							|| iter->second.lastUsed < oldest->second.lastUsed)) {
+					oldest = iter;
+				}
+			}
+
+			if (oldest != _hives.end()) _hives.erase(oldest);
+		}
+
+		mutex _lock;
+		map<string, Entry> _hives;
+		uint64_t _clock;
+	};
+
+	// A request is a hive path, followed by an action and its arguments
+	string serveRequest(HiveCache& cache, const Args& request)
+	{
+		if (request.size() < 2) throw UserFault("Request requires a hive and an action");
+
+		const string& path = request[0];
+		Args action(request.begin() + 1, request.end());
+
+		if (action[0] == "batch" || action[0] == "fleet" || action[0] == "serve") {
+			throw UserFault(action[0] + ": not supported by the daemon");
+		}
+
+		bool writable = isWriteAction(action[0]);
+		shared_ptr<CachedHive> hive(cache.get(path));
+		lock_guard<mutex> guard(hive->lock);
+
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			hive->md.reset();
+			throw ErrnoException("stat: " + path);
+		}
+
+		// Reopen if someone else modified or replaced the hive
+		if (!hive->md || !isSameFile(st, hive->st) || (writable && !hive->writable)) {
+			hive->md.reset();
+			hive->md.reset(new MountedDevices(path, writable));
+			hive->writable = writable;
+			hive->st = st;
+		}
+
+		ostringstream out;
+
+		try {
+			MountedDevices::Transaction t(hive->md->begin());
+			runAction(t, action, out);
+			t.commit();
+		} catch (...) {
+			// A failed commit may have left the handle half-modified
+			if (writable) hive->md.reset();
+			throw;
+		}
+
+		// Don't reopen because of our own changes
+		if (writable && stat(path.c_str(), &st) == 0) {
+			hive->st = st;
+		}
+
+		return out.str();
+	}
+
+	bool sendAll(int fd, const string& data)
+	{
+		for (size_t i = 0; i < data.size(); ) {
+			ssize_t n = send(fd, data.data() + i, data.size() - i, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			i += n;
+		}
+
+		return true;
+	}
+
+	bool sendResponse(int fd, const string& status, const string& output)
+	{
+		return sendAll(fd, status + " " + util::toString(output.size())
+				+ "\n" + output);
+	}
+
+	const size_t kMaxRequestSize = 64 * 1024;
+
+	// Requests are lines of tab-separated fields. Each response is a
+	// line with "ok" or "error" and the length of the output, followed
+	// by the output itself. A request that is too long is answered with
+	// an error, and the connection is closed.
+	void serveConnection(int fd, shared_ptr<HiveCache> cache)
+	{
+		auto cleaner(util::createCleaner([fd] () { close(fd); }));
+		string buf;
+		char chunk[4096];
+		ssize_t n;
+
+		while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return;
+			}
+
+			buf.append(chunk, n);
+
+			string::size_type eol;
+			while ((eol = buf.find('\n')) != string::npos) {
+				Args request;
+				istringstream istr(buf.substr(0, eol));
+				buf.erase(0, eol + 1);
+
+				string field;
+				while (getline(istr, field, '\t')) {
+					request.push_back(field);
+				}
+
+				string status("ok"), output;
+
+				try {
+					output = serveRequest(*cache, request);
+				} catch (const std::exception& e) {
+					status = "error";
+					output = string(e.what()) + "\n";
+				}
+
+				if (!sendResponse(fd, status, output)) return;
+			}
+
+			if (buf.size() > kMaxRequestSize) {
+				sendResponse(fd, "error", "Request too long, the limit is "
+						+ util::toString(kMaxRequestSize) + " bytes\n");
+				return;
+			}
+		}
+	}
+
+	// Keeps devices and hives open, and serves actions over a UNIX
+	// socket, so callers don't pay for process startup, opening the
+	// hive and enumerating devices on every call.
+	int runServe(const Args& args)
+	{
+		if (args.size() != 3 || args[1] != "--socket") {
+			throw UserFault("serve requires --socket PATH");
+		}
+
+		const string& path = args[2];
+		sockaddr_un addr;
+
+		if (path.size() >= sizeof(addr.sun_path)) {
+			throw UserFault("Socket path too long: " + path);
+		}
+
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) throw ErrnoException("socket");
+		auto cleaner(util::createCleaner([fd] () { close(fd); }));
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+
+		// Remove a stale socket of a previous instance, but nothing else
+		struct stat st;
+		if (lstat(path.c_str(), &st) == 0) {
+			if (!S_ISSOCK(st.st_mode)) {
+				throw UserFault(path + " exists, and is not a socket");
+			}
+
+			int other = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (other < 0) throw ErrnoException("socket");
+			bool listening = connect(other, reinterpret_cast<sockaddr*>(&addr),
+					sizeof(addr)) == 0;
+			close(other);
+
+			if (listening) throw UserFault("Already serving on " + path);
+			if (unlink(path.c_str()) != 0) throw ErrnoException("unlink: " + path);
+		} else if (errno != ENOENT) {
+			throw ErrnoException("lstat: " + path);
+		}
+
+		if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+			throw ErrnoException("bind: " + path);
+		}
+
+		if (listen(fd, SOMAXCONN) != 0) throw ErrnoException("listen");
+
+		// Enumerate now, rather than on the first request
+		DevTree::getDisks();
+
+		try {
+			shared_ptr<DevTree::Monitor> monitor(make_shared<DevTree::Monitor>());
+
+			thread([monitor] () {
+				pollfd p = { monitor->fd(), POLLIN, 0 };
+				while (poll(&p, 1, -1) >= 0 || errno == EINTR) {
+					monitor->process();
+				}
+			}).detach();
+		} catch (const std::exception& e) {
+			cerr << "warning: devices will not be updated: " << e.what() << endl;
+		}
+
+		shared_ptr<HiveCache> cache(make_shared<HiveCache>());
+
+		while (true) {
+			int client = accept(fd, NULL, NULL);
+			if (client < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				throw ErrnoException("accept");
+			}
+
+			thread(serveConnection, client, cache).detach();
+		}
+	}
+
 	string getHiveFromArgs(int argc, char **argv, int& index)
 	{
-		string opt(argv[1]);
+		if (index >= argc) printUsageAndDie();
+
+		string opt(argv[index]);
+
+		// Hives on devices that aren't mounted are only copied, unless
+		// the action (or a batch) may modify them
+		auto isWritable = [argc, argv] (int action) {
+			return action < argc && (isWriteAction(argv[action])
+					|| string(argv[action]) == "batch");
+		};
 
 		if (opt == "--probe" /*|| argv[1][0] != '-'*/) {
-			set<WindowsInstall> installs(getAllWindowsInstalls());
+			map<string, string> failures;
+			set<WindowsInstall> installs(getAllWindowsInstalls(probeTimeoutMs,
+						failures));
+
+			for (auto& f : failures) {
+				cerr << "warning: skipped " << f.first << ": " << f.second << endl;
+			}
+
 			if (installs.empty()) {
 				throw UserFault(
 						"No Windows installations found. Specify one manually\n"
@@ -63,20 +944,20 @@ namespace {
 			}
 
 			index += 1;
-			return hiveFromSysDrive(installs.begin()->path);
+			return hiveFromSysDrive(installs.begin()->path, isWritable(index));
 		}
 
 		if (opt.substr(0, 2) == "--") {
-			if (argc < 3) {
+			if (index + 1 >= argc) {
 				throw UserFault(opt + " requires an argument");
 			}
 
-			string arg(argv[2]);
+			string arg(argv[index + 1]);
 
 			index += 2;
 
 			if (opt == "--sysdrive") {
-				return hiveFromSysDrive(arg);
+				return hiveFromSysDrive(arg, isWritable(index));
 			} else if (opt == "--sysroot") {
 				return hiveFromSysRoot(arg);
 			} else if (opt == "--sysdir") {
@@ -94,12 +975,6 @@ namespace {
 				"--probe to try auto-detection (needs root).\n");
 	}
 
-	[[noreturn]] void printUsageAndDie()
-	{
-		cerr << "usage: letterman [action] [arguments ...]" << endl;
-		cerr << "actions: list, swap, change, remove" << endl;
-		exit(1);
-	}
 
 }
 
@@ -109,156 +984,33 @@ int main(int argc, char **argv)
 		if (argc < 2) printUsageAndDie();
 
 		int i = 1;
-		string hive(getHiveFromArgs(argc, argv, i));
-
-		argc -= i;
-
-		if (!argc) printUsageAndDie();
-
-		string action(argv[i]);
-		string arg1(argc >= 2 ? argv[i + 1] : "");
-		string arg2(argc >= 3 ? argv[i + 2] : "");
-		string arg3(argc >= 4 ? argv[i + 3] : "");
-
-		if (action == "swap" || action == "change") {
-			requireArgCount(argc, 2);
-			requireDriveLetter(arg1);
-			requireDriveLetter(arg2);
-
-			char a = arg1[0];
-			char b = arg2[0];
-
-			MountedDevices md(hive, true);
-
-			if (action == "swap") {
-				md.swap(a, b);
-			} else if (action == "change") {
-				md.change(a, b);
-			}
-		} else if (action == "remove") {
-			requireArgCount(argc, 1);
-			requireDriveLetter(arg1);
+		parseGlobalOptions(argc, argv, i);
 
-			MountedDevices (hive, true).remove(arg1[0]);
-		} else if (action == "list") {
-
-			for (auto&& mapping : MountedDevices(hive).list()) {
-				string device(mapping->osDeviceName());
-
-				cout << mapping->name() << "  ";
-
-				if (device == Mapping::kOsNameUnknown) {
-					cout << "? " << mapping->toString(0);
-				} else if (device == Mapping::kOsNameNotAttached) {
-					cout << "- " << mapping->toString(0);
-				} else {
-					cout << "* " << mapping->osDeviceName();
-				}
-
-				cout << endl;
-			}
-#if 1
-		} else if (action == "add") {
-			requireArgCount(argc, 3);
-			requireDriveLetter(arg2);
-
-			if (arg1 == "mbr") {
-				requireArgCount(argc, 4);
-
-				struct Entry
-				{
-					uint32_t disk;
-					uint64_t offset;
-				} __attribute__((packed));
-
-				Entry e;
-				e.disk = htole32(util::fromString<uint32_t>(arg2, ios::hex));
-				e.offset = htole64(util::fromString<uint64_t>(arg3));
-
-				util::hexdump(cout, &e, 12, 4) << endl;
-
-				MountedDevices(hive, true).add(arg2[0], &e, 12);
-			} else if (arg1 == "raw") {
-				string wstr;
-				for (char c : arg3) {
-					wstr += c;
-					wstr += '\0';
-				}
-
-				util::hexdump(cout, wstr.c_str(), wstr.size(), 4) << endl;
-				MountedDevices(hive, true).add(arg2[0], wstr.c_str(), wstr.size());
-			} else if (arg1 == "partition") {
-				
-				Properties criteria = {{ DevTree::kPropDeviceMountable, arg3 }};
-				map<string, Properties> result(DevTree::getPartitions(criteria));
-				if (result.empty()) throw UserFault("No such partition: " + arg3);
-
-				Properties props = result.begin()->second;
-
-				uint64_t offsetMult = 1;
-				string offsetStr = props[DevTree::kPropPartOffsetBlocks];
-				if (!offsetStr.empty()) {
-					offsetMult = 512;
-				} else {
-					offsetStr = props[DevTree::kPropPartOffsetBytes];
-				}
-
-				if (offsetStr.empty()) {
-					throw UserFault("Failed to determine partition offset; must specify manually");
-				}
-
-				// Get the disk with the corresponding kPropDiskId
-				criteria = {{ DevTree::kPropDiskId, props[DevTree::kPropDiskId] }};
-				result = DevTree::getDisks(criteria);
-
-				if (result.empty()) {
-					throw UserFault("Failed to determine hosting disk of partition " + arg3);
-				}
-
-				props = result.begin()->second;
-
-				string mbrIdStr = props[DevTree::kPropMbrId];
-				if (mbrIdStr.empty()) {
-					throw UserFault("Failed to determine MBR disk id of partition " + arg3);
-				}
-
-				struct Entry
-				{
-					uint32_t disk;
-					uint64_t offset;
-				} __attribute__((packed));
-
-				Entry e;
-
-				e.disk = htole32(util::fromString<uint32_t>(mbrIdStr, ios::hex));
-				e.offset = htole64(offsetMult * util::fromString<uint64_t>(offsetStr));
+		if (i < argc && string(argv[i]) == "fleet") {
+			return runFleet(Args(argv + i, argv + argc), cout);
+		} else if (i < argc && string(argv[i]) == "serve") {
+			return runServe(Args(argv + i, argv + argc));
+		}
 
-				MountedDevices(hive, true).add(arg2[0], &e, sizeof(e));
+		string hive(getHiveFromArgs(argc, argv, i));
 
-			} else {
-				throw UserFault("Unknown type: " + arg1);
-			}
-		} else if (action == "dump") {
-			requireArgCount(argc, 1);
+		if (i >= argc) printUsageAndDie();
 
-			map<string, Properties> data;
+		Args args(argv + i, argv + argc);
 
-			if (arg1 == "partitions") data = DevTree::getPartitions();
-			else if (arg1 == "disks") data = DevTree::getDisks();
+		if (args[0] == "batch") {
+			return runBatch(hive, args, cout);
+		}
 
-			for (auto& e : data) {
-				cout << e.first << "\t" << e.second[DevTree::kPropHardware] << endl;
-#if 1
-				for (auto& props : e.second) {
-					cout << "  " << props.first << "=" << props.second << endl;
-				}
-#endif
-			}
-#endif
-		} else {
-			cerr << action << ": unknown action" << endl;
-			return 1;
+		bool writable = isWriteAction(args[0]);
+		if (writable && isHiveCopy(hive)) {
+			throw UserFault("Can't modify a hive in an image");
 		}
+
+		MountedDevices md(hive, writable);
+		MountedDevices::Transaction t(md.begin());
+		runAction(t, args, cout);
+		t.commit();
 	} catch (const UserFault& uf) {
 		cerr << uf.what() << endl;
 		return 1;
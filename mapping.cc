@@ -4,12 +4,18 @@
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdio>
+#include <mutex>
+#include <deque>
 #include "exception.h"
 #include "devtree.h"
+#include "gpt.h"
+#include "record_writer.h"
 #include "mapping.h"
 #include "endian.h"
 #include "util.h"
-#include "mbr.h"
 using namespace std;
 
 namespace letterman {
@@ -72,313 +78,619 @@ namespace letterman {
 #endif
 		}
 
-		unsigned resolveExtendedPartition(ifstream& in, const size_t blockSize,
-				const uint64_t extLbaStart, uint64_t ebrLbaStart,
-				const uint64_t searchOffset, unsigned& counter)
+		// Partition GUIDs read directly from the GPTs of disks, for
+		// partitions the OS doesn't know about (yet). Only disks that
+		// have no partitions in the device table, or partitions without
+		// a GUID, can have such partitions, so only their GPTs are
+		// read. Rebuilt when the devices change.
+		shared_ptr<const GPT::Index> getGptIndex()
 		{
-			MBR ebr;
+			static mutex lock;
+			static shared_ptr<const GPT::Index> index;
+			static uint64_t generation = 0;
 
-			if (!in.seekg(ebrLbaStart * blockSize) || !ebr.read(in)) {
-				return 0;
-			}
+			lock_guard<mutex> guard(lock);
+
+			uint64_t current = DevTree::generation();
+
+			if (!index || generation != current) {
+				generation = current;
+				shared_ptr<GPT::Index> newIndex(make_shared<GPT::Index>());
 
+				unordered_set<string> known, incomplete;
+				DevTree::Devices partitions(DevTree::getPartitions());
 
-			uint64_t logPartLbaStart =
-				ebrLbaStart + ebr.partitions[0].lbaStart;
+				for (auto part : partitions) {
+					string disk(part.get(DevTree::kPropDiskId));
+					if (part.get(DevTree::kPropPartUuid).empty()) {
+						incomplete.insert(disk);
+					} else {
+						known.insert(disk);
+					}
+				}
 
-			ebrLbaStart = extLbaStart + ebr.partitions[1].lbaStart;
+				for (auto disk : DevTree::getDisks()) {
+					string id(disk.get(DevTree::kPropDiskId));
+					if (known.count(id) && !incomplete.count(id)) continue;
 
-			if (logPartLbaStart == searchOffset) {
-				return counter;
-			} else if (ebrLbaStart != extLbaStart) {
-				return resolveExtendedPartition(in, blockSize, extLbaStart,
-						ebrLbaStart, searchOffset, ++counter);
+					string device(disk.get(DevTree::kPropDeviceReadable));
+					GPT::Ptr gpt(GPT::get(device, disk.blockSize()));
+					if (gpt) newIndex->add(device, *gpt, disk.blockSize());
+				}
+
+				index = newIndex;
 			}
 
-			return 0;
+			return index;
 		}
 
-		unsigned resolveExtendedPartition(ifstream& in, size_t blockSize,
-				uint64_t extLbaStart, uint64_t lbaStart, unsigned& counter)
+		// As in kPropMbrId
+		string formatMbrId(uint32_t id)
 		{
-			return resolveExtendedPartition(in, blockSize, extLbaStart,
-					extLbaStart, lbaStart, counter);
+			char buf[9];
+			snprintf(buf, sizeof(buf), "%08x", id);
+			return buf;
 		}
 
 		string resolveMbrDiskOrPartition(uint32_t id, uint64_t offset = 0,
 				bool useLbaStart = false)
 		{
-			for (auto& disk : DevTree::getDisks()) {
-				const string& device = disk.second[DevTree::kPropDeviceReadable];
-				ifstream in(device.c_str());
-				MBR mbr;
-				if (!in.good() || !mbr.read(in)) {
+			for (auto disk : DevTree::getDisks()) {
+				PartitionTable::Ptr table(disk.partitionTable());
+				if (!table || table->mbrId != id) {
 					continue;
 				}
 
-				if (mbr.id == id) {
-					if (!useLbaStart) return device;
+				string device(disk.get(DevTree::kPropDeviceReadable));
+				if (!useLbaStart) return device;
+
+				unsigned partition = table->find(offset / disk.blockSize());
+				if (partition) {
+					return getPartitionName(device, partition);
+				}
+			}
+
+			return "";
+		}
+
+		string mbrDeviceName(uint32_t id, uint64_t offset)
+		{
+			Properties criteria = {{ DevTree::kPropMbrId, formatMbrId(id) }};
+
+			string disk;
+			DevTree::Devices result(DevTree::getDisks(criteria));
+
+			if (result.empty()) {
+#ifndef LETTERMAN_LINUX
+				disk = resolveMbrDiskOrPartition(id, offset, true);
+#else
+				disk = resolveMbrDiskOrPartition(id);
+#endif
+			} else {
+				// TODO handle the not-so-fringe case where getDisks() returns
+				// more than one result
+				disk = result.front().get(DevTree::kPropDeviceReadable);
+			}
+
+			if (disk.empty()) {
+				return Mapping::kOsNameUnknown;
+			}
+#ifndef LETTERMAN_LINUX
+			else {
+				return disk;
+			}
+#endif
+
+			// We have a disk name, but no partition yet. Do the lookup
+			// again, this time explicitly specifying the disk and
+			// ignoring the kPropMbrId
+
+			criteria[DevTree::kPropMbrId] = DevTree::kIgnoreValue;
+			criteria[DevTree::kPropDeviceReadable] = disk;
+			result = DevTree::getDisks(criteria);
+
+			if (result.empty()) {
+				// This shouldn't happen, since findDiskWithMbrId returned
+				// a disk...
+				return Mapping::kOsNameUnknown;
+			}
+
+			// Remove the disk, as we are searching for the partition now
+			criteria[DevTree::kPropDeviceReadable] = DevTree::kIgnoreValue;
+
+			// Searching for a partition by offset only might yield
+			// ambigous results, especially if the partition in question
+			// is the first partition with an offset of 2 or 63 blocks
+			// (many partitioning utilities do this). We thus limit our
+			// search to partitions with a matching disk id.
+			criteria[DevTree::kPropDiskId] = result.front().get(DevTree::kPropDiskId);
+
+			// Try blocks offset first
+			criteria[DevTree::kPropPartOffsetBlocks] = util::toString(offset / 512);
+
+			DevTree::Devices partitions(DevTree::getPartitions(criteria));
+			if (!partitions.empty()) {
+				return partitions.front().name();
+			}
+
+			// Now try byte offset
+			criteria[DevTree::kPropPartOffsetBytes] = util::toString(offset);
+			criteria[DevTree::kPropPartOffsetBlocks] = DevTree::kIgnoreValue;
+
+			partitions = DevTree::getPartitions(criteria);
+			if (!partitions.empty()) {
+				return partitions.front().name();
+			}
+
+#ifdef __linux__
+			return Mapping::kOsNameNotAttached;
+#else
+			// On OSX, most of the above queries will fail, so we can't say
+			// that the device is not attached.
+			return Mapping::kOsNameUnknown;
+#endif
+		}
+
+		string gptDeviceName(const string& guid)
+		{
+			Properties criteria = {{ DevTree::kPropPartUuid, guid }};
+			DevTree::Devices result(DevTree::getPartitions(criteria));
+			if (!result.empty()) {
+				// TODO handle the fringe case where there is more
+				// than one result!
+				return result.front().name();
+			}
+
+			shared_ptr<const GPT::Index> index(getGptIndex());
+			const GPT::Index::Location* location = index->find(guid);
+			if (location) {
+				string name(getPartitionName(location->disk, location->number));
+				return name.substr(name.rfind('/') + 1);
+			}
+
+			return Mapping::kOsNameNotAttached;
+		}
+
+		// Optical drives, by the vendor and model in their instance path
+		string genericDeviceName(string path)
+		{
+			string::size_type pos = path.find("SCSI\\CdRom");
+			if (pos == 0) {
+				pos = path.find("&Prod_");
+				if (pos == string::npos) return Mapping::kOsNameUnknown;
+
+				// SCSI optical drives are stored as
+				// SCSI\CdRom&Ven_<vendor>&Prod_<model>\,
+				// whereas udev seems to use <vendor><mode>
+				// in ID_MODEL.
+
+				// Remove &Prod_
+				path.erase(pos, 6);
+
+				pos = path.find("&Ven_");
+				if (pos == string::npos || pos + 5 >= path.size()) {
+					return Mapping::kOsNameUnknown;
+				}
+
+				pos += 5;
+
+				string::size_type begin = pos;
+
+				pos = path.find_first_of("\\&", begin);
+				if (pos == string::npos) return Mapping::kOsNameUnknown;
 
-					size_t blockSize = DevTree::blockSize(disk.second);
-					uint64_t lbaStart = offset / blockSize;
+				string model(path.substr(begin, pos - begin));
+				Properties criteria = {{ DevTree::kPropHardware, model }};
 
-					if (lbaStart > UINT64_C(0xffffffff)) continue;
+				DevTree::Devices results(DevTree::getDisks(criteria));
+				if (results.empty()) {
+					return Mapping::kOsNameNotAttached;
+				} else if (results.size() == 1) {
+					return results.front().name();
+				}
+			}
 
-					unsigned counter = 5;
+			if ((pos = path.find("IDE\\CdRom")) == 0) {
+				// IDE optical drives are stored as
+				// IDE\CdRom<vendor>_<model>_<other info>
 
-					for (unsigned i = 0; i != 4; ++i) {
-						if (!mbr.partitions[i].type) continue;
+				// Skip the prefix
+				pos += 9;
+
+				if (pos >= path.size()) return Mapping::kOsNameUnknown;
+
+				string::size_type begin = pos;
+
+				if ((pos = path.find('_', pos)) == string::npos) {
+					return Mapping::kOsNameUnknown;
+				}
 
-						uint32_t partLbaStart = mbr.partitions[i].lbaStart;
+				// Remove the first underscore. Note that this will not
+				// work if the vendor string contains an underscore!
 
-						if (partLbaStart == lbaStart) {
-							return getPartitionName(device, i + 1);
-						} else if (MBR::isExtended(mbr.partitions[i])) {
-							unsigned partition = resolveExtendedPartition(in,
-									blockSize, partLbaStart, lbaStart * blockSize,
-									counter);
+				path.erase(pos);
 
-							if (partition) {
-								return getPartitionName(device, partition);
-							}
+				string ret;
+
+				for (auto disk : DevTree::getDisks()) {
+					if (path.find(disk.get(DevTree::kPropHardware)) == begin) {
+						if (!ret.empty()) {
+							// We have more than one match!
+							return Mapping::kOsNameUnknown;
 						}
+						ret = disk.name();
 					}
 				}
+
+				return ret.empty() ? Mapping::kOsNameNotAttached : ret;
 			}
 
-			return "";
+			return Mapping::kOsNameUnknown;
+		}
+
+		// Windows' wide characters, with all but 7-bit ones replaced
+		// by '?'
+		inline char narrow(const char* p)
+		{
+			return (p[1] || p[0] & 0x80) ? '?' : p[0];
 		}
 
+		// Values in the hive need not be aligned
+		template<typename T> T load(const char* p)
+		{
+			T t;
+			memcpy(&t, p, sizeof(t));
+			return t;
+		}
 	}
 
 	const string Mapping::kOsNameUnknown("\0\1", 2);
 	const string Mapping::kOsNameNotAttached("\0\2", 2);
 
-	MappingName::MappingName(char letter, const string& guid)
-	: _letter(letter), _guid(guid)
+	MappingName::MappingName(char letter, util::StringRef guid)
+	: _letter(letter)
 	{
-		util::capitalize(_guid);
+		size_t len = min(guid.size(), sizeof(_guid) - 1);
+		transform(guid.data(), guid.data() + len, _guid, ::toupper);
+		_guid[len] = 0;
 	}
 
 	std::string MappingName::key() const
 	{
 		if (_letter) {
 			return string("\\DosDevices\\") + _letter + ":";
-		} else if (!_guid.empty()) {
-			return "\\??\\Volume{" + _guid + "}";
+		} else if (_guid[0]) {
+			return string("\\??\\Volume{") + _guid + "}";
 		} else {
 			return "";
 		}
 	}
 
-	string RawMapping::toString(int padding) const
+	void MappingName::addFields(RecordWriter& writer) const
 	{
-		ostringstream ostr;
-		util::hexdump(ostr, _data, padding);
-		return ostr.str();
+		if (_letter) {
+			writer.add("letter", string(1, _letter));
+		} else {
+			writer.add("volume", _guid);
+		}
 	}
 
-	string MbrPartitionMapping::toString(int padding) const
+	Mapping::Mapping(const MappingName& name, util::StringRef data)
+	: _name(name), _kind(KIND_RAW), _data(data), _disk(0), _offset(0)
 	{
-		ostringstream ostr(string(padding, ' '));
-		ostr << setfill('0') << hex;
-
-		ostr << "MBR Disk 0x";
-		ostr << setw(8) << _disk;
-		ostr << " @ 0x";
-		ostr << setw(16) << _offset;
-		ostr << " (block " << setw(0) << dec << _offset / 512 << ")";
-
-		return ostr.str();
+		const char* buf = data.data();
+		size_t len = data.size();
+
+		if (len == 12) {
+			_kind = KIND_MBR;
+			_disk = le32toh(load<uint32_t>(buf));
+			_offset = le64toh(load<uint64_t>(buf + 4));
+		} else if (len >= 8) {
+			uint64_t magic = load<uint64_t>(buf);
+			if (len == 24 && magic == UINT64_C(0x3a44493a4f494d44)) { // "DMIO:ID:"
+				_kind = KIND_GPT;
+			} else if (magic == UINT64_C(0x005c003f003f005c) // "\??\"
+					|| magic == UINT64_C(0x005f003f003f005f)) { // "_??_"
+				// Data is composed of the "Mapping Instance Path", with an
+				// appended GUID specifying the "Mapping Interface"
+				// (http://msdn.microsoft.com/en-us/library/windows/hardware/ff545813%28v=vs.85%29.aspx)
+				// Note that the GUID is surrounded by {}
+				if (len >= (36 + 2) * 2 && len % 2 == 0) {
+					_kind = KIND_DEVICE;
+				}
+			}
+		}
 	}
 
-	string MbrPartitionMapping::osDeviceName() const
+	string Mapping::guid() const
 	{
-		ostringstream ostr;
-		ostr << setfill('0') << hex << setw(8) << _disk;
-
-		Properties criteria = {{ DevTree::kPropMbrId, ostr.str() }};
-
-		string disk;
-		map<string, Properties> result(DevTree::getDisks(criteria));
-
-		if (result.empty()) {
-#ifndef LETTERMAN_LINUX
-			disk = resolveMbrDiskOrPartition(_disk, _offset, true);
-#else
-			disk = resolveMbrDiskOrPartition(_disk);
-#endif
-		} else {
-			// TODO handle the not-so-fringe case where getDisks() returns
-			// more than one result
-			disk = result.begin()->second[DevTree::kPropDeviceReadable];
-		}
-
-		if (disk.empty()) {
-			return kOsNameUnknown;
-		}
-#ifndef LETTERMAN_LINUX
-		else {
-			return disk;
+		if (_kind == KIND_GPT) {
+			return util::guidToString(_data.data() + 8);
+		} else if (_kind != KIND_DEVICE) {
+			return "";
 		}
-#endif
 
-		// We have a disk name, but no partition yet. Do the lookup
-		// again, this time explicitly specifying the disk and
-		// ignoring the kPropMbrId
+		const char* guid = _data.data() + _data.size() - (36 + 1) * 2;
+		string ret(36, 0);
 
-		criteria[DevTree::kPropMbrId] = DevTree::kIgnoreValue;
-		criteria[DevTree::kPropDeviceReadable] = disk;
-		result = DevTree::getDisks(criteria);
-
-		if (result.empty()) {
-			// This shouldn't happen, since findDiskWithMbrId returned
-			// a disk...
-			return kOsNameUnknown;
+		for (size_t i = 0; i != 36; ++i) {
+			ret[i] = narrow(guid + i * 2);
 		}
 
-		// Remove the disk, as we are searching for the partition now
-		criteria[DevTree::kPropDeviceReadable] = DevTree::kIgnoreValue;
+		return ret;
+	}
 
-		Properties props = result.begin()->second;
+	string Mapping::path() const
+	{
+		if (_kind != KIND_DEVICE) return "";
 
-		// Searching for a partition by offset only might yield
-		// ambigous results, especially if the partition in question
-		// is the first partition with an offset of 2 or 63 blocks
-		// (many partitioning utilities do this). We thus limit our
-		// search to partitions with a matching disk id.
-		criteria[DevTree::kPropDiskId] = props[DevTree::kPropDiskId];
+		// Skip the \??\ prefix, and stop before the GUID
+		size_t len = _data.size() / 2;
+		size_t guidBegin = len - (36 + 2);
+		size_t end = guidBegin < 4 ? len : guidBegin;
 
-		// Try blocks offset first
-		criteria[DevTree::kPropPartOffsetBlocks] = util::toString(_offset / 512);
+		string path;
+		path.reserve(end - 4);
 
-		result = DevTree::getPartitions(criteria);
-		if (!result.empty()) {
-			return result.begin()->first;
+		for (size_t i = 4; i != end; ++i) {
+			char c = narrow(_data.data() + i * 2);
+			path += c == '#' ? '\\' : c;
 		}
 
-		// Now try byte offset
-		criteria[DevTree::kPropPartOffsetBytes] = util::toString(_offset);
-		criteria[DevTree::kPropPartOffsetBlocks] = DevTree::kIgnoreValue;
-
-		result = DevTree::getPartitions(criteria);
-		if (!result.empty()) {
-			return result.begin()->first;
+		if (path[path.size() - 1] == '\\') {
+			path.resize(path.size() - 1);
 		}
 
-#ifdef __linux__
-		return kOsNameNotAttached;
-#else
-		// On OSX, most of the above queries will fail, so we can't say
-		// that the device is not attached.
-		return kOsNameUnknown;
-#endif
+		return path;
 	}
 
-	string GuidPartitionMapping::osDeviceName() const
+	string Mapping::toString(int padding) const
 	{
-		string guid(_guid);
-
-		Properties criteria = {{ DevTree::kPropPartUuid, guid }};
-		map<string, Properties> result(DevTree::getPartitions(criteria));
-		if (!result.empty()) {
-			// TODO handle the fringe case where there is more
-			// than one result!
-			return result.begin()->first;
+		if (_kind == KIND_RAW) {
+			ostringstream ostr;
+			util::hexdump(ostr, _data.data(), _data.size(), padding);
+			return ostr.str();
 		}
 
-		return kOsNameNotAttached;
-	}
-
-	string GuidPartitionMapping::toString(int padding) const
-	{
 		ostringstream ostr(string(padding, ' '));
-		ostr << "GUID Partition " << _guid;
+
+		switch (_kind) {
+		case KIND_MBR:
+			ostr << setfill('0') << hex;
+			ostr << "MBR Disk 0x";
+			ostr << setw(8) << _disk;
+			ostr << " @ 0x";
+			ostr << setw(16) << _offset;
+			ostr << " (block " << setw(0) << dec << _offset / 512 << ")";
+			break;
+
+		case KIND_GPT:
+			ostr << "GUID Partition " << guid();
+			break;
+
+		case KIND_DEVICE:
+			ostr << devInterfaceGuidToName(guid()) << " " << path();
+			break;
+
+		default:
+			break;
+		}
+
 		return ostr.str();
 	}
 
-	string GenericMapping::toString(int padding) const
+	void Mapping::addFields(RecordWriter& writer) const
 	{
-		ostringstream ostr(string(padding, ' '));
-		ostr << devInterfaceGuidToName(_guid) << " " << _path;
-		return ostr.str();
+		static const char* digits = "0123456789abcdef";
+
+		switch (_kind) {
+		case KIND_RAW:
+			{
+				string hex;
+				hex.reserve(_data.size() * 2);
+
+				for (size_t i = 0; i != _data.size(); ++i) {
+					unsigned char c = _data.data()[i];
+					hex += digits[c >> 4];
+					hex += digits[c & 0xf];
+				}
+
+				writer.add("kind", "raw");
+				writer.add("data", hex);
+			}
+			break;
+
+		case KIND_MBR:
+			writer.add("kind", "mbr");
+			writer.add("disk", uint64_t(_disk));
+			writer.add("offset", _offset);
+			break;
+
+		case KIND_GPT:
+			writer.add("kind", "gpt");
+			writer.add("guid", guid());
+			break;
+
+		case KIND_DEVICE:
+			writer.add("kind", "device");
+			writer.add("guid", guid());
+			writer.add("path", path());
+			break;
+		}
 	}
 
-	string GenericMapping::osDeviceName() const
+	string Mapping::osDeviceName() const
 	{
-		string path(_path);
+		switch (_kind) {
+		case KIND_MBR:
+			return mbrDeviceName(_disk, _offset);
+		case KIND_GPT:
+			return gptDeviceName(guid());
+		case KIND_DEVICE:
+			return genericDeviceName(path());
+		default:
+			return kOsNameUnknown;
+		}
+	}
 
-		string::size_type pos = path.find("SCSI\\CdRom");
-		if (pos == 0) {
-			pos = path.find("&Prod_");
-			if (pos == string::npos) return kOsNameUnknown;
+	vector<string> resolveDevices(const MappingTable& mappings,
+			ResolveMode mode)
+	{
+		typedef unordered_map<util::StringRef, string, util::StringRef::Hash> Join;
+
+		vector<string> ret(mappings.size(), Mapping::kOsNameUnknown);
+		if (mode == RESOLVE_NONE) return ret;
+
+		// The joins only refer to their keys
+		deque<string> keys;
+		auto key = [&keys] (string&& k) -> util::StringRef {
+			keys.push_back(move(k));
+			return keys.back();
+		};
+
+		// MBR id -> disk id, (disk id, offset) -> partition name and
+		// partition GUID -> partition name. Each map starts out with
+		// the keys that are needed, and is filled in by one pass over
+		// the disks or partitions.
+		Join disks, byBlocks, byBytes, byGuid;
+		// MBR ids and GUIDs of the mappings
+		vector<util::StringRef> mbrIds(mappings.size()), guids(mappings.size());
+
+		for (size_t i = 0; i != mappings.size(); ++i) {
+			const Mapping& mapping = mappings[i];
+
+			if (mapping.kind() == Mapping::KIND_MBR) {
+#ifdef LETTERMAN_LINUX
+				mbrIds[i] = key(formatMbrId(mapping.disk()));
+				disks.emplace(mbrIds[i], Mapping::kOsNameUnknown);
+#else
+				// No MBR ids in the device table
+				if (mode == RESOLVE_FULL) ret[i] = mapping.osDeviceName();
+#endif
+			} else if (mapping.kind() == Mapping::KIND_GPT) {
+				guids[i] = key(mapping.guid());
+				byGuid.emplace(guids[i], "");
+			} else {
+				// Other mappings only query the device table
+				ret[i] = mapping.osDeviceName();
+			}
+		}
 
-			// SCSI optical drives are stored as
-			// SCSI\CdRom&Ven_<vendor>&Prod_<model>\,
-			// whereas udev seems to use <vendor><mode>
-			// in ID_MODEL.
+		if (!disks.empty()) {
+			size_t pending = disks.size();
+			vector<DevTree::Device> unlabelled;
+			DevTree::Devices all(DevTree::getDisks());
 
-			// Remove &Prod_
-			path.erase(pos, 6);
+			for (auto disk : all) {
+				util::StringRef id(disk.get(DevTree::kPropMbrId));
+				if (id.empty()) {
+					unlabelled.push_back(disk);
+					continue;
+				}
 
-			pos = path.find("&Ven_");
-			if (pos == string::npos || pos + 5 >= path.size()) {
-				return kOsNameUnknown;
+				auto iter = disks.find(id);
+				if (iter != disks.end() && iter->second == Mapping::kOsNameUnknown) {
+					iter->second = disk.get(DevTree::kPropDiskId);
+					--pending;
+				}
 			}
 
-			pos += 5;
+			// Only disks without a known MBR id can be the missing ones
+			for (size_t i = 0; mode == RESOLVE_FULL && pending && i != unlabelled.size(); ++i) {
+				PartitionTable::Ptr table(unlabelled[i].partitionTable());
+				if (!table) continue;
 
-			string::size_type begin = pos;
+				auto iter = disks.find(formatMbrId(table->mbrId));
+				if (iter != disks.end() && iter->second == Mapping::kOsNameUnknown) {
+					iter->second = unlabelled[i].get(DevTree::kPropDiskId);
+					--pending;
+				}
+			}
 
-			pos = path.find_first_of("\\&", begin);
-			if (pos == string::npos) return kOsNameUnknown;
+			for (size_t i = 0; i != mappings.size(); ++i) {
+				if (mbrIds[i].empty()) continue;
 
-			string model(path.substr(begin, pos - begin));
-			Properties criteria = {{ DevTree::kPropHardware, model }};
+				const string& disk(disks.find(mbrIds[i])->second);
+				if (disk == Mapping::kOsNameUnknown) continue;
 
-			map<string, Properties> results(DevTree::getDisks(criteria));
-			if (results.empty()) {
-				return kOsNameNotAttached;
-			} else if (results.size() == 1) {
-				return results.begin()->first;
+				uint64_t offset = mappings[i].offset();
+				byBlocks.emplace(key(disk + '\0' + util::toString(offset / 512)), "");
+				byBytes.emplace(key(disk + '\0' + util::toString(offset)), "");
 			}
 		}
 
-		if ((pos = path.find("IDE\\CdRom")) == 0) {
-			// IDE optical drives are stored as
-			// IDE\CdRom<vendor>_<model>_<other info>
-
-			// Skip the prefix
-			pos += 9;
-
-			if (pos >= path.size()) return kOsNameUnknown;
+		if (!byBlocks.empty() || !byGuid.empty()) {
+			// Partitions are sorted by name, so the first match is the
+			// same one that a query would return.
+			string k;
+			auto join = [&k] (Join& join, const DevTree::Device& part,
+					util::StringRef disk, util::StringRef offset) {
+				if (offset.empty()) return;
+
+				k.assign(disk.data(), disk.size());
+				k += '\0';
+				k.append(offset.data(), offset.size());
+
+				auto iter = join.find(k);
+				if (iter != join.end() && iter->second.empty()) {
+					iter->second = part.name();
+				}
+			};
 
-			string::size_type begin = pos;
+			for (auto part : DevTree::getPartitions()) {
+				if (!byGuid.empty()) {
+					auto iter = byGuid.find(part.get(DevTree::kPropPartUuid));
+					if (iter != byGuid.end() && iter->second.empty()) {
+						iter->second = part.name();
+					}
+				}
 
-			if ((pos = path.find('_', pos)) == string::npos) {
-				return kOsNameUnknown;
+				if (!byBlocks.empty()) {
+					util::StringRef disk(part.get(DevTree::kPropDiskId));
+					join(byBlocks, part, disk, part.get(DevTree::kPropPartOffsetBlocks));
+					join(byBytes, part, disk, part.get(DevTree::kPropPartOffsetBytes));
+				}
 			}
+		}
 
-			// Remove the first underscore. Note that this will not
-			// work if the vendor string contains an underscore!
+		auto lookup = [] (const Join& join, util::StringRef k) -> string {
+			auto iter = join.find(k);
+			return iter != join.end() ? iter->second : "";
+		};
 
-			path.erase(pos);
+		shared_ptr<const GPT::Index> gptIndex;
 
-			string ret;
+		for (size_t i = 0; i != mappings.size(); ++i) {
+			if (!mbrIds[i].empty()) {
+				string disk(lookup(disks, mbrIds[i]));
+				if (disk == Mapping::kOsNameUnknown) continue;
 
-			for (auto& disk : DevTree::getDisks()) {
-				if (path.find(disk.second[DevTree::kPropHardware]) == begin) {
-					if (!ret.empty()) {
-						// We have more than one match!
-						return kOsNameUnknown;
+				uint64_t offset = mappings[i].offset();
+				string name(lookup(byBlocks, disk + '\0' + util::toString(offset / 512)));
+				if (name.empty()) {
+					name = lookup(byBytes, disk + '\0' + util::toString(offset));
+				}
+
+				ret[i] = name.empty() ? Mapping::kOsNameNotAttached : name;
+			} else if (!guids[i].empty()) {
+				string name(lookup(byGuid, guids[i]));
+
+				if (name.empty() && mode == RESOLVE_FULL) {
+					// Partitions the OS doesn't know about (yet)
+					if (!gptIndex) gptIndex = getGptIndex();
+					const GPT::Index::Location* location = gptIndex->find(guids[i]);
+					if (location) {
+						name = getPartitionName(location->disk, location->number);
+						name = name.substr(name.rfind('/') + 1);
+					} else {
+						name = Mapping::kOsNameNotAttached;
 					}
-					ret = disk.first;
 				}
-			}
 
-			return ret.empty() ? kOsNameNotAttached : ret;
+				if (!name.empty()) ret[i] = name;
+			}
 		}
 
-		return kOsNameUnknown;
+		return ret;
 	}
 }
@@ -4,31 +4,38 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
+#include "util.h"
 
 namespace letterman {
+	class RecordWriter;
 
 	class MappingName
 	{
 		public:
 
 		MappingName()
-		: _letter(0), _guid("") {}
+		: _letter(0)
+		{ _guid[0] = 0; }
 
 		static MappingName letter(char letter) {
-			return MappingName(letter, "");
+			return MappingName(letter, util::StringRef());
 		}
 
-		static MappingName volume(const std::string& guid) {
+		static MappingName volume(util::StringRef guid) {
 			return MappingName(0, guid);
 		}
 
 		std::string key() const;
 
+		// Adds a "letter" or "volume" field
+		void addFields(RecordWriter& writer) const;
+
 		friend std::ostream& operator<<(std::ostream& os, const MappingName& name)
 		{
 			if (name._letter) {
 				os << name._letter << ":";
-			} else if (!name._guid.empty()) {
+			} else if (name._guid[0]) {
 				os << "Volume{" << name._guid << "}";
 			} else {
 				os << "(Invalid)";
@@ -38,100 +45,119 @@ namespace letterman {
 		}
 
 		private:
-		MappingName(char letter, const std::string& guid);
+		MappingName(char letter, util::StringRef guid);
 
 		char _letter;
-		std::string _guid;
+		// Upper case; stored in place, as volume names are plentiful
+		char _guid[37];
 	};
 
+	// A value of the MountedDevices key, decoded according to its kind.
+	// Mappings are plain values that refer to the value's data rather
+	// than copying it, so the data must outlive them. Strings (GUIDs,
+	// paths) are only formatted when asked for.
 	class Mapping
 	{
 		public:
 
-		typedef std::unique_ptr<Mapping> Ptr;
+		enum Kind
+		{
+			KIND_RAW,
+			KIND_MBR,
+			KIND_GPT,
+			KIND_DEVICE
+		};
 
 		static const std::string kOsNameNotAttached;
 		static const std::string kOsNameUnknown;
 
-		Mapping() {}
-		virtual ~Mapping() {}
+		Mapping(const MappingName& name, util::StringRef data);
 
 		const MappingName& name() const {
 			return _name;
 		}
 
-		virtual std::string toString(int padding) const = 0;
-		virtual std::string osDeviceName() const
-		{ return kOsNameUnknown; }
-
-		friend class MountedDevices;
-
-		private:
-		MappingName _name;
-	};
+		Kind kind() const
+		{ return _kind; }
 
-	class RawMapping : public Mapping 
-	{
-		public:
-		RawMapping(const std::string& data)
-		: _data(data) {}
+		std::string toString(int padding) const;
+		std::string osDeviceName() const;
 
-		virtual ~RawMapping() {}
+		// Adds "kind" and the fields of the mapping's kind
+		void addFields(RecordWriter& writer) const;
 
-		virtual std::string toString(int padding) const override;
+		// KIND_MBR
+		uint32_t disk() const
+		{ return _disk; }
 
-		private:
-		std::string _data;
-	};
+		uint64_t offset() const
+		{ return _offset; }
 
-	class MbrPartitionMapping : public Mapping
-	{
-		public:
-		MbrPartitionMapping(uint32_t disk, uint64_t offset)
-		: _disk(disk), _offset(offset) {}
+		// KIND_GPT: the partition GUID; KIND_DEVICE: the interface GUID
+		std::string guid() const;
 
-		virtual ~MbrPartitionMapping() {}
-
-		virtual std::string toString(int padding) const override;
-		virtual std::string osDeviceName() const override;
+		// KIND_DEVICE: the instance path, with '\\' as separator
+		std::string path() const;
 
 		private:
+		MappingName _name;
+		Kind _kind;
+		util::StringRef _data;
 		uint32_t _disk;
 		uint64_t _offset;
 	};
 
-	class GuidPartitionMapping : public Mapping
+	// Mappings, stored contiguously. Also owns the buffers that mappings
+	// refer to if they aren't owned by the hive (see MountedDevices).
+	class MappingTable
 	{
 		public:
-		GuidPartitionMapping(const std::string& guid)
-		: _guid(guid)
-		{}
+		typedef std::vector<Mapping>::const_iterator const_iterator;
 
-		virtual ~GuidPartitionMapping() {}
+		MappingTable() {}
+		MappingTable(MappingTable&& other) = default;
+		MappingTable& operator=(MappingTable&& other) = default;
 
-		virtual std::string toString(int padding) const override;
-		virtual std::string osDeviceName() const override;
+		size_t size() const
+		{ return _mappings.size(); }
 
-		private:
-		std::string _guid;
-	};
+		bool empty() const
+		{ return _mappings.empty(); }
 
-	class GenericMapping : public Mapping
-	{
-		public:
-		GenericMapping(const std::string& path, 
-				const std::string& guid)
-		: _path(path), _guid(guid)
-		{}
+		const Mapping& operator[](size_t i) const
+		{ return _mappings[i]; }
+
+		const_iterator begin() const
+		{ return _mappings.begin(); }
 
-		virtual ~GenericMapping() {}
+		const_iterator end() const
+		{ return _mappings.end(); }
 
-		virtual std::string toString(int padding) const override;
-		virtual std::string osDeviceName() const override;
+		// Memory allocated by hivex, which is freed with free()
+		typedef std::unique_ptr<char, void (*)(void*)> Buffer;
 
 		private:
-		std::string _path;
-		std::string _guid;
+		friend class MountedDevices;
+
+		std::vector<Mapping> _mappings;
+		std::vector<Buffer> _buffers;
+	};
+
+	enum ResolveMode
+	{
+		// Don't access devices at all; all names are kOsNameUnknown
+		RESOLVE_NONE,
+		// Only use the device table, never read disks directly
+		RESOLVE_CACHED,
+		// Also read the partition tables of disks that may match
+		RESOLVE_FULL
 	};
+
+	// Returns the same as osDeviceName() for each mapping (with
+	// RESOLVE_FULL), but scans the device table only once for all of
+	// them, instead of querying it per mapping. Disks are read only if
+	// the device table doesn't know their MBR id.
+	std::vector<std::string> resolveDevices(const MappingTable& mappings,
+			ResolveMode mode = RESOLVE_FULL);
 }
 #endif
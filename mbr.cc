@@ -1,13 +1,23 @@
+#include <cstring>
 #include "endian.h"
 #include "mbr.h"
 
 namespace letterman {
 	bool MBR::read(std::istream& in) 
 	{
-		if (!in.read(reinterpret_cast<char*>(this), 512)) {
+		char sector[512];
+
+		if (!in.read(sector, 512)) {
 			return false;
 		}
 
+		return read(sector);
+	}
+
+	bool MBR::read(const void* sector)
+	{
+		memcpy(this, sector, 512);
+
 		if((sig = le16toh(sig)) != 0xaa55) {
 			return false;
 		}
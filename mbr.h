@@ -23,9 +23,14 @@ namespace letterman {
 		uint16_t sig;
 
 		bool read(std::istream& in);
+		bool read(const void* sector);
 
 		static bool isExtended(const Partition& partition) {
-			switch (partition.type) {
+			return isExtended(partition.type);
+		}
+
+		static bool isExtended(uint8_t type) {
+			switch (type) {
 				case 0x05: // CHS extended, but (ab)used as LBA
 				case 0x0f: // LBA extended
 				case 0x85: // Linux extended
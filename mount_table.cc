@@ -0,0 +1,123 @@
+#ifdef LETTERMAN_LINUX
+#include <sys/sysmacros.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include "mount_table.h"
+#include "exception.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		bool isOctal(char c)
+		{
+			return c >= '0' && c <= '7';
+		}
+
+		// Undoes the octal escaping of spaces, tabs, newlines
+		// and backslashes in mountinfo fields.
+		string unescape(const string& str)
+		{
+			string ret;
+			ret.reserve(str.size());
+
+			for (size_t i = 0; i < str.size(); ++i) {
+				if (str[i] == '\\' && i + 3 < str.size()
+						&& isOctal(str[i + 1]) && isOctal(str[i + 2])
+						&& isOctal(str[i + 3])) {
+					ret += char((str[i + 1] - '0') * 64 + (str[i + 2] - '0') * 8
+							+ (str[i + 3] - '0'));
+					i += 3;
+				} else {
+					ret += str[i];
+				}
+			}
+
+			return ret;
+		}
+
+		mutex lock;
+		MountTable::Ptr current;
+	}
+
+	MountTable::Ptr MountTable::get(bool refresh)
+	{
+		lock_guard<mutex> guard(lock);
+
+		if (!current || refresh) {
+			current = make_shared<MountTable>("/proc/self/mountinfo");
+		}
+
+		return current;
+	}
+
+	MountTable::MountTable(const string& filename)
+	{
+		ifstream in(filename.c_str());
+		if (!in) throw ErrnoException("open: " + filename);
+
+		string line;
+
+		// 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw
+		while (getline(in, line)) {
+			istringstream istr(line);
+			string id, parent, devNum, root, target, field;
+			Mount m;
+
+			if (!(istr >> id >> parent >> devNum >> root >> target)) continue;
+
+			// skip mount options and optional fields
+			while (istr >> field && field != "-");
+
+			if (!(istr >> m.fsType >> m.source)) continue;
+
+			unsigned maj, min;
+			char colon;
+			istringstream dstr(devNum);
+			if (!(dstr >> maj >> colon >> min) || colon != ':') continue;
+
+			m.device = makedev(maj, min);
+			m.source = unescape(m.source);
+			m.target = unescape(target);
+
+			size_t i = _mounts.size();
+			bool isRoot = (root == "/");
+
+			_mounts.push_back(m);
+			_isRoot.push_back(isRoot);
+
+			addToIndex(_bySource, m.source, i, isRoot);
+			addToIndex(_byDevice, m.device, i, isRoot);
+		}
+	}
+
+	template<class K> void MountTable::addToIndex(unordered_map<K, size_t>& index,
+			const K& key, size_t i, bool isRoot)
+	{
+		auto result = index.insert(make_pair(key, i));
+		if (!result.second && isRoot && !_isRoot[result.first->second]) {
+			result.first->second = i;
+		}
+	}
+
+	const MountTable::Mount* MountTable::findBySource(const string& source) const
+	{
+		auto iter = _bySource.find(source);
+		return iter != _bySource.end() ? &_mounts[iter->second] : nullptr;
+	}
+
+	const MountTable::Mount* MountTable::findByDevice(dev_t device) const
+	{
+		auto iter = _byDevice.find(device);
+		return iter != _byDevice.end() ? &_mounts[iter->second] : nullptr;
+	}
+
+	const MountTable::Mount* MountTable::find(const string& source,
+			dev_t device) const
+	{
+		const Mount* m = findByDevice(device);
+		return m ? m : findBySource(source);
+	}
+}
+#endif
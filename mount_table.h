@@ -0,0 +1,56 @@
+#ifndef LETTERMAN_MOUNT_TABLE_H
+#define LETTERMAN_MOUNT_TABLE_H
+#include <unordered_map>
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace letterman {
+
+	// Snapshot of the mount table, parsed once from
+	// /proc/self/mountinfo and indexed by source device and by
+	// device number. Linux only.
+	class MountTable
+	{
+		public:
+		struct Mount
+		{
+			std::string source;
+			std::string target;
+			std::string fsType;
+			dev_t device;
+		};
+
+		typedef std::shared_ptr<const MountTable> Ptr;
+
+		// Returns the current snapshot, which is created on first use,
+		// or re-read if refresh is set.
+		static Ptr get(bool refresh = false);
+
+		explicit MountTable(const std::string& filename);
+
+		// Return NULL if the device is not mounted. If a device is
+		// mounted more than once, mounts of its root directory are
+		// preferred over bind mounts of subdirectories.
+		const Mount* findBySource(const std::string& source) const;
+		const Mount* findByDevice(dev_t device) const;
+
+		// By device number first, since the source may be a symlink
+		// or a different name for the same device.
+		const Mount* find(const std::string& source, dev_t device) const;
+
+		const std::vector<Mount>& mounts() const
+		{ return _mounts; }
+
+		private:
+		template<class K> void addToIndex(std::unordered_map<K, size_t>& index,
+				const K& key, size_t i, bool isRoot);
+
+		std::vector<Mount> _mounts;
+		std::vector<bool> _isRoot;
+		std::unordered_map<std::string, size_t> _bySource;
+		std::unordered_map<dev_t, size_t> _byDevice;
+	};
+}
+#endif
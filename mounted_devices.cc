@@ -1,9 +1,11 @@
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <memory>
 #include <cctype>
+#include <set>
 #include "mounted_devices.h"
 #include "exception.h"
 #include "endian.h"
@@ -15,183 +17,42 @@ namespace letterman {
 
 		string toString(char* buf, size_t len = 0)
 		{
-			unique_ptr<char> p(buf);
+			MappingTable::Buffer p(buf, free);
 			return len ? string(buf, len) : string(buf);
 		}
 
-		// poor man's conversion from windows wide strings
-		// with 16-byte chars. we simply ignore all chars
-		// where the second byte is non-zero (or the first
-		// byte a non-7-bit char)
-		string fromWstring(string wstr)
-		{
-			if (wstr.size() % 2) {
-				throw invalid_argument("wstr");
-			}
-
-			string ret;
-
-			for(string::size_type i = 0; i < wstr.size(); i += 2) {
-				ret += (wstr[i + 1] || wstr[i] & 0x80) ? '?' : wstr[i];
-			}
-
-			return ret;
-		}
-
-		string parseGuid(const char* buf, size_t offset)
-		{
-			ostringstream ostr;
-
-			const char* p = buf + offset;
-			uint32_t a = *reinterpret_cast<const uint32_t*>(p + 0);
-			uint16_t b = *reinterpret_cast<const uint16_t*>(p + 4);
-			uint16_t c = *reinterpret_cast<const uint16_t*>(p + 6);
-			uint16_t d = htobe16(*reinterpret_cast<const uint16_t*>(p + 8));
-
-			ostr << uppercase << hex << setfill('0');
-			ostr << setw(8) << a << "-";
-			ostr << setw(4) << b << "-";
-			ostr << setw(4) << c << "-";
-			ostr << setw(4) << d << "-";
-
-			for (int i = 10; i != 16; ++i) {
-				int c = *(p + i) & 0xff;
-				ostr << setw(2) << c;
-			}
-
-			return ostr.str();
-		}
-
-		Mapping* createMapping(const string& data)
-		{
-			const char* buf = data.c_str();
-			size_t len = data.size();
-
-			if (len == 12) {
-				uint32_t disk = le32toh(*reinterpret_cast<const uint32_t*>(buf));
-				uint64_t offset = le64toh(*reinterpret_cast<const uint64_t*>(buf + 4));
-				return new MbrPartitionMapping(disk, offset);
-			} else if (len >= 8) {
-				uint64_t magic = *reinterpret_cast<const uint64_t*>(buf);
-				if (len == 24 && magic == UINT64_C(0x3a44493a4f494d44)) { // "DMIO:ID:"
-					return new GuidPartitionMapping(parseGuid(buf, 8));
-				} else if (magic == UINT64_C(0x005c003f003f005c) // "\??\"
-						|| magic == UINT64_C(0x005f003f003f005f)) { // "_??_"
-					if (len >= (36 + 2) * 2) {
-						string bytes(fromWstring(data));
-
-						// Data is composed of the "Mapping Instance Path", with an
-						// appended GUID specifying the "Mapping Interface"
-						// (http://msdn.microsoft.com/en-us/library/windows/hardware/ff545813%28v=vs.85%29.aspx)
-						// Note that the GUID is surrounded by {}
-						size_t guidBegin = bytes.size() - (36 + 2);
-
-						string instancePath(bytes.substr(4, guidBegin - 4));
-						string intfGuid(bytes.substr(guidBegin + 1, 36));
-
-						string::size_type pos;
-
-						while ((pos = instancePath.find('#')) != string::npos) {
-							instancePath[pos] = '\\';
-						}
-
-						if (instancePath[instancePath.size() - 1] == '\\') {
-							instancePath.resize(instancePath.size() - 1);
-						}
-
-						return new GenericMapping(instancePath, intfGuid);
-					}
-				}
-			}
-			return new RawMapping(data);
-		}
-
-		struct Value
-		{
-			Value()
-			: freeKey(true), freeValue(true)
-			{
-				val = { 0 };
-			}
-
-			~Value()
-			{
-				if (freeKey) free(val.key);
-				if (freeValue) free(val.value);
-			}
-
-			hive_set_value* operator->() {
-				return &val;
-			}
-
-			hive_set_value* operator*() {
-				return &val;
-			}
-
-			void setKey(const string& key)
-			{
-				if (freeKey) free(val.key);
-				val.key = strdup(key.c_str());
-			}
-
-			bool freeKey;
-			bool freeValue;
-
-			hive_set_value val;
-		};
+		MountedDevices::Backend backend = MountedDevices::BACKEND_HIVEX;
+		MountedDevices::CommitMode commitMode = MountedDevices::COMMIT_DIRECT;
+	}
 
-		bool getValue(hive_h* hive, hive_node_h node, const string& name, Value& out)
-		{
-			hive_value_h handle = hivex_node_get_value(hive, node, name.c_str());
-			if (!handle) {
-				return false;
-			}
+	void MountedDevices::setBackend(Backend b)
+	{
+		backend = b;
+	}
 
-			out->value = hivex_value_value(hive, handle, &out->t, &out->len);
-			if (!out->value) {
-				throw ErrnoException("hivex_value_value");
-			}
+	void MountedDevices::setCommitMode(CommitMode mode)
+	{
+		commitMode = mode;
+	}
 
-			out->key = strdup(name.c_str());
-			if (!out->key) {
-				throw ErrnoException("strdup");
+	MountedDevices::MountedDevices(const string& filename, bool writable)
+	: _hive(nullptr), _node(0), _key(0)
+	{
+		if (backend == BACKEND_NATIVE) {
+			_regf.reset(new Regf(filename, writable));
+			_key = _regf->child(_regf->root(), "MountedDevices");
+			if (!_key) {
+				throw runtime_error("No MountedDevices key in " + filename);
 			}
 
-			return true;
-		}
-
-		void getValue(hive_h* hive, hive_node_h node, char letter, Value& out)
-		{
-			if (!getValue(hive, node, MappingName::letter(letter).key(), out)) {
-				throw UserFault(string("Letter is not mapped to any volume: ") + letter + ":");
-			}
+			return;
 		}
 
-		void requireDriveLetterNotTaken(hive_h* hive, hive_node_h node, char letter)
-		{
-			string key(MappingName::letter(letter).key());
-			hive_value_h handle = hivex_node_get_value(hive, node, key.c_str());
-			if (handle) {
-				hive_type t;
-				size_t len;
-
-				if (hivex_value_type(hive, handle, &t, &len) != 0) {
-					throw ErrnoException("hivex_value_type");
-				}
-
-				if (len != 0) {
-					throw UserFault(string("Drive letter ") 
-							+ letter + ": is already taken");
-				}
-
-				// Zero length means removed (by us) - Windows will boot
-				// happily with a zero-length \\DosMappings\\X: entry.
-			}
+		if (writable && commitMode == COMMIT_LOG) {
+			throw UserFault("Committing to the transaction log requires "
+					"--backend=native");
 		}
-	}
 
-	MountedDevices::MountedDevices(const string& filename, bool writable)
-	{
 		_hive = hivex_open(filename.c_str(), writable ? HIVEX_OPEN_WRITE : 0);
 		if (!_hive) {
 			throw ErrnoException("hivex_open: " + filename);
@@ -210,21 +71,68 @@ namespace letterman {
 
 	MountedDevices::~MountedDevices()
 	{
-		hivex_close(_hive);
+		if (_hive) hivex_close(_hive);
 	}
 
-	vector<Mapping::Ptr> MountedDevices::list(int flags) const
+	void MountedDevices::forEachValue(const function<bool(const string& key,
+				util::StringRef data)>& f, MappingTable& table) const
 	{
-		hive_value_h *values = hivex_node_values(_hive, _node);
+		if (_regf) {
+			// Data points into the mapped hive
+			_regf->forEachValue(_key, [&f] (const Regf::Value& v) {
+				f(v.name, v.data);
+			});
+
+			return;
+		}
+
+		unique_ptr<hive_value_h, void (*)(void*)> values(
+				hivex_node_values(_hive, _node), free);
 		if (!values) {
 			throw ErrnoException("hivex_node_values");
 		}
 
-		vector<Mapping::Ptr> devices;
+		string key;
 
-		for (; *values; ++values) {
+		for (hive_value_h* value = values.get(); *value; ++value) {
+			MappingTable::Buffer name(hivex_value_key(_hive, *value), free);
+			if (!name) {
+				throw ErrnoException("hivex_value_key");
+			}
+
+			key.assign(name.get());
+
+			hive_type type;
+			size_t len;
+			MappingTable::Buffer buf(hivex_value_value(_hive, *value, &type, &len),
+					free);
+			if (!buf) {
+				throw ErrnoException("hivex_value_value");
+			}
+
+			if (f(key, util::StringRef(buf.get(), len))) {
+				table._buffers.push_back(move(buf));
+			}
+		}
+	}
+
+	MappingTable MountedDevices::list(int flags) const
+	{
+		return list(flags, nullptr);
+	}
+
+	MappingTable MountedDevices::list(int flags, const Transaction* t) const
+	{
+		// Values from the hive, in hive order, followed by values that
+		// only exist in the transaction. Values that were overridden by
+		// the transaction are replaced by their queued contents.
+		// Mappings are decoded in place, and refer to the value data.
+		MappingTable table;
+		set<const Transaction::Value*> seen;
+
+		// Returns whether a mapping was added
+		auto add = [&table, flags] (const string& key, util::StringRef data) -> bool {
 			int letter = 0;
-			string key(toString(hivex_value_key(_hive, *values)));
 
 			if (key.find("\\DosDevices\\") == string::npos) {
 				// do something here
@@ -234,119 +142,250 @@ namespace letterman {
 				letter = toupper(key[key.size() - 2]);
 			}
 
-			hive_type type;
-			size_t len;
-			char *buf = hivex_value_value(_hive, *values, &type, &len);
-			if (!buf) {
-				throw ErrnoException("hivex_value_value");
-			}
-
-			if (!len) continue;
-
-			Mapping::Ptr device(createMapping(toString(buf, len)));
+			if (data.empty()) return false;
 
 			if (letter) {
-				device->_name = MappingName::letter(letter);
+				table._mappings.emplace_back(MappingName::letter(letter), data);
 			} else {
 				if (!(flags & LIST_WITHOUT_LETTER)) {
-					continue;
+					return false;
 				}
 
 				if (key.find("\\??\\Volume{") != 0) {
-					throw new runtime_error("Invalid key " + key);
+					throw runtime_error("Invalid key " + key);
 				}
 
-				device->_name = MappingName::volume(key.substr(11, 36));
+				util::StringRef guid(key.data() + 11, min(key.size() - 11, size_t(36)));
+				table._mappings.emplace_back(MappingName::volume(guid), data);
+			}
+
+			return true;
+		};
+
+		forEachValue([&] (const string& key, util::StringRef data) -> bool {
+			if (t) {
+				auto iter = t->_values.find(key);
+				if (iter != t->_values.end()) {
+					seen.insert(&iter->second);
+					if (iter->second.exists) add(key, iter->second.data);
+					return false;
+				}
 			}
 
-			devices.push_back(move(device));
+			return add(key, data);
+		}, table);
+
+		if (t) {
+			for (auto& e : t->_values) {
+				if (e.second.exists && !seen.count(&e.second)) {
+					add(e.first, e.second.data);
+				}
+			}
 		}
 
-		return devices;
+		return table;
 	}
 
-	void MountedDevices::swap(char a, char b)
+	MountedDevices::Transaction::Value& MountedDevices::Transaction::get(
+			char letter)
 	{
-		Value aVal, bVal;
+		string key(MappingName::letter(letter).key());
+
+		auto iter = _values.find(key);
+		if (iter != _values.end()) return iter->second;
+
+		Value& val = _values[key];
+		val.exists = false;
+		val.dirty = false;
+		val.type = hive_t_REG_BINARY;
+
+		if (_md->_regf) {
+			Regf::Value v;
+			if (_md->_regf->value(_md->_key, key, v)) {
+				val.type = static_cast<hive_type>(v.type);
+				val.data = v.data;
+				val.exists = true;
+			}
 
-		getValue(_hive, _node, a, aVal);
-		getValue(_hive, _node, b, bVal);
+			return val;
+		}
 
-		// The logical thing to do would be to rename the values,
-		// but hivex does not support this, so we read the 
-		// values, swap the keys, and write them back to the hive.
+		hive_value_h handle = hivex_node_get_value(_md->_hive, _md->_node,
+				key.c_str());
+		if (handle) {
+			size_t len;
+			char* buf = hivex_value_value(_md->_hive, handle, &val.type, &len);
+			if (!buf) {
+				_values.erase(key);
+				throw ErrnoException("hivex_value_value");
+			}
 
-		::swap(aVal->key, bVal->key);
+			if (len) {
+				val.data = toString(buf, len);
+			} else {
+				free(buf);
+			}
 
-		if (hivex_node_set_value(_hive, _node, &aVal.val, 0) != 0) {
-			throw ErrnoException("hivex_node_set_value");
+			val.exists = true;
 		}
 
-		if (hivex_node_set_value(_hive, _node, &bVal.val, 0) != 0) {
-			throw ErrnoException("hivex_node_set_value");
+		return val;
+	}
+
+	MountedDevices::Transaction::Value&
+	MountedDevices::Transaction::getMapped(char letter)
+	{
+		Value& val = get(letter);
+		if (!val.exists) {
+			throw UserFault(string("Letter is not mapped to any volume: ")
+					+ letter + ":");
 		}
 
-		if (hivex_commit(_hive, NULL, 0) != 0) {
-			throw ErrnoException("hivex_commit");
+		return val;
+	}
+
+	void MountedDevices::Transaction::requireNotTaken(char letter)
+	{
+		// Zero length means removed (by us) - Windows will boot
+		// happily with a zero-length \\DosMappings\\X: entry.
+		if (!get(letter).data.empty()) {
+			throw UserFault(string("Drive letter ")
+					+ letter + ": is already taken");
 		}
 	}
 
-	void MountedDevices::change(char from, char to)
+	void MountedDevices::Transaction::swap(char a, char b)
 	{
-		requireDriveLetterNotTaken(_hive, _node, to);
+		Value& aVal = getMapped(a);
+		Value& bVal = getMapped(b);
 
-		Value val;
-		getValue(_hive, _node, from, val);
+		// The logical thing to do would be to rename the values,
+		// but hivex does not support this, so we swap the contents
+		// and write both values back to the hive on commit.
 
-		string key(MappingName::letter(to).key());
+		::swap(aVal.type, bVal.type);
+		::swap(aVal.data, bVal.data);
+		aVal.dirty = bVal.dirty = true;
+	}
 
-		val.setKey(key);
+	void MountedDevices::Transaction::change(char from, char to)
+	{
+		requireNotTaken(to);
 
-		if (hivex_node_set_value(_hive, _node, &val.val, 0) != 0) {
-			throw ErrnoException("hivex_node_set_value");
-		}
+		Value& fromVal = getMapped(from);
+		Value& toVal = get(to);
 
-		if (hivex_commit(_hive, NULL, 0) != 0) {
-			throw ErrnoException("hivex_commit");
-		}
+		toVal.exists = true;
+		toVal.type = fromVal.type;
+		toVal.data = fromVal.data;
+		toVal.dirty = true;
 
-		remove(from);
+		// hivex does not support deleting values, so just clear it
+		fromVal.data.clear();
+		fromVal.dirty = true;
 	}
 
-	void MountedDevices::remove(char letter)
+	void MountedDevices::Transaction::remove(char letter)
 	{
-		Value val;
-		getValue(_hive, _node, letter, val);
+		Value& val = getMapped(letter);
 
 		// hivex does not support deleting values, so just clear it
-		val->len = 0;
+		val.data.clear();
+		val.dirty = true;
+	}
 
-		if (hivex_node_set_value(_hive, _node, &val.val, 0) != 0) {
-			throw ErrnoException("hivex_node_set_value");
-		}
+	void MountedDevices::Transaction::add(char letter, const void* data,
+			size_t len)
+	{
+		requireNotTaken(letter);
 
-		if (hivex_commit(_hive, NULL, 0) != 0) {
-			throw ErrnoException("hivex_commit");
+		Value& val = get(letter);
+		val.exists = true;
+		val.type = hive_t_REG_BINARY;
+		val.data.assign(static_cast<const char*>(data), len);
+		val.dirty = true;
+	}
+
+	bool MountedDevices::Transaction::empty() const
+	{
+		for (auto& e : _values) {
+			if (e.second.dirty) return false;
 		}
+
+		return true;
 	}
 
-	void MountedDevices::add(char letter, const void* data, size_t len)
+	void MountedDevices::Transaction::commit()
 	{
-		requireDriveLetterNotTaken(_hive, _node, letter);
+		if (empty()) {
+			_values.clear();
+			return;
+		}
+
+		if (_md->_regf) {
+			for (auto& e : _values) {
+				if (!e.second.dirty) continue;
+
+				_md->_regf->setValue(_md->_key, e.first, e.second.type,
+						e.second.data);
+			}
+
+			_values.clear();
+			_md->_regf->commit(commitMode == COMMIT_LOG);
+			return;
+		}
+
+		for (auto& e : _values) {
+			if (!e.second.dirty) continue;
 
-		Value val;
-		val->key = strdup(MappingName::letter(letter).key().c_str());
-		val->value = static_cast<char*>(const_cast<void*>(data));
-		val.freeValue = false;
-		val->len = len;
-		val->t = hive_t_REG_BINARY;
+			hive_set_value val;
+			val.key = const_cast<char*>(e.first.c_str());
+			val.t = e.second.type;
+			val.len = e.second.data.size();
+			val.value = const_cast<char*>(e.second.data.data());
 
-		if (hivex_node_set_value(_hive, _node, &val.val, 0) != 0) {
-			throw ErrnoException("hivex_node_set_value");
+			if (hivex_node_set_value(_md->_hive, _md->_node, &val, 0) != 0) {
+				throw ErrnoException("hivex_node_set_value");
+			}
 		}
 
-		if (hivex_commit(_hive, NULL, 0) != 0) {
+		_values.clear();
+
+		if (hivex_commit(_md->_hive, NULL, 0) != 0) {
 			throw ErrnoException("hivex_commit");
 		}
 	}
+
+	void MountedDevices::Transaction::rollback()
+	{
+		_values.clear();
+	}
+
+	void MountedDevices::swap(char a, char b)
+	{
+		Transaction t(begin());
+		t.swap(a, b);
+		t.commit();
+	}
+
+	void MountedDevices::change(char from, char to)
+	{
+		Transaction t(begin());
+		t.change(from, to);
+		t.commit();
+	}
+
+	void MountedDevices::remove(char letter)
+	{
+		Transaction t(begin());
+		t.remove(letter);
+		t.commit();
+	}
+
+	void MountedDevices::add(char letter, const void* data, size_t len)
+	{
+		Transaction t(begin());
+		t.add(letter, data, len);
+		t.commit();
+	}
 }
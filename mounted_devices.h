@@ -1,10 +1,13 @@
 #ifndef LETTERMAN_MOUNTED_DEVICES_H
 #define LETTERMAN_MOUNTED_DEVICES_H
+#include <functional>
 #include <memory>
 #include <vector>
 #include <string>
+#include <map>
 #include <hivex.h>
 #include "mapping.h"
+#include "regf.h"
 
 namespace letterman {
 
@@ -16,8 +19,74 @@ class MountedDevices
 
 	static const int LIST_WITHOUT_LETTER = 1;
 
-	Mapping::Ptr find(const MappingName& name) const;
-	std::vector<Mapping::Ptr> list(int flags = 0) const;
+	// Hives are read and written with hivex, or by mmap'ing the file
+	// (see Regf), in which case commits only write modified pages.
+	enum Backend { BACKEND_HIVEX, BACKEND_NATIVE };
+
+	static void setBackend(Backend backend);
+
+	// How the native backend commits: by writing the modified pages to
+	// the hive, or to its transaction log (see Regf::commit).
+	enum CommitMode { COMMIT_DIRECT, COMMIT_LOG };
+
+	static void setCommitMode(CommitMode mode);
+
+	// Queues changes to the MountedDevices key. All operations are
+	// validated against an in-memory view of the values touched so
+	// far, so later operations see the effects of earlier ones. Nothing
+	// is written to the hive until commit(), which writes all changes
+	// at once: with a single hivex_commit, or with the native backend a
+	// single Regf::commit (to the hive or its log, see CommitMode). A
+	// transaction that is destroyed without being committed is rolled
+	// back.
+	class Transaction
+	{
+		public:
+		Transaction(Transaction&& other) = default;
+		~Transaction() {}
+
+		void swap(char a, char b);
+		void change(char from, char to);
+		void remove(char letter);
+		void add(char letter, const void* data, size_t len);
+
+		void commit();
+		void rollback();
+
+		bool empty() const;
+
+		// Like MountedDevices::list, but reflects all queued changes
+		MappingTable list(int flags = 0) const
+		{ return _md->list(flags, this); }
+
+		private:
+		friend class MountedDevices;
+
+		Transaction(MountedDevices& md)
+		: _md(&md) {}
+
+		struct Value
+		{
+			bool exists;
+			bool dirty;
+			hive_type type;
+			std::string data;
+		};
+
+		Value& get(char letter);
+		Value& getMapped(char letter);
+		void requireNotTaken(char letter);
+
+		MountedDevices* _md;
+		std::map<std::string, Value> _values;
+	};
+
+	Transaction begin()
+	{ return Transaction(*this); }
+
+	// Mappings refer to the hive's data, so they are only valid until
+	// it is modified.
+	MappingTable list(int flags = 0) const;
 
 	void swap(char a, char b);
 	void change(char from, char to);
@@ -28,8 +97,19 @@ class MountedDevices
 	void add(char a, const void* data, size_t len);
 
 	private:
+	MappingTable list(int flags, const Transaction* t) const;
+
+	// Calls f for each value of the key, in hive order. f returns
+	// whether it still refers to the data; data read by hivex is then
+	// kept in table, and freed otherwise.
+	void forEachValue(const std::function<bool(const std::string& key,
+				util::StringRef data)>& f, MappingTable& table) const;
+
 	hive_h *_hive;
 	hive_node_h _node;
+
+	std::unique_ptr<Regf> _regf;
+	Regf::Key _key;
 };
 
 }
@@ -0,0 +1,583 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include "block_device.h"
+#include "exception.h"
+#include "endian.h"
+#include "ntfs.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		const Ntfs::Record kRecordMft = 0;
+		const Ntfs::Record kRecordRoot = 5;
+		// The MFT's own extents are in its first records
+		const uint64_t kBootstrapRecords = 16;
+		// File references also contain a sequence number
+		const uint64_t kRecordNumberMask = UINT64_C(0x0000ffffffffffff);
+
+		// Records and index blocks are protected by an update sequence,
+		// which replaces the last two bytes of every 512 byte block.
+		const size_t kFixupStride = 512;
+		const size_t kRecordUsaOffset = 0x04;
+		const size_t kRecordUsaCount = 0x06;
+
+		// MFT record ("FILE")
+		const size_t kRecordFirstAttribute = 0x14;
+		const size_t kRecordFlags = 0x16;
+		const size_t kRecordUsedSize = 0x18;
+		const uint16_t kRecordInUse = 0x01;
+
+		// Attributes
+		const uint32_t kAttrAttributeList = 0x20;
+		const uint32_t kAttrData = 0x80;
+		const uint32_t kAttrIndexRoot = 0x90;
+		const uint32_t kAttrIndexAllocation = 0xa0;
+		const uint32_t kAttrEnd = 0xffffffff;
+
+		const size_t kAttrType = 0x00;
+		const size_t kAttrLength = 0x04;
+		const size_t kAttrNonResident = 0x08;
+		const size_t kAttrNameLength = 0x09;
+		const size_t kAttrNameOffset = 0x0a;
+		const size_t kAttrFlags = 0x0c;
+		const size_t kAttrValueLength = 0x10;
+		const size_t kAttrValueOffset = 0x14;
+		const size_t kAttrStartVcn = 0x10;
+		const size_t kAttrRunsOffset = 0x20;
+		const size_t kAttrDataSize = 0x30;
+		const size_t kAttrInitializedSize = 0x38;
+		const size_t kAttrNonResidentSize = 0x40;
+		const uint16_t kAttrCompressed = 0x0001;
+		const uint16_t kAttrEncrypted = 0x4000;
+
+		// Attribute list entries
+		const size_t kListType = 0x00;
+		const size_t kListLength = 0x04;
+		const size_t kListNameLength = 0x06;
+		const size_t kListNameOffset = 0x07;
+		const size_t kListStartVcn = 0x08;
+		const size_t kListRecord = 0x10;
+		const size_t kListMinLength = 0x1a;
+
+		// Directory indexes: the root node is in the index root, all
+		// other nodes are index blocks ("INDX") in the index allocation.
+		const size_t kIndexRootBlockSize = 0x08;
+		const size_t kIndexRootNode = 0x10;
+		const size_t kIndexBlockNode = 0x18;
+		const size_t kNodeEntriesOffset = 0x00;
+		const size_t kNodeEntriesEnd = 0x04;
+		const size_t kNodeHeaderSize = 0x10;
+
+		const size_t kEntryRecord = 0x00;
+		const size_t kEntryLength = 0x08;
+		const size_t kEntryKeyLength = 0x0a;
+		const size_t kEntryFlags = 0x0c;
+		const size_t kEntryKey = 0x10;
+		const uint16_t kEntryHasChild = 0x01;
+		const uint16_t kEntryIsLast = 0x02;
+
+		// Keys are FILE_NAME attributes
+		const size_t kFileNameLength = 0x40;
+		const size_t kFileName = 0x42;
+
+		const unsigned kMaxIndexDepth = 32;
+		const size_t kChunkSize = 1024 * 1024;
+
+		uint16_t get16(const uint8_t* p)
+		{
+			uint16_t v;
+			memcpy(&v, p, sizeof(v));
+			return le16toh(v);
+		}
+
+		uint32_t get32(const uint8_t* p)
+		{
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			return le32toh(v);
+		}
+
+		uint64_t get64(const uint8_t* p)
+		{
+			uint64_t v;
+			memcpy(&v, p, sizeof(v));
+			return le64toh(v);
+		}
+
+		char upper(char c)
+		{
+			return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+		}
+
+		// Compares a UTF-16 name to an ASCII one, in the same order as
+		// NTFS sorts directory entries (as far as ASCII is concerned).
+		int compareName(const uint8_t* p, size_t len, const string& name)
+		{
+			for (size_t i = 0; i != len && i != name.size(); ++i) {
+				uint16_t c = get16(p + i * 2);
+				if (c < 0x80) c = upper(c);
+
+				uint16_t d = static_cast<uint8_t>(upper(name[i]));
+				if (c != d) return c < d ? -1 : 1;
+			}
+
+			return len == name.size() ? 0 : len < name.size() ? -1 : 1;
+		}
+
+		// Restores the last two bytes of each 512 byte block. Returns
+		// false if the block was only partially written.
+		bool applyFixups(uint8_t* buf, size_t size)
+		{
+			size_t usaOffset = get16(buf + kRecordUsaOffset);
+			size_t usaCount = get16(buf + kRecordUsaCount);
+
+			if (usaCount != size / kFixupStride + 1 || usaOffset + usaCount * 2 > size) {
+				return false;
+			}
+
+			const uint8_t* usa = buf + usaOffset;
+			for (size_t i = 1; i != usaCount; ++i) {
+				uint8_t* end = buf + i * kFixupStride - 2;
+				if (memcmp(end, usa, 2)) return false;
+				memcpy(end, usa + i * 2, 2);
+			}
+
+			return true;
+		}
+
+		bool isNamed(const uint8_t* attr, const string& name)
+		{
+			return attr[kAttrNameLength] == name.size() && !compareName(
+					attr + get16(attr + kAttrNameOffset), name.size(), name);
+		}
+	}
+
+	Ntfs::Ntfs(const shared_ptr<BlockDevice>& dev, const string& path)
+	: _dev(dev), _path(path)
+	{
+		uint8_t boot[512];
+		readDevice(0, boot, sizeof(boot));
+
+		if (memcmp(boot + 3, "NTFS    ", 8) || boot[510] != 0x55 || boot[511] != 0xaa) {
+			throw UserFault("No NTFS file system on " + path);
+		}
+
+		uint32_t sectorSize = get16(boot + 0x0b);
+		uint8_t spc = boot[0x0d];
+		int8_t cpr = boot[0x40];
+
+		// Large clusters are stored as a negative power of two
+		if (sectorSize < 256 || sectorSize > 4096 || sectorSize & (sectorSize - 1)
+				|| !spc || (spc > 0x80 && spc < 0xf4)) {
+			corrupt();
+		}
+
+		_clusterSize = sectorSize * (spc <= 0x80 ? spc : 1u << (256 - spc));
+		if (_clusterSize & (_clusterSize - 1)) corrupt();
+
+		// So is the record size, if it's less than a cluster
+		if (cpr > 0) {
+			if (_clusterSize > 65536u / cpr) corrupt();
+			_recordSize = cpr * _clusterSize;
+		} else if (cpr >= -16 && cpr <= -9) {
+			_recordSize = 1u << -cpr;
+		} else {
+			corrupt();
+		}
+
+		if (_recordSize & (_recordSize - 1)) corrupt();
+
+		// Read the MFT's first records directly, to get at its extents
+		uint64_t mftLcn = get64(boot + 0x30);
+		Run bootstrap = { 0, mftLcn,
+			(kBootstrapRecords * _recordSize + _clusterSize - 1) / _clusterSize,
+			false };
+		_mftRuns.push_back(bootstrap);
+
+		Stream mft;
+		if (!getStream(kRecordMft, kAttrData, "", mft) || mft.isResident) {
+			corrupt();
+		}
+
+		_mftRuns = mft.runs;
+	}
+
+	void Ntfs::corrupt() const
+	{
+		throw runtime_error("Not a valid NTFS file system: " + _path);
+	}
+
+	void Ntfs::readDevice(uint64_t offset, void* buf, size_t len) const
+	{
+		errno = 0;
+		if (!_dev->read(offset, buf, len)) throw ErrnoException("read: " + _path);
+	}
+
+	void Ntfs::readRecord(Record record, vector<uint8_t>& buf) const
+	{
+		Stream mft;
+		mft.isResident = false;
+		mft.runs = _mftRuns;
+		mft.size = mft.initializedSize = UINT64_MAX;
+
+		buf.resize(_recordSize);
+		if (record > UINT64_MAX / _recordSize) corrupt();
+		readStream(mft, record * _recordSize, buf.data(), buf.size());
+
+		if (memcmp(buf.data(), "FILE", 4) || !applyFixups(buf.data(), buf.size())
+				|| !(get16(buf.data() + kRecordFlags) & kRecordInUse)
+				|| get32(buf.data() + kRecordUsedSize) > _recordSize) {
+			corrupt();
+		}
+	}
+
+	bool Ntfs::getStream(Record record, uint32_t type, const string& name,
+			Stream& stream) const
+	{
+		vector<uint8_t> base;
+		readRecord(record, base);
+
+		// Calls f for each attribute of a record, until it returns false
+		auto forEach = [this] (const vector<uint8_t>& rec,
+				const function<bool(const uint8_t* attr, size_t len)>& f) {
+			size_t used = get32(rec.data() + kRecordUsedSize);
+			size_t pos = get16(rec.data() + kRecordFirstAttribute);
+
+			while (pos + 8 <= used) {
+				const uint8_t* attr = rec.data() + pos;
+				if (get32(attr + kAttrType) == kAttrEnd) break;
+
+				size_t len = get32(attr + kAttrLength);
+				if (len < kAttrValueOffset + 2 || len > used - pos
+						|| get16(attr + kAttrNameOffset) + attr[kAttrNameLength] * 2u > len
+						|| (attr[kAttrNonResident] && len < kAttrNonResidentSize)) {
+					corrupt();
+				}
+
+				if (!f(attr, len)) break;
+				pos += len;
+			}
+		};
+
+		// Values of a resident attribute, or the runs of a non-resident
+		// one, are copied, so the records can be discarded.
+		auto decode = [this] (const uint8_t* attr, size_t len, Stream& s) {
+			s.isResident = !attr[kAttrNonResident];
+
+			if (s.isResident) {
+				size_t offset = get16(attr + kAttrValueOffset);
+				size_t size = get32(attr + kAttrValueLength);
+				if (offset + size > len) corrupt();
+
+				s.data.assign(reinterpret_cast<const char*>(attr + offset), size);
+				s.size = s.initializedSize = size;
+				return;
+			}
+
+			if (get16(attr + kAttrFlags) & (kAttrCompressed | kAttrEncrypted)) {
+				throw runtime_error("Compressed and encrypted files are not "
+						"supported: " + _path);
+			}
+
+			if (!get64(attr + kAttrStartVcn)) {
+				s.size = get64(attr + kAttrDataSize);
+				s.initializedSize = get64(attr + kAttrInitializedSize);
+			}
+
+			// Runs are a header byte with the sizes of the length and
+			// the offset to the previous run's LCN, followed by both.
+			// Runs without an offset are sparse.
+			uint64_t vcn = get64(attr + kAttrStartVcn), lcn = 0;
+
+			for (size_t pos = get16(attr + kAttrRunsOffset); pos < len && attr[pos]; ) {
+				size_t lengthSize = attr[pos] & 0x0f, offsetSize = attr[pos] >> 4;
+				if (!lengthSize || lengthSize > 8 || offsetSize > 8
+						|| pos + 1 + lengthSize + offsetSize > len) {
+					corrupt();
+				}
+
+				Run run = { vcn, 0, 0, !offsetSize };
+
+				for (size_t i = 0; i != lengthSize; ++i) {
+					run.length |= uint64_t(attr[pos + 1 + i]) << (i * 8);
+				}
+
+				if (offsetSize) {
+					const uint8_t* p = attr + pos + 1 + lengthSize;
+					uint64_t offset = 0;
+					for (size_t i = 0; i != offsetSize; ++i) {
+						offset |= uint64_t(p[i]) << (i * 8);
+					}
+
+					// Sign-extend
+					if (offsetSize < 8 && p[offsetSize - 1] & 0x80) {
+						offset |= UINT64_MAX << (offsetSize * 8);
+					}
+
+					run.lcn = lcn += offset;
+				}
+
+				s.runs.push_back(run);
+				vcn += run.length;
+				pos += 1 + lengthSize + offsetSize;
+			}
+		};
+
+		stream = Stream();
+		stream.size = stream.initializedSize = 0;
+		bool found = false;
+
+		// Attributes that don't fit into a record are moved to others,
+		// which are listed in the attribute list.
+		Stream list;
+		bool hasList = false;
+
+		forEach(base, [&] (const uint8_t* attr, size_t len) {
+			if (get32(attr + kAttrType) == kAttrAttributeList) {
+				decode(attr, len, list);
+				hasList = true;
+				return false;
+			}
+
+			return true;
+		});
+
+		if (hasList) {
+			string entries(list.data);
+			if (!list.isResident) {
+				if (list.size > _recordSize * kBootstrapRecords) corrupt();
+				entries.resize(list.size);
+				readStream(list, 0, &entries[0], entries.size());
+			}
+
+			const uint8_t* p = reinterpret_cast<const uint8_t*>(entries.data());
+			vector<uint8_t> rec;
+
+			for (size_t pos = 0; pos + kListMinLength <= entries.size(); ) {
+				const uint8_t* entry = p + pos;
+				size_t len = get16(entry + kListLength);
+				if (len < kListMinLength || len > entries.size() - pos
+						|| entry[kListNameOffset] + entry[kListNameLength] * 2u > len) {
+					corrupt();
+				}
+
+				pos += len;
+
+				if (get32(entry + kListType) != type || entry[kListNameLength] != name.size()
+						|| compareName(entry + entry[kListNameOffset], name.size(), name)) {
+					continue;
+				}
+
+				Record extent = get64(entry + kListRecord) & kRecordNumberMask;
+				uint64_t startVcn = get64(entry + kListStartVcn);
+
+				if (extent == record) {
+					rec = base;
+				} else {
+					readRecord(extent, rec);
+				}
+
+				forEach(rec, [&] (const uint8_t* attr, size_t len) {
+					if (get32(attr + kAttrType) != type || !isNamed(attr, name)
+							|| (attr[kAttrNonResident]
+								&& get64(attr + kAttrStartVcn) != startVcn)) {
+						return true;
+					}
+
+					decode(attr, len, stream);
+					found = true;
+					return false;
+				});
+			}
+		} else {
+			forEach(base, [&] (const uint8_t* attr, size_t len) {
+				if (get32(attr + kAttrType) != type || !isNamed(attr, name)) {
+					return true;
+				}
+
+				decode(attr, len, stream);
+				found = true;
+				return stream.isResident;
+			});
+		}
+
+		if (!found) return false;
+
+		sort(stream.runs.begin(), stream.runs.end(),
+				[] (const Run& a, const Run& b) { return a.vcn < b.vcn; });
+
+		return true;
+	}
+
+	void Ntfs::readStream(const Stream& stream, uint64_t offset, void* buf,
+			size_t len) const
+	{
+		uint8_t* p = static_cast<uint8_t*>(buf);
+
+		if (offset > stream.size || len > stream.size - offset) corrupt();
+
+		if (stream.isResident) {
+			memcpy(p, stream.data.data() + offset, len);
+			return;
+		}
+
+		// Data that was never written reads as zeros
+		if (offset + len > stream.initializedSize) {
+			size_t valid = offset < stream.initializedSize
+				? stream.initializedSize - offset : 0;
+			memset(p + valid, 0, len - valid);
+			len = valid;
+		}
+
+		while (len) {
+			uint64_t vcn = offset / _clusterSize;
+
+			auto run = upper_bound(stream.runs.begin(), stream.runs.end(), vcn,
+					[] (uint64_t vcn, const Run& r) { return vcn < r.vcn; });
+			if (run == stream.runs.begin()) corrupt();
+			--run;
+
+			if (vcn - run->vcn >= run->length) corrupt();
+
+			uint64_t within = offset - run->vcn * _clusterSize;
+			size_t n = min<uint64_t>(len, run->length * _clusterSize - within);
+
+			if (run->isSparse) {
+				memset(p, 0, n);
+			} else {
+				if (run->lcn > UINT64_MAX / _clusterSize) corrupt();
+				readDevice(run->lcn * _clusterSize + within, p, n);
+			}
+
+			p += n;
+			offset += n;
+			len -= n;
+		}
+	}
+
+	bool Ntfs::findChild(Record dir, const string& name, Record& child) const
+	{
+		Stream root;
+		if (!getStream(dir, kAttrIndexRoot, "$I30", root)) return false;
+		if (!root.isResident || root.data.size() < kIndexRootNode + kNodeHeaderSize) {
+			corrupt();
+		}
+
+		const uint8_t* r = reinterpret_cast<const uint8_t*>(root.data.data());
+		size_t blockSize = get32(r + kIndexRootBlockSize);
+		if (blockSize < kIndexBlockNode + kNodeHeaderSize || blockSize % kFixupStride
+				|| blockSize > 65536) {
+			corrupt();
+		}
+
+		// Blocks are addressed in clusters, or in 512 byte units if they
+		// are smaller than a cluster.
+		size_t vcnSize = blockSize >= _clusterSize ? _clusterSize : 512;
+
+		Stream allocation;
+		bool hasAllocation = getStream(dir, kAttrIndexAllocation, "$I30", allocation);
+
+		const uint8_t* node = r + kIndexRootNode;
+		size_t nodeSize = root.data.size() - kIndexRootNode;
+		vector<uint8_t> block(blockSize);
+
+		for (unsigned depth = 0; depth != kMaxIndexDepth; ++depth) {
+			size_t pos = get32(node + kNodeEntriesOffset);
+			size_t end = get32(node + kNodeEntriesEnd);
+			if (end > nodeSize) corrupt();
+
+			// Entries are sorted; the last one has no key, only the
+			// child with all names after the previous entry.
+			const uint8_t* entry = nullptr;
+			uint16_t flags = 0;
+
+			while (true) {
+				if (pos + kEntryKey > end) corrupt();
+
+				entry = node + pos;
+				size_t len = get16(entry + kEntryLength);
+				flags = get16(entry + kEntryFlags);
+				if (len < kEntryKey || len > end - pos
+						|| ((flags & kEntryHasChild) && len < kEntryKey + 8)) {
+					corrupt();
+				}
+
+				if (flags & kEntryIsLast) break;
+
+				size_t keyLength = get16(entry + kEntryKeyLength);
+				const uint8_t* key = entry + kEntryKey;
+				if (keyLength < kFileName || kEntryKey + keyLength > len
+						|| kFileName + key[kFileNameLength] * 2u > keyLength) {
+					corrupt();
+				}
+
+				int cmp = compareName(key + kFileName, key[kFileNameLength], name);
+				if (!cmp) {
+					child = get64(entry + kEntryRecord) & kRecordNumberMask;
+					return true;
+				}
+
+				if (cmp > 0) break;
+				pos += len;
+			}
+
+			if (!(flags & kEntryHasChild)) return false;
+			if (!hasAllocation) corrupt();
+
+			uint64_t vcn = get64(entry + get16(entry + kEntryLength) - 8);
+			if (vcn > UINT64_MAX / vcnSize) corrupt();
+			readStream(allocation, vcn * vcnSize, block.data(), block.size());
+
+			if (memcmp(block.data(), "INDX", 4) || !applyFixups(block.data(), block.size())) {
+				corrupt();
+			}
+
+			node = block.data() + kIndexBlockNode;
+			nodeSize = blockSize - kIndexBlockNode;
+		}
+
+		corrupt();
+	}
+
+	bool Ntfs::find(const string& path, Record& record) const
+	{
+		record = kRecordRoot;
+		string::size_type pos = 0;
+
+		while (pos <= path.size()) {
+			string::size_type end = path.find_first_of("/\\", pos);
+			if (end == string::npos) end = path.size();
+
+			string name(path.substr(pos, end - pos));
+			if (!name.empty() && !findChild(record, name, record)) return false;
+
+			pos = end + 1;
+		}
+
+		return true;
+	}
+
+	void Ntfs::read(Record record,
+			const function<void(const void* data, size_t len)>& f) const
+	{
+		Stream data;
+		if (!getStream(record, kAttrData, "", data)) {
+			throw runtime_error("Not a file: " + _path);
+		}
+
+		// Sparse files could be larger, but not the ones we're after,
+		// and a corrupt size shouldn't fill up the disk.
+		if (data.size > _dev->size()) corrupt();
+
+		vector<uint8_t> buf(min<uint64_t>(data.size, kChunkSize));
+
+		for (uint64_t offset = 0; offset < data.size; ) {
+			size_t n = min<uint64_t>(data.size - offset, buf.size());
+			readStream(data, offset, buf.data(), n);
+			f(buf.data(), n);
+			offset += n;
+		}
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef LETTERMAN_NTFS_H
+#define LETTERMAN_NTFS_H
+#include <functional>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace letterman {
+	class BlockDevice;
+
+	// Minimal read-only NTFS reader, to get at files on partitions and
+	// images without mounting them. Only the boot sector, the MFT
+	// records on the way to a file, and the file's data are read.
+	// Compressed and encrypted files are not supported, and names are
+	// only compared ignoring ASCII case. A corrupt file system results
+	// in a runtime_error.
+	class Ntfs
+	{
+		public:
+		// Number of an MFT record
+		typedef uint64_t Record;
+
+		// Throws UserFault if the device doesn't contain NTFS
+		Ntfs(const std::shared_ptr<BlockDevice>& dev, const std::string& path);
+
+		// Finds a file or directory by its path relative to the root,
+		// with components separated by '/' or '\'. Returns false if
+		// there is no such file.
+		bool find(const std::string& path, Record& record) const;
+
+		// Calls f with consecutive chunks of the file's data
+		void read(Record record,
+				const std::function<void(const void* data, size_t len)>& f) const;
+
+		private:
+		struct Run
+		{
+			uint64_t vcn;
+			uint64_t lcn;
+			uint64_t length;
+			bool isSparse;
+		};
+
+		// An attribute's value, which is either stored in the MFT
+		// record, or in runs of clusters.
+		struct Stream
+		{
+			bool isResident;
+			std::string data;
+			std::vector<Run> runs;
+			uint64_t size;
+			uint64_t initializedSize;
+		};
+
+		void readRecord(Record record, std::vector<uint8_t>& buf) const;
+		bool getStream(Record record, uint32_t type, const std::string& name,
+				Stream& stream) const;
+		void readStream(const Stream& stream, uint64_t offset, void* buf,
+				size_t len) const;
+		bool findChild(Record dir, const std::string& name, Record& child) const;
+		void readDevice(uint64_t offset, void* buf, size_t len) const;
+		[[noreturn]] void corrupt() const;
+
+		std::shared_ptr<BlockDevice> _dev;
+		std::string _path;
+		uint32_t _clusterSize;
+		uint32_t _recordSize;
+		std::vector<Run> _mftRuns;
+	};
+}
+#endif
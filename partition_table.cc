@@ -0,0 +1,320 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <map>
+#include <set>
+#include "partition_table.h"
+#include "block_device.h"
+#include "util.h"
+#include "mbr.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		typedef PartitionTable::Partition Partition;
+
+		class Cache
+		{
+			public:
+			static Cache& instance()
+			{
+				static Cache cache;
+				return cache;
+			}
+
+			// Must be called with the lock held
+			PartitionTable::Ptr find(const string& identity)
+			{
+				if (!_loaded) load();
+
+				auto iter = _tables.find(identity);
+				return iter != _tables.end() ? iter->second : nullptr;
+			}
+
+			// Must be called with the lock held
+			void save(const string& identity, const PartitionTable::Ptr& table)
+			{
+				_tables[identity] = table;
+
+				// The cache is optional, so errors are ignored. Lines
+				// are appended, so concurrent writers don't clobber each
+				// other; later lines win when loading.
+				mkdir(dir.c_str(), 0755);
+				ofstream out(filename().c_str(), ios::app);
+				out << format(identity, *table);
+			}
+
+			mutex lock;
+			map<string, PartitionTable::Ptr> byDevice;
+			string dir;
+
+			private:
+			Cache()
+			: _loaded(false) {}
+
+			string filename() const
+			{ return dir + "/ptables"; }
+
+			static string format(const string& identity, const PartitionTable& table)
+			{
+				ostringstream ostr;
+				ostr << identity << " " << hex << table.mbrId << dec;
+				for (auto& p : table.partitions) {
+					ostr << " " << p.number << ":" << unsigned(p.type) << ":"
+						<< p.lbaStart << ":" << p.lbaSize;
+				}
+				ostr << "\n";
+				return ostr.str();
+			}
+
+			// A disk's identity without the checksum of its first sector
+			static string diskOf(const string& identity)
+			{ return identity.substr(0, identity.rfind('/')); }
+
+			// Disks without a serial may not be the same disk in another
+			// process, so their tables are never cached. Older versions
+			// stored them with "-" as the serial.
+			static bool isStable(const string& identity)
+			{ return identity.compare(0, 2, "-/") != 0; }
+
+			void load()
+			{
+				_loaded = true;
+
+				ifstream in(filename().c_str());
+				string line;
+				size_t lines = 0;
+				// Disk -> its latest identity; a line for a disk replaces
+				// the ones before, whose first sector has changed since.
+				map<string, string> latest;
+
+				while (getline(in, line)) {
+					++lines;
+					istringstream istr(line);
+					string identity, partition;
+					shared_ptr<PartitionTable> table(make_shared<PartitionTable>());
+
+					if (!(istr >> identity >> hex >> table->mbrId >> dec)) continue;
+
+					bool valid = true;
+
+					while (valid && istr >> partition) {
+						Partition p;
+						unsigned type;
+						char c1, c2, c3;
+						istringstream pstr(partition);
+
+						valid = (pstr >> p.number >> c1 >> type >> c2 >> p.lbaStart
+									>> c3 >> p.lbaSize)
+							&& c1 == ':' && c2 == ':' && c3 == ':';
+
+						p.type = type;
+						table->add(p);
+					}
+
+					if (!valid || !isStable(identity)) continue;
+
+					string& previous = latest[diskOf(identity)];
+					if (!previous.empty()) _tables.erase(previous);
+					previous = identity;
+
+					_tables[identity] = table;
+				}
+
+				// Entries are only ever appended, so drop the stale ones
+				if (lines > _tables.size()) compact();
+			}
+
+			// Rewrites the file with the entries that are still valid.
+			// The new file is renamed into place, so readers never see a
+			// partial one. Lines appended by another process in between
+			// are lost, which only means reading those tables again.
+			void compact()
+			{
+				string tmpl(filename() + ".XXXXXX");
+				int fd = mkstemp(&tmpl[0]);
+				if (fd == -1) return;
+				fchmod(fd, 0644);
+
+				string data;
+				for (auto& entry : _tables) data += format(entry.first, *entry.second);
+
+				bool written = util::pwriteAll(fd, 0, data.data(), data.size());
+				if (close(fd) != 0) written = false;
+
+				if (!written || rename(tmpl.c_str(), filename().c_str()) != 0) {
+					unlink(tmpl.c_str());
+				}
+			}
+
+			bool _loaded;
+			map<string, PartitionTable::Ptr> _tables;
+		};
+
+		// Corrupted or malicious chains may be arbitrarily long, or
+		// loop back onto themselves.
+		const unsigned kMaxLogicalPartitions = 1024;
+
+		// Walks the EBR chain of an extended partition, reading each
+		// EBR exactly once.
+		void readLogicalPartitions(BlockDevice& dev, size_t blockSize,
+				const MBR::Partition& extended, PartitionTable& table)
+		{
+			const uint64_t extLbaStart = extended.lbaStart;
+			const uint64_t extLbaEnd = extLbaStart + extended.lbaSize;
+
+			set<uint64_t> visited;
+			uint64_t ebrLbaStart = extLbaStart;
+
+			for (unsigned number = 5; number != 5 + kMaxLogicalPartitions; ++number) {
+				if (!visited.insert(ebrLbaStart).second) {
+					// The EBR chain loops back; stop here
+					break;
+				}
+
+				char sector[512];
+				MBR ebr;
+
+				if (!dev.read(ebrLbaStart * blockSize, sector, sizeof(sector))
+						|| !ebr.read(sector)) {
+					break;
+				}
+
+				const MBR::Partition& entry = ebr.partitions[0];
+				const MBR::Partition& next = ebr.partitions[1];
+
+				if (entry.type) {
+					table.add(Partition{ number, entry.type,
+							ebrLbaStart + entry.lbaStart, entry.lbaSize });
+				}
+
+				if (!next.type || !next.lbaStart) break;
+
+				ebrLbaStart = extLbaStart + next.lbaStart;
+
+				// The next EBR must be inside the extended partition,
+				// unless its size is unknown.
+				if (extended.lbaSize && ebrLbaStart >= extLbaEnd) break;
+			}
+		}
+
+		string getIdentity(const BlockDevice& dev, const char* sector, const string& serial,
+				size_t blockSize)
+		{
+			uint64_t size = dev.size();
+			string id(serial);
+			util::replaceAll(id, ' ', '_');
+
+			ostringstream ostr;
+			ostr << id << "/" << size << "/" << blockSize
+				<< "/" << hex << util::StringRef::Hash()(util::StringRef(sector, 512));
+			return ostr.str();
+		}
+
+		PartitionTable::Ptr readPartitionTable(const string& device,
+				const string& serial, size_t blockSize, Cache& cache)
+		{
+			BlockDevice::Ptr dev(BlockDevice::open(device));
+			if (!dev) return nullptr;
+
+			char sector[512];
+			MBR mbr;
+
+			if (!dev->read(0, sector, sizeof(sector)) || !mbr.read(sector)) {
+				return nullptr;
+			}
+
+			string identity;
+
+			// Only disks with a serial can be recognized by other processes
+			if (!cache.dir.empty() && !serial.empty()) {
+				identity = getIdentity(*dev, sector, serial, blockSize);
+
+				lock_guard<mutex> guard(cache.lock);
+				PartitionTable::Ptr table(cache.find(identity));
+				if (table) return table;
+			}
+
+			shared_ptr<PartitionTable> table(make_shared<PartitionTable>());
+			table->mbrId = mbr.id;
+
+			for (unsigned i = 0; i != 4; ++i) {
+				const MBR::Partition& entry = mbr.partitions[i];
+				if (!entry.type) continue;
+
+				table->add(Partition{ i + 1, entry.type, entry.lbaStart,
+						entry.lbaSize });
+			}
+
+			for (unsigned i = 0; i != 4; ++i) {
+				if (MBR::isExtended(mbr.partitions[i])) {
+					readLogicalPartitions(*dev, blockSize, mbr.partitions[i], *table);
+					break;
+				}
+			}
+
+			if (!identity.empty()) {
+				lock_guard<mutex> guard(cache.lock);
+				cache.save(identity, table);
+			}
+
+			return table;
+		}
+	}
+
+	const string PartitionTable::kDefaultCacheDir("/var/cache/letterman");
+
+	void PartitionTable::add(const Partition& partition)
+	{
+		partitions.push_back(partition);
+
+		// If two partitions start at the same block, the first one wins
+		if (!MBR::isExtended(partition.type)) {
+			numbers.insert(make_pair(partition.lbaStart, partition.number));
+		}
+	}
+
+	unsigned PartitionTable::find(uint64_t lbaStart) const
+	{
+		auto iter = numbers.find(lbaStart);
+		return iter != numbers.end() ? iter->second : 0;
+	}
+
+	PartitionTable::Ptr PartitionTable::get(const string& device,
+			const string& serial, size_t blockSize)
+	{
+		Cache& cache = Cache::instance();
+
+		{
+			lock_guard<mutex> guard(cache.lock);
+			auto iter = cache.byDevice.find(device);
+			if (iter != cache.byDevice.end()) return iter->second;
+		}
+
+		Ptr table(readPartitionTable(device, serial, blockSize, cache));
+
+		lock_guard<mutex> guard(cache.lock);
+		cache.byDevice[device] = table;
+		return table;
+	}
+
+	void PartitionTable::invalidate(const string& device)
+	{
+		Cache& cache = Cache::instance();
+		lock_guard<mutex> guard(cache.lock);
+		cache.byDevice.erase(device);
+	}
+
+	void PartitionTable::setCacheDir(const string& dir)
+	{
+		Cache& cache = Cache::instance();
+		lock_guard<mutex> guard(cache.lock);
+		cache.dir = dir;
+	}
+}
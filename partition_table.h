@@ -0,0 +1,57 @@
+#ifndef LETTERMAN_PARTITION_TABLE_H
+#define LETTERMAN_PARTITION_TABLE_H
+#include <unordered_map>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace letterman {
+
+	// Parsed MBR partition table of a disk, including all logical
+	// partitions. Tables are cached per process by device, and can
+	// optionally be persisted across processes, keyed by the disk's
+	// identity (serial or WWN, size, and a checksum of sector 0), so
+	// EBR chains don't have to be walked again. Disks without a serial
+	// are only cached per process.
+	struct PartitionTable
+	{
+		struct Partition
+		{
+			unsigned number;
+			uint8_t type;
+			uint64_t lbaStart;
+			uint64_t lbaSize;
+		};
+
+		typedef std::shared_ptr<const PartitionTable> Ptr;
+
+		uint32_t mbrId;
+		// Primary partitions are numbered 1 to 4, logical
+		// partitions start at 5.
+		std::vector<Partition> partitions;
+		// Start block -> partition number, excluding extended partitions
+		std::unordered_map<uint64_t, unsigned> numbers;
+
+		void add(const Partition& partition);
+
+		// Returns the number of the partition starting at the
+		// given block, or 0 if there is none.
+		unsigned find(uint64_t lbaStart) const;
+
+		// Returns NULL if the device has no valid MBR. The serial is
+		// only used to identify the disk in the persistent cache.
+		static Ptr get(const std::string& device, const std::string& serial,
+				size_t blockSize);
+
+		// Drops the device from the per-process cache, e.g. after
+		// its partition table changed.
+		static void invalidate(const std::string& device);
+
+		// Enables the persistent cache. An empty directory disables it.
+		static void setCacheDir(const std::string& dir);
+
+		static const std::string kDefaultCacheDir;
+	};
+}
+#endif
@@ -0,0 +1,116 @@
+#include <cstring>
+#include <cstdio>
+#include "record_writer.h"
+#include "endian.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		const size_t kFlushSize = 64 * 1024;
+		const uint8_t kTypeInteger = 1;
+		const uint8_t kTypeString = 2;
+	}
+
+	RecordWriter::RecordWriter(ostream& os, Format format)
+	: _os(os), _format(format), _start(0), _first(true)
+	{
+		_buf.reserve(kFlushSize);
+	}
+
+	RecordWriter::~RecordWriter()
+	{
+		flush();
+	}
+
+	void RecordWriter::begin()
+	{
+		_start = _buf.size();
+		_first = true;
+
+		if (_format == FORMAT_BIN) {
+			// Length is filled in by end()
+			_buf.append(sizeof(uint32_t), '\0');
+		} else {
+			_buf += '{';
+		}
+	}
+
+	void RecordWriter::addKey(const char* key, uint8_t type)
+	{
+		if (_format == FORMAT_BIN) {
+			size_t len = strlen(key);
+			_buf += static_cast<char>(len);
+			_buf.append(key, len);
+			_buf += static_cast<char>(type);
+		} else {
+			if (!_first) _buf += ',';
+			appendJson(key);
+			_buf += ':';
+		}
+
+		_first = false;
+	}
+
+	void RecordWriter::add(const char* key, const string& value)
+	{
+		addKey(key, kTypeString);
+
+		if (_format == FORMAT_BIN) {
+			uint32_t len = htole32(value.size());
+			_buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+			_buf += value;
+		} else {
+			appendJson(value);
+		}
+	}
+
+	void RecordWriter::add(const char* key, uint64_t value)
+	{
+		addKey(key, kTypeInteger);
+
+		if (_format == FORMAT_BIN) {
+			value = htole64(value);
+			_buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+		} else {
+			_buf += to_string(value);
+		}
+	}
+
+	void RecordWriter::end()
+	{
+		if (_format == FORMAT_BIN) {
+			uint32_t len = htole32(_buf.size() - _start - sizeof(len));
+			memcpy(&_buf[_start], &len, sizeof(len));
+		} else {
+			_buf += "}\n";
+		}
+
+		if (_buf.size() >= kFlushSize) flush();
+	}
+
+	void RecordWriter::flush()
+	{
+		_os.write(_buf.data(), _buf.size());
+		_buf.clear();
+	}
+
+	void RecordWriter::appendJson(const string& str)
+	{
+		_buf += '"';
+
+		for (char c : str) {
+			if (c == '"' || c == '\\') {
+				_buf += '\\';
+				_buf += c;
+			} else if (static_cast<unsigned char>(c) < 0x20) {
+				char esc[7];
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				_buf += esc;
+			} else {
+				_buf += c;
+			}
+		}
+
+		_buf += '"';
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef LETTERMAN_RECORD_WRITER_H
+#define LETTERMAN_RECORD_WRITER_H
+#include <stdint.h>
+#include <iostream>
+#include <string>
+
+namespace letterman {
+	// Writes machine-readable records with typed fields, either as one
+	// JSON object per line (NDJSON), or in a compact binary form:
+	//
+	//   record := u32 length, field*           (length of the fields)
+	//   field  := u8 keylen, key, u8 type, value
+	//   value  := u64                          (type 1)
+	//           | u32 length, bytes            (type 2, string)
+	//
+	// All integers are little-endian. Records are buffered, and written
+	// to the stream in large chunks rather than line by line.
+	class RecordWriter
+	{
+		public:
+		enum Format
+		{
+			FORMAT_TEXT,
+			FORMAT_NDJSON,
+			FORMAT_BIN
+		};
+
+		RecordWriter(std::ostream& os, Format format);
+		~RecordWriter();
+
+		RecordWriter(const RecordWriter&) = delete;
+		RecordWriter& operator=(const RecordWriter&) = delete;
+
+		void begin();
+		void add(const char* key, const std::string& value);
+		void add(const char* key, uint64_t value);
+		void end();
+
+		// Writes the buffered records to the stream; call between records
+		void flush();
+
+		private:
+		void addKey(const char* key, uint8_t type);
+		void appendJson(const std::string& str);
+
+		std::ostream& _os;
+		Format _format;
+		std::string _buf;
+		size_t _start;
+		bool _first;
+	};
+}
+#endif
@@ -0,0 +1,1002 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <algorithm>
+#include <unistd.h>
+#include <cstring>
+#include <fcntl.h>
+#include <ctime>
+#include "exception.h"
+#include "endian.h"
+#include "regf.h"
+using namespace std;
+
+namespace letterman {
+	namespace {
+		// The base block is followed by the hive bins, which all cell
+		// offsets are relative to.
+		const size_t kBinsOffset = 0x1000;
+		const uint32_t kNoCell = 0xffffffff;
+
+		// Hive bins are multiples of this, and so is the file
+		const size_t kPageSize = 0x1000;
+		const size_t kBinHeaderSize = 0x20;
+		const size_t kBinOffset = 0x04;
+		const size_t kBinSize = 0x08;
+
+		// Address space reserved behind a writable hive for new bins
+		const size_t kMaxGrowth = 64 * 1024 * 1024;
+
+		// Base block
+		const size_t kRegfSequence1 = 0x04;
+		const size_t kRegfSequence2 = 0x08;
+		const size_t kRegfTimestamp = 0x0c;
+		const size_t kRegfMajor = 0x14;
+		const size_t kRegfMinor = 0x18;
+		const size_t kRegfRoot = 0x24;
+		const size_t kRegfBinsSize = 0x28;
+		const size_t kRegfChecksum = 0x1fc;
+
+		// Key node ("nk")
+		const size_t kNkFlags = 0x02;
+		const size_t kNkSubkeyCount = 0x14;
+		const size_t kNkSubkeyList = 0x1c;
+		const size_t kNkValueCount = 0x24;
+		const size_t kNkValueList = 0x28;
+		const size_t kNkMaxValueName = 0x3c;
+		const size_t kNkMaxValueData = 0x40;
+		const size_t kNkNameLength = 0x48;
+		const size_t kNkName = 0x4c;
+		const uint16_t kNkCompressedName = 0x20;
+
+		// Value ("vk")
+		const size_t kVkNameLength = 0x02;
+		const size_t kVkDataSize = 0x04;
+		const size_t kVkDataOffset = 0x08;
+		const size_t kVkType = 0x0c;
+		const size_t kVkFlags = 0x10;
+		const size_t kVkName = 0x14;
+		const uint16_t kVkCompressedName = 0x01;
+		const uint32_t kVkResidentData = 0x80000000;
+
+		// Transaction log (new format). Its base block is followed by
+		// entries, each holding a number of dirty pages.
+		const size_t kLogBaseBlockSize = 0x200;
+		const size_t kLogEntryAlign = 0x200;
+		const uint32_t kLogFileType = 6;
+		const size_t kRegfFileType = 0x1c;
+		const size_t kRegfFlags = 0x90;
+
+		const size_t kEntrySize = 0x04;
+		const size_t kEntryFlags = 0x08;
+		const size_t kEntrySequence = 0x0c;
+		const size_t kEntryBinsSize = 0x10;
+		const size_t kEntryPageCount = 0x14;
+		const size_t kEntryHash1 = 0x18;
+		const size_t kEntryHash2 = 0x20;
+		const size_t kEntryPages = 0x28;
+		const size_t kEntryHash2Size = 0x20;
+
+		// Once the log is larger, the hive is synced and marked clean
+		const uint64_t kMaxLogSize = 1024 * 1024;
+
+		const uint64_t kMarvinSeed = UINT64_C(0x82ef4d887a4e55c5);
+
+		// Larger values are split into segments ("db") in hives
+		// of version 1.4 and later.
+		const uint32_t kMaxCellData = 16344;
+
+		// An ri list may only refer to other kinds of lists
+		const unsigned kMaxListDepth = 1;
+
+		uint16_t get16(const uint8_t* p)
+		{
+			uint16_t v;
+			memcpy(&v, p, sizeof(v));
+			return le16toh(v);
+		}
+
+		uint32_t get32(const uint8_t* p)
+		{
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			return le32toh(v);
+		}
+
+		void set32(uint8_t* p, uint32_t v)
+		{
+			v = htole32(v);
+			memcpy(p, &v, sizeof(v));
+		}
+
+		uint32_t checksum(const uint8_t* base)
+		{
+			uint32_t sum = 0;
+			for (size_t i = 0; i != kRegfChecksum; i += 4) {
+				sum ^= get32(base + i);
+			}
+
+			if (sum == 0) return 1;
+			if (sum == 0xffffffff) return 0xfffffffe;
+			return sum;
+		}
+
+		uint64_t get64(const uint8_t* p)
+		{
+			uint64_t v;
+			memcpy(&v, p, sizeof(v));
+			return le64toh(v);
+		}
+
+		void set64(uint8_t* p, uint64_t v)
+		{
+			v = htole64(v);
+			memcpy(p, &v, sizeof(v));
+		}
+
+		uint32_t rotl(uint32_t x, int n)
+		{
+			return x << n | x >> (32 - n);
+		}
+
+		// Marvin32, which protects transaction log entries. Returns both
+		// halves of the final state.
+		uint64_t marvin32(const uint8_t* p, size_t len)
+		{
+			uint32_t lo = static_cast<uint32_t>(kMarvinSeed);
+			uint32_t hi = kMarvinSeed >> 32;
+
+			auto block = [&lo, &hi] () {
+				hi ^= lo; lo = rotl(lo, 20);
+				lo += hi; hi = rotl(hi, 9);
+				hi ^= lo; lo = rotl(lo, 27);
+				lo += hi; hi = rotl(hi, 19);
+			};
+
+			for (; len >= 4; p += 4, len -= 4) {
+				lo += get32(p);
+				block();
+			}
+
+			uint32_t last = 0x80;
+			if (len == 1) last = 0x8000 | p[0];
+			else if (len == 2) last = 0x800000 | get16(p);
+			else if (len == 3) last = 0x80000000 | p[2] << 16 | get16(p);
+
+			lo += last;
+			block();
+			block();
+
+			return uint64_t(hi) << 32 | lo;
+		}
+
+		size_t roundUp(size_t n, size_t multiple)
+		{
+			return (n + multiple - 1) / multiple * multiple;
+		}
+
+		bool isSignature(const uint8_t* p, const char* sig)
+		{
+			return p[0] == sig[0] && p[1] == sig[1];
+		}
+
+		char upper(char c)
+		{
+			return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+		}
+
+		// Hash used in "lh" lists
+		uint32_t hashName(const string& name)
+		{
+			uint32_t hash = 0;
+			for (char c : name) {
+				hash = hash * 37 + static_cast<uint8_t>(upper(c));
+			}
+
+			return hash;
+		}
+
+		// "lf" lists store the first four characters of each name
+		bool isHintMatching(const uint8_t* hint, const string& name)
+		{
+			for (size_t i = 0; i != 4; ++i) {
+				if (hint[i] & 0x80) return true;
+				char c = i < name.size() ? name[i] : 0;
+				if (upper(hint[i]) != upper(c)) return false;
+			}
+
+			return true;
+		}
+
+		bool isNameEqual(const uint8_t* p, size_t len, bool compressed,
+				const string& name)
+		{
+			if (compressed) {
+				if (len != name.size()) return false;
+				for (size_t i = 0; i != len; ++i) {
+					if (upper(p[i]) != upper(name[i])) return false;
+				}
+			} else {
+				if (len != name.size() * 2) return false;
+				for (size_t i = 0; i != name.size(); ++i) {
+					if (p[i * 2 + 1] || upper(p[i * 2]) != upper(name[i])) {
+						return false;
+					}
+				}
+			}
+
+			return true;
+		}
+
+		// Assigns rather than returns the name, to reuse its buffer
+		void getName(const uint8_t* p, size_t len, bool compressed,
+				string& name)
+		{
+			if (compressed) {
+				name.assign(reinterpret_cast<const char*>(p), len);
+				return;
+			}
+
+			name.clear();
+			for (size_t i = 0; i + 1 < len; i += 2) {
+				name += (p[i + 1] || p[i] & 0x80) ? '?' : char(p[i]);
+			}
+		}
+	}
+
+	Regf::Regf(const string& filename, bool writable)
+	: _filename(filename), _fd(-1), _writable(writable), _data(nullptr),
+	  _size(0), _mapped(0), _reserved(0), _logEnd(0), _logSequence(0)
+	{
+		_fd = open(filename.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+		if (_fd < 0) throw ErrnoException("open: " + filename);
+
+		try {
+			struct stat st;
+			if (fstat(_fd, &st) != 0) throw ErrnoException("fstat: " + filename);
+			if (size_t(st.st_size) < kBinsOffset) corrupt();
+
+			_size = st.st_size;
+			void* addr;
+
+			// Differing sequence numbers mean that the last write was
+			// interrupted, and the hive has to be recovered from its logs.
+			// Read-only hives are then recovered into a private copy.
+			uint8_t header[kRegfSequence2 + 4];
+			if (!util::preadAll(_fd, 0, header, sizeof(header))) {
+				throw ErrnoException("read: " + filename);
+			}
+
+			bool dirty = get32(header + kRegfSequence1)
+				!= get32(header + kRegfSequence2);
+
+			if (writable || dirty) {
+				// Reserve address space for new bins behind the file, so
+				// the mapping never has to move.
+				_mapped = roundUp(_size, sysconf(_SC_PAGESIZE));
+				_reserved = _mapped + kMaxGrowth;
+
+				addr = mmap(NULL, _reserved, PROT_NONE, MAP_PRIVATE | MAP_ANON,
+						-1, 0);
+				if (addr == MAP_FAILED) throw ErrnoException("mmap");
+				_data = static_cast<uint8_t*>(addr);
+
+				if (mmap(addr, _size, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_FIXED, _fd, 0) == MAP_FAILED) {
+					throw ErrnoException("mmap: " + filename);
+				}
+			} else {
+				_mapped = _reserved = _size;
+				addr = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+				if (addr == MAP_FAILED) throw ErrnoException("mmap: " + filename);
+				_data = static_cast<uint8_t*>(addr);
+			}
+
+			if (memcmp(_data, "regf", 4) || get32(_data + kRegfMajor) != 1
+					|| get32(_data + kRegfChecksum) != checksum(_data)) {
+				corrupt();
+			}
+
+			_minor = get32(_data + kRegfMinor);
+			_end = kBinsOffset + get32(_data + kRegfBinsSize);
+
+			if (dirty) {
+				if (!replayLog(filename + ".LOG1") && !replayLog(filename + ".LOG2")) {
+					throw runtime_error("Hive was not written completely, and "
+							"can't be recovered from its logs: " + filename);
+				}
+			}
+
+			// Recovered bins may extend beyond the end of the file
+			if (_end == kBinsOffset || _end > (_logged.empty() ? _size : _mapped)
+					|| (_end - kBinsOffset) % kPageSize
+					|| memcmp(_data + kBinsOffset, "hbin", 4)) {
+				corrupt();
+			}
+
+			_root = get32(_data + kRegfRoot);
+			key(_root);
+		} catch (...) {
+			if (_data) munmap(_data, _reserved);
+			close(_fd);
+			throw;
+		}
+	}
+
+	Regf::~Regf()
+	{
+		munmap(_data, _reserved);
+		close(_fd);
+	}
+
+	void Regf::corrupt() const
+	{
+		throw runtime_error("Not a valid registry hive: " + _filename);
+	}
+
+	const uint8_t* Regf::cell(uint32_t offset, size_t size) const
+	{
+		size_t pos = kBinsOffset + offset;
+		if (offset == kNoCell || pos + 4 > _end) corrupt();
+
+		// Allocated cells have a negative size, which includes itself
+		int32_t cellSize = get32(_data + pos);
+		if (cellSize >= 0 || size + 4 > size_t(-int64_t(cellSize))
+				|| size_t(-int64_t(cellSize)) > _end - pos) {
+			corrupt();
+		}
+
+		return _data + pos + 4;
+	}
+
+	const uint8_t* Regf::key(Key key, size_t size) const
+	{
+		const uint8_t* nk = cell(key, max(size, kNkName));
+		if (!isSignature(nk, "nk")) corrupt();
+		return nk;
+	}
+
+	const uint8_t* Regf::vk(uint32_t offset) const
+	{
+		const uint8_t* vk = cell(offset, kVkName);
+		if (!isSignature(vk, "vk")) corrupt();
+		return cell(offset, kVkName + get16(vk + kVkNameLength));
+	}
+
+	bool Regf::isNamed(Key key, const string& name) const
+	{
+		const uint8_t* nk = this->key(key);
+		size_t len = get16(nk + kNkNameLength);
+		nk = this->key(key, kNkName + len);
+
+		return isNameEqual(nk + kNkName, len,
+				get16(nk + kNkFlags) & kNkCompressedName, name);
+	}
+
+	Regf::Key Regf::find(uint32_t list, const string& name, uint32_t hash,
+			unsigned depth) const
+	{
+		const uint8_t* p = cell(list, 4);
+		size_t count = get16(p + 2);
+
+		if (isSignature(p, "ri") || isSignature(p, "li")) {
+			bool isIndex = isSignature(p, "ri");
+			if (isIndex && depth == kMaxListDepth) corrupt();
+
+			p = cell(list, 4 + count * 4);
+			for (size_t i = 0; i != count; ++i) {
+				uint32_t offset = get32(p + 4 + i * 4);
+				Key key = isIndex ? find(offset, name, hash, depth + 1)
+					: isNamed(offset, name) ? offset : 0;
+				if (key) return key;
+			}
+		} else if (isSignature(p, "lf") || isSignature(p, "lh")) {
+			bool isHash = isSignature(p, "lh");
+
+			p = cell(list, 4 + count * 8);
+			for (size_t i = 0; i != count; ++i) {
+				const uint8_t* entry = p + 4 + i * 8;
+				uint32_t offset = get32(entry);
+
+				// Only look at the key if its hint matches
+				if (isHash ? get32(entry + 4) != hash
+						: !isHintMatching(entry + 4, name)) {
+					continue;
+				}
+
+				if (isNamed(offset, name)) return offset;
+			}
+		} else {
+			corrupt();
+		}
+
+		return 0;
+	}
+
+	Regf::Key Regf::child(Key parent, const string& name) const
+	{
+		const uint8_t* nk = key(parent);
+		if (!get32(nk + kNkSubkeyCount)) return 0;
+
+		return find(get32(nk + kNkSubkeyList), name, hashName(name), 0);
+	}
+
+	void Regf::read(uint32_t offset, Value& value) const
+	{
+		const uint8_t* p = vk(offset);
+		uint16_t flags = get16(p + kVkFlags);
+		uint32_t size = get32(p + kVkDataSize);
+
+		getName(p + kVkName, get16(p + kVkNameLength),
+				flags & kVkCompressedName, value.name);
+		value.type = get32(p + kVkType);
+
+		if (size & kVkResidentData) {
+			// Up to four bytes are stored in place of the data offset
+			size &= ~kVkResidentData;
+			if (size > 4) corrupt();
+			value.data = util::StringRef(
+					reinterpret_cast<const char*>(p + kVkDataOffset), size);
+		} else if (!size) {
+			value.data = util::StringRef();
+		} else if (size > kMaxCellData && _minor >= 4) {
+			throw runtime_error("Value " + value.name + " is too large: "
+					+ _filename);
+		} else {
+			value.data = util::StringRef(reinterpret_cast<const char*>(
+						cell(get32(p + kVkDataOffset), size)), size);
+		}
+	}
+
+	void Regf::forEachValue(Key key,
+			const function<void(const Value& value)>& f) const
+	{
+		const uint8_t* nk = this->key(key);
+		size_t count = get32(nk + kNkValueCount);
+
+		if (!count) return;
+		if (count > (_end - kBinsOffset) / 4) corrupt();
+
+		const uint8_t* list = cell(get32(nk + kNkValueList), count * 4);
+		Value value;
+
+		for (size_t i = 0; i != count; ++i) {
+			read(get32(list + i * 4), value);
+			f(value);
+		}
+	}
+
+	uint32_t Regf::findValue(Key key, const string& name) const
+	{
+		const uint8_t* nk = this->key(key);
+		size_t count = get32(nk + kNkValueCount);
+
+		if (!count) return 0;
+		if (count > (_end - kBinsOffset) / 4) corrupt();
+
+		const uint8_t* list = cell(get32(nk + kNkValueList), count * 4);
+
+		for (size_t i = 0; i != count; ++i) {
+			uint32_t offset = get32(list + i * 4);
+			const uint8_t* p = vk(offset);
+
+			if (isNameEqual(p + kVkName, get16(p + kVkNameLength),
+						get16(p + kVkFlags) & kVkCompressedName, name)) {
+				return offset;
+			}
+		}
+
+		return 0;
+	}
+
+	bool Regf::value(Key key, const string& name, Value& value) const
+	{
+		uint32_t offset = findValue(key, name);
+		if (!offset) return false;
+
+		read(offset, value);
+		return true;
+	}
+
+	size_t Regf::capacity(uint32_t offset) const
+	{
+		cell(offset, 0);
+		return size_t(-int64_t(int32_t(get32(_data + kBinsOffset + offset)))) - 4;
+	}
+
+	uint8_t* Regf::modify(size_t pos, size_t len)
+	{
+		for (size_t page = pos / kPageSize; page * kPageSize < pos + len; ++page) {
+			_dirty.insert(page);
+			_logged.erase(page);
+		}
+
+		return _data + pos;
+	}
+
+	void Regf::put32(size_t pos, uint32_t value)
+	{
+		set32(modify(pos, 4), value);
+	}
+
+	Regf::FreeCells& Regf::freeCells()
+	{
+		if (_free) return *_free;
+
+		unique_ptr<FreeCells> cells(new FreeCells);
+
+		for (size_t pos = kBinsOffset; pos < _end; ) {
+			size_t binSize = get32(_data + pos + kBinSize);
+			if (memcmp(_data + pos, "hbin", 4) || binSize < kBinHeaderSize
+					|| binSize % kPageSize || binSize > _end - pos) {
+				corrupt();
+			}
+
+			size_t binEnd = pos + binSize;
+
+			for (size_t p = pos + kBinHeaderSize; p < binEnd; ) {
+				int32_t size = get32(_data + p);
+				size_t len = size < 0 ? -int64_t(size) : size;
+				if (len < 8 || len % 8 || len > binEnd - p) corrupt();
+
+				if (size > 0) cells->emplace_back(p - kBinsOffset, len);
+				p += len;
+			}
+
+			pos = binEnd;
+		}
+
+		_free = move(cells);
+		return *_free;
+	}
+
+	void Regf::grow(size_t end)
+	{
+		if (end > _reserved) {
+			throw runtime_error("Hive can't grow any further: " + _filename);
+		}
+
+		if (end > _mapped) {
+			size_t len = roundUp(end - _mapped, sysconf(_SC_PAGESIZE));
+			if (mmap(_data + _mapped, len, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED) {
+				throw ErrnoException("mmap");
+			}
+
+			_mapped += len;
+		}
+	}
+
+	void Regf::addBin(size_t size)
+	{
+		size_t binSize = roundUp(size + kBinHeaderSize, kPageSize);
+		size_t end = _end + binSize;
+
+		// Make sure free cells are found before the new bin exists
+		FreeCells& cells = freeCells();
+		grow(end);
+
+		uint8_t* bin = modify(_end, binSize);
+		memset(bin, 0, binSize);
+		memcpy(bin, "hbin", 4);
+		set32(bin + kBinOffset, _end - kBinsOffset);
+		set32(bin + kBinSize, binSize);
+
+		// The rest of the bin is a single free cell
+		set32(bin + kBinHeaderSize, binSize - kBinHeaderSize);
+		cells.emplace_back(_end + kBinHeaderSize - kBinsOffset,
+				binSize - kBinHeaderSize);
+
+		_end = end;
+	}
+
+	uint32_t Regf::allocate(size_t size)
+	{
+		size_t need = roundUp(size + 4, 8);
+		FreeCells& cells = freeCells();
+
+		auto iter = find_if(cells.begin(), cells.end(),
+				[need] (const FreeCells::value_type& c) { return c.second >= need; });
+
+		if (iter == cells.end()) {
+			addBin(need);
+			iter = cells.end() - 1;
+		}
+
+		uint32_t offset = iter->first;
+
+		// Split the cell if the rest is large enough for another one
+		if (iter->second - need >= 8) {
+			iter->first += need;
+			iter->second -= need;
+			put32(kBinsOffset + iter->first, iter->second);
+		} else {
+			need = iter->second;
+			cells.erase(iter);
+		}
+
+		put32(kBinsOffset + offset, -int32_t(need));
+		memset(modify(kBinsOffset + offset + 4, need - 4), 0, need - 4);
+
+		return offset;
+	}
+
+	void Regf::deallocate(uint32_t offset)
+	{
+		cell(offset, 0);
+		FreeCells& cells = freeCells();
+
+		size_t pos = kBinsOffset + offset;
+		uint32_t len = -int32_t(get32(_data + pos));
+
+		put32(pos, len);
+		cells.emplace_back(offset, len);
+	}
+
+	uint32_t Regf::addValue(Key key, const string& name)
+	{
+		uint32_t offset = allocate(kVkName + name.size());
+		size_t pos = kBinsOffset + offset + 4;
+
+		uint8_t* p = modify(pos, kVkName + name.size());
+		memcpy(p, "vk", 2);
+		p[kVkNameLength] = name.size() & 0xff;
+		p[kVkNameLength + 1] = name.size() >> 8;
+		set32(p + kVkDataSize, kVkResidentData);
+		p[kVkFlags] = kVkCompressedName;
+		memcpy(p + kVkName, name.data(), name.size());
+
+		// Append it to the key's value list, which is moved to a new
+		// cell if it's full
+		size_t nkPos = kBinsOffset + key + 4;
+		const uint8_t* nk = this->key(key);
+		size_t count = get32(nk + kNkValueCount);
+		uint32_t list = get32(nk + kNkValueList);
+		size_t needed = (count + 1) * 4;
+
+		if (!count || capacity(list) < needed) {
+			uint32_t newList = allocate(needed);
+			if (count) {
+				memcpy(modify(kBinsOffset + newList + 4, count * 4),
+						cell(list, count * 4), count * 4);
+				deallocate(list);
+			}
+
+			put32(nkPos + kNkValueList, list = newList);
+		}
+
+		put32(kBinsOffset + list + 4 + count * 4, offset);
+		put32(nkPos + kNkValueCount, count + 1);
+
+		if (get32(nk + kNkMaxValueName) < name.size() * 2) {
+			put32(nkPos + kNkMaxValueName, name.size() * 2);
+		}
+
+		return offset;
+	}
+
+	void Regf::setValue(Key key, const string& name, uint32_t type,
+			util::StringRef data)
+	{
+		if (!_writable) throw runtime_error("Hive is read-only: " + _filename);
+		if (data.size() > kMaxCellData) {
+			throw runtime_error("Value " + name + " is too large: " + _filename);
+		}
+
+		if (name.size() > 0xffff) throw runtime_error("Invalid value name");
+
+		uint32_t offset = findValue(key, name);
+		if (!offset) offset = addValue(key, name);
+
+		size_t pos = kBinsOffset + offset + 4;
+		const uint8_t* p = vk(offset);
+		uint32_t oldSize = get32(p + kVkDataSize);
+		uint32_t oldData = get32(p + kVkDataOffset);
+		bool hadCell = oldSize && !(oldSize & kVkResidentData);
+
+		if (data.size() <= 4) {
+			uint8_t* resident = modify(pos + kVkDataOffset, 4);
+			memset(resident, 0, 4);
+			memcpy(resident, data.data(), data.size());
+			put32(pos + kVkDataSize, data.size() | kVkResidentData);
+
+			if (hadCell) deallocate(oldData);
+		} else {
+			// Reuse the old cell if the data fits
+			uint32_t dataCell = oldData;
+			if (!hadCell || capacity(oldData) < data.size()) {
+				dataCell = allocate(data.size());
+				if (hadCell) deallocate(oldData);
+			}
+
+			memcpy(modify(kBinsOffset + dataCell + 4, data.size()),
+					data.data(), data.size());
+			put32(pos + kVkDataOffset, dataCell);
+			put32(pos + kVkDataSize, data.size());
+		}
+
+		put32(pos + kVkType, type);
+
+		size_t nkPos = kBinsOffset + key + 4;
+		if (get32(this->key(key) + kNkMaxValueData) < data.size()) {
+			put32(nkPos + kNkMaxValueData, data.size());
+		}
+	}
+
+	void Regf::writeBaseBlock(bool sync)
+	{
+		set32(_data + kRegfChecksum, checksum(_data));
+
+		if (!util::pwriteAll(_fd, 0, _data, kBinsOffset)
+				|| (sync && fsync(_fd) != 0)) {
+			throw ErrnoException("write: " + _filename);
+		}
+	}
+
+	void Regf::writePages()
+	{
+		// Write runs of consecutive pages at once
+		for (auto iter = _dirty.begin(); iter != _dirty.end(); ) {
+			size_t first = *iter, last = first;
+			while (++iter != _dirty.end() && *iter == last + 1) {
+				last = *iter;
+			}
+
+			size_t pos = first * kPageSize;
+			if (!util::pwriteAll(_fd, pos, _data + pos,
+						(last - first + 1) * kPageSize)) {
+				throw ErrnoException("write: " + _filename);
+			}
+		}
+
+		_dirty.clear();
+		_size = max(_size, _end);
+	}
+
+	bool Regf::replayLog(const string& filename)
+	{
+		int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return false;
+		auto cleaner(util::createCleaner([fd] () { close(fd); }));
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || size_t(st.st_size) < kLogBaseBlockSize) {
+			return false;
+		}
+
+		vector<uint8_t> log(st.st_size);
+		if (!util::preadAll(fd, 0, log.data(), log.size())) return false;
+
+		// The log must have been started when the hive was last clean
+		const uint8_t* base = log.data();
+		if (memcmp(base, "regf", 4) || get32(base + kRegfChecksum) != checksum(base)
+				|| get32(base + kRegfFileType) != kLogFileType
+				|| get32(base + kRegfSequence2) != get32(_data + kRegfSequence2)) {
+			return false;
+		}
+
+		uint32_t sequence = get32(base + kRegfSequence1);
+		size_t pos = kLogBaseBlockSize;
+
+		// Apply entries until one is invalid, which is where a write
+		// was interrupted.
+		while (pos + kEntryPages <= log.size()) {
+			const uint8_t* entry = log.data() + pos;
+			size_t size = get32(entry + kEntrySize);
+			size_t count = get32(entry + kEntryPageCount);
+			size_t binsSize = get32(entry + kEntryBinsSize);
+
+			if (memcmp(entry, "HvLE", 4) || size % kLogEntryAlign
+					|| size > log.size() - pos || size < kEntryPages
+					|| count > (size - kEntryPages) / 8
+					|| get32(entry + kEntrySequence) != sequence
+					|| binsSize % kPageSize || binsSize > _reserved - kBinsOffset
+					|| get64(entry + kEntryHash1) != marvin32(
+						entry + kEntryPages, size - kEntryPages)
+					|| get64(entry + kEntryHash2) != marvin32(
+						entry, kEntryHash2Size)) {
+				break;
+			}
+
+			// Check all pages before applying any
+			size_t data = kEntryPages + count * 8;
+			for (size_t i = 0; i != count && data <= size; ++i) {
+				uint32_t offset = get32(entry + kEntryPages + i * 8);
+				uint32_t len = get32(entry + kEntryPages + i * 8 + 4);
+				if (offset % kPageSize || len % kPageSize
+						|| uint64_t(offset) + len > binsSize) {
+					data = size + 1;
+				}
+
+				data += len;
+			}
+
+			if (data > size) break;
+
+			grow(kBinsOffset + binsSize);
+			data = kEntryPages + count * 8;
+
+			for (size_t i = 0; i != count; ++i) {
+				size_t offset = kBinsOffset + get32(entry + kEntryPages + i * 8);
+				size_t len = get32(entry + kEntryPages + i * 8 + 4);
+
+				memcpy(_data + offset, entry + data, len);
+				for (size_t page = offset / kPageSize;
+						page != (offset + len) / kPageSize; ++page) {
+					_dirty.insert(page);
+					_logged.insert(page);
+				}
+
+				data += len;
+			}
+
+			_end = kBinsOffset + binsSize;
+			pos += size;
+			++sequence;
+		}
+
+		if (pos == kLogBaseBlockSize) return false;
+
+		set32(_data + kRegfBinsSize, _end - kBinsOffset);
+		_log = filename;
+		_logEnd = pos;
+		_logSequence = sequence;
+
+		return true;
+	}
+
+	void Regf::appendLog()
+	{
+		// Pages that aren't in the log yet, as runs of consecutive pages
+		vector<pair<size_t, size_t>> runs;
+		size_t pagesSize = 0;
+
+		for (size_t page : _dirty) {
+			if (_logged.count(page)) continue;
+
+			if (!runs.empty() && runs.back().first + runs.back().second == page) {
+				++runs.back().second;
+			} else {
+				runs.emplace_back(page, 1);
+			}
+
+			pagesSize += kPageSize;
+		}
+
+		// Everything was logged already (e.g. after a replay)
+		if (runs.empty()) {
+			writePages();
+			return;
+		}
+
+		bool isNew = _log.empty();
+		uint32_t secondary = get32(_data + kRegfSequence2);
+
+		if (isNew) {
+			// Use the log that was written longest ago
+			string logs[] = { _filename + ".LOG1", _filename + ".LOG2" };
+			uint32_t sequences[2] = { 0, 0 };
+
+			for (int i = 0; i != 2; ++i) {
+				int fd = open(logs[i].c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd < 0) continue;
+
+				uint8_t base[kLogBaseBlockSize];
+				if (util::preadAll(fd, 0, base, sizeof(base))
+						&& !memcmp(base, "regf", 4)) {
+					sequences[i] = get32(base + kRegfSequence1);
+				}
+
+				close(fd);
+			}
+
+			_log = logs[sequences[1] < sequences[0]];
+			_logEnd = kLogBaseBlockSize;
+			_logSequence = secondary;
+		}
+
+		vector<uint8_t> entry(roundUp(kEntryPages + runs.size() * 8 + pagesSize,
+					kLogEntryAlign));
+		uint8_t* p = entry.data();
+
+		memcpy(p, "HvLE", 4);
+		set32(p + kEntrySize, entry.size());
+		set32(p + kEntryFlags, get32(_data + kRegfFlags));
+		set32(p + kEntrySequence, _logSequence);
+		set32(p + kEntryBinsSize, _end - kBinsOffset);
+		set32(p + kEntryPageCount, runs.size());
+
+		size_t data = kEntryPages + runs.size() * 8;
+		for (size_t i = 0; i != runs.size(); ++i) {
+			size_t pos = runs[i].first * kPageSize;
+			size_t len = runs[i].second * kPageSize;
+
+			set32(p + kEntryPages + i * 8, pos - kBinsOffset);
+			set32(p + kEntryPages + i * 8 + 4, len);
+			memcpy(p + data, _data + pos, len);
+			data += len;
+		}
+
+		set64(p + kEntryHash1, marvin32(p + kEntryPages, entry.size() - kEntryPages));
+		set64(p + kEntryHash2, marvin32(p, kEntryHash2Size));
+
+		int fd = open(_log.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) throw ErrnoException("open: " + _log);
+		auto cleaner(util::createCleaner([fd] () { close(fd); }));
+
+		if (isNew) {
+			// A copy of the hive's base block as of its last clean state
+			uint8_t base[kLogBaseBlockSize];
+			memcpy(base, _data, sizeof(base));
+			set32(base + kRegfSequence1, secondary);
+			set32(base + kRegfSequence2, secondary);
+			set32(base + kRegfFileType, kLogFileType);
+			set32(base + kRegfChecksum, checksum(base));
+
+			if (!util::pwriteAll(fd, 0, base, sizeof(base))) {
+				throw ErrnoException("write: " + _log);
+			}
+		}
+
+		// Truncate, so no older entries follow this one
+		if (!util::pwriteAll(fd, _logEnd, entry.data(), entry.size())
+				|| ftruncate(fd, _logEnd + entry.size()) != 0
+				|| fsync(fd) != 0) {
+			throw ErrnoException("write: " + _log);
+		}
+
+		_logEnd += entry.size();
+		++_logSequence;
+
+		for (auto& run : runs) {
+			for (size_t i = 0; i != run.second; ++i) {
+				_logged.insert(run.first + i);
+			}
+		}
+
+		// Mark the hive as dirty. The first time, this has to be on disk
+		// before any pages are, otherwise the log would be ignored if the
+		// pages were only partially written.
+		set32(_data + kRegfSequence1, secondary + 1);
+		set32(_data + kRegfBinsSize, _end - kBinsOffset);
+		writeBaseBlock(isNew);
+
+		writePages();
+	}
+
+	void Regf::commit(bool useLog)
+	{
+		if (useLog) {
+			if (!_dirty.empty()) appendLog();
+			if (_logEnd < kMaxLogSize) return;
+		}
+
+		if (_dirty.empty() && _log.empty()) return;
+
+		// The primary sequence number is incremented before anything
+		// else is written, the secondary one after all bins have been
+		// written, so a hive that was only partially written has
+		// differing sequence numbers.
+		uint32_t sequence = get32(_data + kRegfSequence1) + 1;
+
+		// 100ns intervals since 1601-01-01
+		uint64_t timestamp = (uint64_t(time(NULL)) + UINT64_C(11644473600))
+				* 10000000;
+
+		set32(_data + kRegfSequence1, sequence);
+		set32(_data + kRegfBinsSize, _end - kBinsOffset);
+		set64(_data + kRegfTimestamp, timestamp);
+		writeBaseBlock();
+
+		// Pages that were written along with the log are synced, too
+		writePages();
+		if (fsync(_fd) != 0) throw ErrnoException("fsync: " + _filename);
+
+		set32(_data + kRegfSequence2, sequence);
+		writeBaseBlock();
+
+		_logged.clear();
+		_log.clear();
+		_logEnd = 0;
+	}
+}
@@ -0,0 +1,126 @@
+#ifndef LETTERMAN_REGF_H
+#define LETTERMAN_REGF_H
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <set>
+#include "util.h"
+
+namespace letterman {
+	// View of a registry hive file. The file is mmap'd rather than read,
+	// and only the cells on the way to the requested keys and values are
+	// touched. Every cell is bounds-checked, a corrupt hive results in a
+	// runtime_error. The file must not be truncated while it is open.
+	//
+	// Writable hives are mapped privately; changes are made in memory,
+	// and commit() writes back only the 4 KiB pages that were modified.
+	class Regf
+	{
+		public:
+		// Offset of the key's cell, relative to the first hive bin
+		typedef uint32_t Key;
+
+		struct Value
+		{
+			// Non-ASCII characters of UTF-16 names are replaced by '?'
+			std::string name;
+			uint32_t type;
+			// Points into the mapping
+			util::StringRef data;
+		};
+
+		explicit Regf(const std::string& filename, bool writable = false);
+		~Regf();
+
+		Regf(const Regf&) = delete;
+		Regf& operator=(const Regf&) = delete;
+
+		Key root() const
+		{ return _root; }
+
+		// Names are compared case-insensitively. Returns 0 if there is
+		// no such subkey.
+		Key child(Key parent, const std::string& name) const;
+
+		// Calls f for each value of the key. The same Value is passed
+		// each time, so its name is not reallocated per value.
+		void forEachValue(Key key,
+				const std::function<void(const Value& value)>& f) const;
+
+		// Returns false if there is no such value
+		bool value(Key key, const std::string& name, Value& value) const;
+
+		// Creates or replaces a value. Cells that are no longer used are
+		// freed, new ones are taken from free cells if possible, or else
+		// from a new hive bin at the end of the file.
+		void setValue(Key key, const std::string& name, uint32_t type,
+				util::StringRef data);
+
+		// Writes all modified pages. The base block's sequence numbers
+		// are updated before and after, as Windows does, so an
+		// interrupted commit is detected.
+		//
+		// With useLog, the pages are instead appended as one entry to a
+		// transaction log (<hive>.LOG1 or .LOG2, in the format used since
+		// Windows 8.1), and only the log is synced. The hive is marked
+		// dirty, so Windows replays the log at boot, and the pages are
+		// written to it without waiting for them. Once the log has grown
+		// large enough, the hive is synced and marked clean again.
+		//
+		// Opening a dirty hive replays its log; a read-only hive is then
+		// kept as a private copy in memory, and the file isn't changed.
+		void commit(bool useLog = false);
+
+		private:
+		typedef std::vector<std::pair<uint32_t, uint32_t>> FreeCells;
+
+		const uint8_t* cell(uint32_t offset, size_t size) const;
+		const uint8_t* key(Key key, size_t size = 0) const;
+		const uint8_t* vk(uint32_t offset) const;
+		Key find(uint32_t list, const std::string& name, uint32_t hash,
+				unsigned depth) const;
+		bool isNamed(Key key, const std::string& name) const;
+		uint32_t findValue(Key key, const std::string& name) const;
+		void read(uint32_t offset, Value& value) const;
+		[[noreturn]] void corrupt() const;
+
+		size_t capacity(uint32_t offset) const;
+		uint8_t* modify(size_t pos, size_t len);
+		void put32(size_t pos, uint32_t value);
+		uint32_t addValue(Key key, const std::string& name);
+		uint32_t allocate(size_t size);
+		void deallocate(uint32_t offset);
+		void addBin(size_t size);
+		void grow(size_t end);
+		FreeCells& freeCells();
+		void writeBaseBlock(bool sync = true);
+		void writePages();
+		void appendLog();
+		bool replayLog(const std::string& filename);
+
+		std::string _filename;
+		int _fd;
+		bool _writable;
+		uint8_t* _data;
+		size_t _size;
+		size_t _mapped;
+		size_t _reserved;
+		size_t _end;
+		unsigned _minor;
+		Key _root;
+
+		// Indexes of modified 4 KiB pages, other than the base block
+		std::set<size_t> _dirty;
+		// Pages whose current contents are in the transaction log
+		std::set<size_t> _logged;
+		// Log that the hive depends on, if it is dirty
+		std::string _log;
+		uint64_t _logEnd;
+		uint32_t _logSequence;
+		// Offset and size of free cells, found on the first allocation
+		std::unique_ptr<FreeCells> _free;
+	};
+}
+#endif
@@ -0,0 +1,89 @@
+#include "thread_pool.h"
+using namespace std;
+
+namespace letterman {
+	ThreadPool::ThreadPool(unsigned threads)
+	: _busy(0), _stop(false)
+	{
+		if (!threads) threads = defaultSize();
+
+		for (unsigned i = 0; i != threads; ++i) {
+			_threads.emplace_back(&ThreadPool::run, this);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			lock_guard<mutex> guard(_lock);
+			_stop = true;
+		}
+
+		_taskAvailable.notify_all();
+
+		for (auto& t : _threads) {
+			t.join();
+		}
+	}
+
+	unsigned ThreadPool::defaultSize()
+	{
+		unsigned n = thread::hardware_concurrency();
+		return n ? n : 1;
+	}
+
+	void ThreadPool::post(const Task& task)
+	{
+		{
+			lock_guard<mutex> guard(_lock);
+			_tasks.push_back(task);
+		}
+
+		_taskAvailable.notify_one();
+	}
+
+	void ThreadPool::wait()
+	{
+		unique_lock<mutex> guard(_lock);
+		_idle.wait(guard, [this] () { return _tasks.empty() && !_busy; });
+
+		if (_error) {
+			exception_ptr error(_error);
+			_error = nullptr;
+			rethrow_exception(error);
+		}
+	}
+
+	void ThreadPool::run()
+	{
+		unique_lock<mutex> guard(_lock);
+
+		while (true) {
+			_taskAvailable.wait(guard, [this] () {
+					return _stop || !_tasks.empty(); });
+
+			// Drain the queue before stopping
+			if (_tasks.empty()) return;
+
+			Task task(move(_tasks.front()));
+			_tasks.pop_front();
+			++_busy;
+
+			guard.unlock();
+
+			try {
+				task();
+			} catch (...) {
+				guard.lock();
+				if (!_error) _error = current_exception();
+				guard.unlock();
+			}
+
+			guard.lock();
+
+			if (!--_busy && _tasks.empty()) {
+				_idle.notify_all();
+			}
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef LETTERMAN_THREAD_POOL_H
+#define LETTERMAN_THREAD_POOL_H
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <deque>
+
+namespace letterman {
+	class ThreadPool
+	{
+		public:
+		typedef std::function<void()> Task;
+
+		// Zero threads means one thread per CPU
+		explicit ThreadPool(unsigned threads = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		void post(const Task& task);
+
+		// Waits until all tasks posted so far have finished. If a task
+		// threw, the first exception is rethrown here.
+		void wait();
+
+		unsigned size() const
+		{ return _threads.size(); }
+
+		static unsigned defaultSize();
+
+		private:
+		void run();
+
+		std::vector<std::thread> _threads;
+		std::deque<Task> _tasks;
+		std::mutex _lock;
+		std::condition_variable _taskAvailable;
+		std::condition_variable _idle;
+		std::exception_ptr _error;
+		unsigned _busy;
+		bool _stop;
+	};
+}
+#endif
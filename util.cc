@@ -1,3 +1,6 @@
+#include <unistd.h>
+#include <cerrno>
+#include "endian.h"
 #include "util.h"
 using namespace std;
 
@@ -41,6 +44,68 @@ namespace letterman {
 			return str;
 		}
 
+		bool preadAll(int fd, uint64_t offset, void* buf, size_t len)
+		{
+			char* p = static_cast<char*>(buf);
+
+			while (len) {
+				ssize_t n = pread(fd, p, len, offset);
+				if (n <= 0) {
+					if (n < 0 && errno == EINTR) continue;
+					return false;
+				}
+
+				p += n;
+				offset += n;
+				len -= n;
+			}
+
+			return true;
+		}
+
+		bool pwriteAll(int fd, uint64_t offset, const void* buf, size_t len)
+		{
+			const char* p = static_cast<const char*>(buf);
+
+			while (len) {
+				ssize_t n = pwrite(fd, p, len, offset);
+				if (n <= 0) {
+					if (n < 0 && errno == EINTR) continue;
+					return false;
+				}
+
+				p += n;
+				offset += n;
+				len -= n;
+			}
+
+			return true;
+		}
+
+		string guidToString(const void* guid)
+		{
+			const char* p = static_cast<const char*>(guid);
+			uint32_t a, b, c;
+
+			memcpy(&a, p, 4);
+			a = le32toh(a);
+			b = le16toh(*reinterpret_cast<const uint16_t*>(p + 4));
+			c = le16toh(*reinterpret_cast<const uint16_t*>(p + 6));
+
+			ostringstream ostr;
+			ostr << uppercase << hex << setfill('0');
+			ostr << setw(8) << a << "-";
+			ostr << setw(4) << b << "-";
+			ostr << setw(4) << c << "-";
+
+			for (int i = 8; i != 16; ++i) {
+				if (i == 10) ostr << "-";
+				ostr << setw(2) << (p[i] & 0xff);
+			}
+
+			return ostr.str();
+		}
+
 		string& rtrim(string& str)
 		{
 			string::size_type i = str.find_last_not_of(" \t\r\n");
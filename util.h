@@ -4,8 +4,11 @@
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
+#include <functional>
 #include <sstream>
 #include <memory>
+#include <stdint.h>
+#include <cstring>
 #include <string>
 #include <cctype>
 
@@ -26,7 +29,7 @@ namespace letterman {
 			}
 
 			private:
-			const T& _function;
+			T _function;
 		};
 
 		template<typename T> static Cleaner<T> createCleaner(
@@ -35,6 +38,78 @@ namespace letterman {
 			return Cleaner<T>(function);
 		}
 
+		// Non-owning reference to a string, which is not necessarily
+		// NUL-terminated.
+		class StringRef
+		{
+			public:
+			StringRef()
+			: _data(""), _size(0) {}
+
+			StringRef(const char* data, size_t size)
+			: _data(data), _size(size) {}
+
+			StringRef(const char* str)
+			: _data(str), _size(std::strlen(str)) {}
+
+			StringRef(const std::string& str)
+			: _data(str.data()), _size(str.size()) {}
+
+			const char* data() const
+			{ return _data; }
+
+			size_t size() const
+			{ return _size; }
+
+			bool empty() const
+			{ return !_size; }
+
+			std::string str() const
+			{ return std::string(_data, _size); }
+
+			operator std::string() const
+			{ return str(); }
+
+			friend bool operator==(const StringRef& a, const StringRef& b)
+			{
+				return a._size == b._size
+					&& !std::memcmp(a._data, b._data, a._size);
+			}
+
+			friend bool operator!=(const StringRef& a, const StringRef& b)
+			{ return !(a == b); }
+
+			friend bool operator<(const StringRef& a, const StringRef& b)
+			{
+				int cmp = std::memcmp(a._data, b._data,
+						std::min(a._size, b._size));
+				return cmp ? cmp < 0 : a._size < b._size;
+			}
+
+			friend std::ostream& operator<<(std::ostream& os,
+					const StringRef& str)
+			{ return os.write(str._data, str._size); }
+
+			// FNV-1a
+			struct Hash
+			{
+				size_t operator()(const StringRef& str) const
+				{
+					uint64_t h = UINT64_C(0xcbf29ce484222325);
+					for (size_t i = 0; i != str._size; ++i) {
+						h = (h ^ static_cast<uint8_t>(str._data[i]))
+							* UINT64_C(0x100000001b3);
+					}
+
+					return h;
+				}
+			};
+
+			private:
+			const char* _data;
+			size_t _size;
+		};
+
 		template<typename T> std::string toString(const T& t)
 		{
 			std::ostringstream ostr;
@@ -59,6 +134,17 @@ namespace letterman {
 		std::string& replaceAll(std::string& str, char from, char to);
 		std::string& rtrim(std::string& str);
 
+		// Like pread(2), but retries until all bytes have been read.
+		// Returns false on errors and on EOF.
+		bool preadAll(int fd, uint64_t offset, void* buf, size_t len);
+
+		// Like pwrite(2), but retries until all bytes have been written
+		bool pwriteAll(int fd, uint64_t offset, const void* buf, size_t len);
+
+		// Formats a binary GUID (as used by Windows and GPT, i.e. with
+		// the first three fields little-endian) in upper case.
+		std::string guidToString(const void* guid);
+
 		inline void capitalize(std::string& str)
 		{
 			std::transform(str.begin(), str.end(), str.begin(), ::toupper);